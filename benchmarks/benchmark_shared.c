@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
@@ -42,6 +43,222 @@
 #include "shared.h"
 #include "benchmark_shared.h"
 
+#define FT_LAT_BATCH 64
+
+static struct ft_hist op_lat;
+
+static int ft_hist_index(uint64_t nsec)
+{
+	int msb;
+
+	if (nsec < 2 * FT_HIST_SUB)
+		return (int) nsec;
+
+	msb = 63 - __builtin_clzll(nsec);
+	return (msb - FT_HIST_SUB_BITS + 1) * FT_HIST_SUB +
+		(int) ((nsec >> (msb - FT_HIST_SUB_BITS)) - FT_HIST_SUB);
+}
+
+static uint64_t ft_hist_low(int index)
+{
+	int shift;
+
+	if (index < 2 * FT_HIST_SUB)
+		return index;
+
+	shift = index / FT_HIST_SUB - 1;
+	return (uint64_t) (FT_HIST_SUB + index % FT_HIST_SUB) << shift;
+}
+
+void ft_hist_reset(struct ft_hist *hist)
+{
+	memset(hist, 0, sizeof *hist);
+	hist->min = UINT64_MAX;
+}
+
+void ft_hist_add(struct ft_hist *hist, uint64_t nsec)
+{
+	hist->bucket[ft_hist_index(nsec)]++;
+	hist->count++;
+	hist->sum += nsec;
+	if (nsec < hist->min)
+		hist->min = nsec;
+	if (nsec > hist->max)
+		hist->max = nsec;
+}
+
+void ft_hist_merge(struct ft_hist *dst, const struct ft_hist *src)
+{
+	int i;
+
+	for (i = 0; i < FT_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Returns the midpoint of the bucket holding the requested percentile */
+uint64_t ft_hist_percentile(const struct ft_hist *hist, double pct)
+{
+	uint64_t target, seen = 0, low, high;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	target = (uint64_t) (pct / 100.0 * hist->count + 0.5);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < FT_HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= target)
+			break;
+	}
+
+	low = ft_hist_low(i);
+	high = i + 1 < FT_HIST_BUCKETS ? ft_hist_low(i + 1) : hist->max;
+	low += (high - low) / 2;
+	return MAX(MIN(low, hist->max), hist->min);
+}
+
+/*
+ * Prints min/avg/percentiles and the sample distribution collapsed to one
+ * row per power of two.  Times are reported in usec.
+ */
+void ft_hist_show(const char *name, const struct ft_hist *hist)
+{
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+	static const char *pct_str[] = { "p50", "p90", "p99", "p99.9" };
+	uint64_t cnt;
+	int i, j;
+
+	if (!hist->count) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	if (opts.machr) {
+		printf("- { latency: %s, count: %" PRIu64 ", min: %f, avg: %f",
+			name, hist->count, hist->min / 1000.0,
+			(double) hist->sum / hist->count / 1000.0);
+		for (i = 0; i < ARRAY_SIZE(pcts); i++)
+			printf(", %s: %f", pct_str[i],
+				ft_hist_percentile(hist, pcts[i]) / 1000.0);
+		printf(", max: %f, hist: {", hist->max / 1000.0);
+	} else {
+		printf("%s latency (usec): count %" PRIu64 " min %.2f avg %.2f",
+			name, hist->count, hist->min / 1000.0,
+			(double) hist->sum / hist->count / 1000.0);
+		for (i = 0; i < ARRAY_SIZE(pcts); i++)
+			printf(" %s %.2f", pct_str[i],
+				ft_hist_percentile(hist, pcts[i]) / 1000.0);
+		printf(" max %.2f\n", hist->max / 1000.0);
+		printf("  %-16s%12s%9s\n", "usec >=", "count", "%");
+	}
+
+	for (i = 0, j = 0; i < FT_HIST_BUCKETS; i = j) {
+		/* collapse buckets sharing the same power of two */
+		for (j = i + 1, cnt = hist->bucket[i];
+		     j < FT_HIST_BUCKETS && ft_hist_low(j) < 2 * MAX(ft_hist_low(i), 1);
+		     j++)
+			cnt += hist->bucket[j];
+		if (!cnt)
+			continue;
+
+		if (opts.machr)
+			printf(" %g: %" PRIu64 ",", ft_hist_low(i) / 1000.0, cnt);
+		else
+			printf("  %-16.3f%12" PRIu64 "%8.2f%%\n",
+				ft_hist_low(i) / 1000.0, cnt,
+				100.0 * cnt / hist->count);
+	}
+
+	if (opts.machr)
+		printf(" } }\n");
+}
+
+/*
+ * Parses a comma separated list of at most max integers in [lo, hi] for
+ * the sweep options.
+ */
+int ft_parse_int_list(const char *str, int *list, int *cnt, int max,
+		int lo, int hi)
+{
+	char *end;
+	long val;
+
+	for (*cnt = 0; *str; str = end) {
+		val = strtol(str, &end, 0);
+		if (end == str || val < lo || val > hi || *cnt == max)
+			return -FI_EINVAL;
+		list[(*cnt)++] = (int) val;
+		if (*end == ',')
+			end++;
+	}
+	return *cnt ? 0 : -FI_EINVAL;
+}
+
+/*
+ * Sets the bit of each of the cnt names that matches str in mask, or all
+ * of them for "all".
+ */
+int ft_parse_mask(const char *str, const char **names, int cnt, int *mask)
+{
+	int i;
+
+	for (*mask = 0, i = 0; i < cnt; i++) {
+		if (!strcmp(str, names[i]) || !strcmp(str, "all"))
+			*mask |= 1 << i;
+	}
+	return *mask ? 0 : -FI_EINVAL;
+}
+
+/* Checks that a transfer_size message fits in one receive buffer */
+int ft_check_rx_fit(const char *what)
+{
+	if (rx_size - ft_rx_prefix_size() < (size_t) opts.transfer_size) {
+		FT_ERR("%s does not fit in the provider's max_msg_size", what);
+		return -FI_EINVAL;
+	}
+	return 0;
+}
+
+const char *ft_iov_layout_str[] = {
+	[FT_IOV_STRIDED] = "strided",
+	[FT_IOV_IRREGULAR] = "irregular",
+};
+
+/*
+ * Splits about cnt * seg bytes of payload over cnt segments of buf.  Each
+ * segment is followed by a gap of its own length, like one face of a halo
+ * exchange.  Strided segments are all seg bytes.  Irregular segments are
+ * weighted by their position in the iovec, like the ubertest formatters.
+ * Returns the payload size.  buf must hold twice the payload size.
+ */
+size_t ft_format_iov_layout(struct iovec *iov, size_t cnt, char *buf,
+		size_t seg, enum ft_iov_layout layout)
+{
+	size_t i, len, offset, total = 0;
+
+	for (i = 0, offset = 0; i < cnt; i++) {
+		if (layout == FT_IOV_IRREGULAR)
+			len = MAX(2 * seg * (i + 1) / (cnt + 1), 1);
+		else
+			len = seg;
+
+		iov[i].iov_base = buf + offset;
+		iov[i].iov_len = len;
+		offset += 2 * len;
+		total += len;
+	}
+	return total;
+}
+
 void ft_parse_benchmark_opts(int op, char *optarg)
 {
 	switch (op) {
@@ -57,12 +274,21 @@ void ft_parse_benchmark_opts(int op, char *optarg)
 	case 'W':
 		opts.window_size = atoi(optarg);
 		break;
+	case 'q':
+		opts.options |= FT_OPT_QUEUE_STATS;
+		break;
+	case 'L':
+		opts.options |= FT_OPT_OP_LATENCY;
+		/* completions are reaped in batches for their op_context */
+		if (cq_attr.format == FI_CQ_FORMAT_UNSPEC)
+			cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+		break;
 	default:
 		break;
 	}
 }
 
-void ft_benchmark_usage(void)
+void ft_benchmark_base_usage(void)
 {
 	FT_PRINT_OPTS_USAGE("-v", "enables data_integrity checks");
 	FT_PRINT_OPTS_USAGE("-P", "enable prefix mode");
@@ -73,10 +299,35 @@ void ft_benchmark_usage(void)
 			"# of iterations > window size");
 }
 
+void ft_benchmark_usage(void)
+{
+	ft_benchmark_base_usage();
+	FT_PRINT_OPTS_USAGE("-q", "report post retries, CQ polls and "
+			"fi_tx/rx_size_left samples after each test");
+	FT_PRINT_OPTS_USAGE("-L", "report post-to-completion latency of "
+			"each windowed send (fi_msg_bw and fi_rdm_tagged_bw "
+			"only, disables inject)");
+}
+
+/* Only bandwidth() times individual operations */
+static int ft_check_op_latency(const char *test)
+{
+	if (opts.options & FT_OPT_OP_LATENCY) {
+		FT_ERR("-L is not supported by %s", test);
+		return -FI_EINVAL;
+	}
+	return 0;
+}
+
 int ft_bw_init(void)
 {
+	if ((opts.options & FT_OPT_OP_LATENCY) && !txcq) {
+		FT_ERR("per-operation latency requires a TX completion queue");
+		return -FI_EINVAL;
+	}
+
 	if (opts.window_size > 0) {
-		tx_ctx_arr = calloc(opts.window_size, sizeof(struct fi_context));
+		tx_ctx_arr = calloc(opts.window_size, sizeof(*tx_ctx_arr));
 		if (!tx_ctx_arr)
 			return -FI_ENOMEM;
 	}
@@ -87,6 +338,10 @@ int pingpong(void)
 {
 	int ret, i;
 
+	ret = ft_check_op_latency("pingpong tests");
+	if (ret)
+		return ret;
+
 	ret = ft_sync();
 	if (ret)
 		return ret;
@@ -132,6 +387,9 @@ int pingpong(void)
 	else
 		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end, 2);
 
+	if (opts.options & FT_OPT_QUEUE_STATS)
+		ft_show_queue_stats();
+
 	return 0;
 }
 
@@ -145,6 +403,42 @@ static int bw_tx_comp()
 	return ft_rx(ep, 4);
 }
 
+/*
+ * Reap the window in batches and charge each send the time between its
+ * post and the moment its completion was read.  Sends completed by FT_POST
+ * while retrying -FI_EAGAIN are drained there and not sampled.
+ */
+static int bw_tx_comp_lat(void)
+{
+	struct fi_cq_entry comp[FT_LAT_BATCH];
+	struct ft_context *ctx;
+	struct timespec now;
+	ssize_t i, ret;
+
+	while (tx_cq_cntr < tx_seq) {
+		ret = fi_cq_read(txcq, comp, MIN(tx_seq - tx_cq_cntr, FT_LAT_BATCH));
+		if (ret > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			for (i = 0; i < ret; i++) {
+				ctx = comp[i].op_context;
+				if (opts.options & FT_OPT_ACTIVE)
+					ft_hist_add(&op_lat, get_elapsed(&ctx->post,
+							&now, NANO));
+			}
+			tx_cq_cntr += ret;
+		} else if (ret == -FI_EAVAIL) {
+			ret = ft_cq_readerr(txcq);
+			tx_cq_cntr++;
+			return ret;
+		} else if (ret != -FI_EAGAIN) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return ret;
+		}
+	}
+
+	return ft_rx(ep, 4);
+}
+
 static int bw_rx_comp()
 {
 	int ret;
@@ -172,26 +466,36 @@ int bandwidth(void)
 	 * bandwidth.  */
 
 	if (opts.dst_addr) {
+		ft_hist_reset(&op_lat);
 		for (i = j = 0; i < opts.iterations + opts.warmup_iterations; i++) {
 			if (i == opts.warmup_iterations)
 				ft_start();
 
-			if (opts.transfer_size < fi->tx_attr->inject_size)
+			if (opts.options & FT_OPT_OP_LATENCY) {
+				clock_gettime(CLOCK_MONOTONIC, &tx_ctx_arr[j].post);
+				ret = ft_post_tx(ep, remote_fi_addr, opts.transfer_size,
+						 &tx_ctx_arr[j].context);
+			} else if (opts.transfer_size < fi->tx_attr->inject_size) {
 				ret = ft_inject(ep, opts.transfer_size);
-			else
+			} else {
 				ret = ft_post_tx(ep, remote_fi_addr, opts.transfer_size,
-						 &tx_ctx_arr[j]);
+						 &tx_ctx_arr[j].context);
+			}
 			if (ret)
 				return ret;
 
 			if (++j == opts.window_size) {
-				ret = bw_tx_comp();
+				if (opts.options & FT_OPT_QUEUE_STATS)
+					ft_sample_queue_depth(ep);
+				ret = (opts.options & FT_OPT_OP_LATENCY) ?
+					bw_tx_comp_lat() : bw_tx_comp();
 				if (ret)
 					return ret;
 				j = 0;
 			}
 		}
-		ret = bw_tx_comp();
+		ret = (opts.options & FT_OPT_OP_LATENCY) ?
+			bw_tx_comp_lat() : bw_tx_comp();
 		if (ret)
 			return ret;
 	} else {
@@ -199,11 +503,14 @@ int bandwidth(void)
 			if (i == opts.warmup_iterations)
 				ft_start();
 
-			ret = ft_post_rx(ep, opts.transfer_size, &tx_ctx_arr[j]);
+			ret = ft_post_rx(ep, opts.transfer_size,
+					 &tx_ctx_arr[j].context);
 			if (ret)
 				return ret;
 
 			if (++j == opts.window_size) {
+				if (opts.options & FT_OPT_QUEUE_STATS)
+					ft_sample_queue_depth(ep);
 				ret = bw_rx_comp();
 				if (ret)
 					return ret;
@@ -222,6 +529,12 @@ int bandwidth(void)
 	else
 		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end, 1);
 
+	if ((opts.options & FT_OPT_OP_LATENCY) && opts.dst_addr)
+		ft_hist_show("post_to_comp", &op_lat);
+
+	if (opts.options & FT_OPT_QUEUE_STATS)
+		ft_show_queue_stats();
+
 	return 0;
 }
 
@@ -248,6 +561,10 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 {
 	int ret, i, j;
 
+	ret = ft_check_op_latency("RMA bandwidth tests");
+	if (ret)
+		return ret;
+
 	ret = ft_sync();
 	if (ret)
 		return ret;
@@ -263,12 +580,12 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 						opts.transfer_size, remote);
 			} else {
 				ret = ft_post_rma(rma_op, ep, opts.transfer_size,
-						remote,	&tx_ctx_arr[j]);
+						remote,	&tx_ctx_arr[j].context);
 			}
 			break;
 		case FT_RMA_WRITEDATA:
 			if (!opts.dst_addr) {
-				ret = ft_post_rx(ep, 0, &tx_ctx_arr[j]);
+				ret = ft_post_rx(ep, 0, &tx_ctx_arr[j].context);
 			} else {
 				if (opts.transfer_size < fi->tx_attr->inject_size) {
 					ret = ft_post_rma_inject(FT_RMA_WRITEDATA,
@@ -279,13 +596,13 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 					ret = ft_post_rma(FT_RMA_WRITEDATA,
 							ep,
 							opts.transfer_size,
-							remote,	&tx_ctx_arr[j]);
+							remote,	&tx_ctx_arr[j].context);
 				}
 			}
 			break;
 		case FT_RMA_READ:
 			ret = ft_post_rma(FT_RMA_READ, ep, opts.transfer_size,
-					remote,	&tx_ctx_arr[j]);
+					remote,	&tx_ctx_arr[j].context);
 			break;
 		default:
 			FT_ERR("Unknown RMA op type\n");
@@ -295,6 +612,8 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 			return ret;
 
 		if (++j == opts.window_size) {
+			if (opts.options & FT_OPT_QUEUE_STATS)
+				ft_sample_queue_depth(ep);
 			ret = bw_rma_comp(rma_op);
 			if (ret)
 				return ret;
@@ -311,5 +630,105 @@ int bandwidth_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
 				opts.argc, opts.argv);
 	else
 		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end, 1);
+
+	if (opts.options & FT_OPT_QUEUE_STATS)
+		ft_show_queue_stats();
+	return 0;
+}
+
+/*
+ * Write ping-pong completes when the last byte of the receive buffer
+ * changes, so it relies on the provider placing the payload in order.
+ */
+static int pingpong_rma_flag_wait(uint8_t flag)
+{
+	volatile uint8_t *last = (uint8_t *) rx_buf + ft_rx_prefix_size() +
+				 opts.transfer_size - 1;
+
+	while (*last != flag)
+		;
+	return 0;
+}
+
+static int pingpong_rma_post(enum ft_rma_opcodes rma_op,
+		struct fi_rma_iov *remote, uint8_t flag)
+{
+	int ret;
+
+	if (rma_op == FT_RMA_WRITE)
+		((uint8_t *) tx_buf)[opts.transfer_size - 1] = flag;
+
+	if (opts.transfer_size < fi->tx_attr->inject_size)
+		ret = ft_post_rma_inject(rma_op, ep, opts.transfer_size, remote);
+	else
+		ret = ft_post_rma(rma_op, ep, opts.transfer_size, remote,
+				&tx_ctx);
+	return ret;
+}
+
+static int pingpong_rma_wait(enum ft_rma_opcodes rma_op, uint8_t flag)
+{
+	if (rma_op == FT_RMA_WRITEDATA)
+		return ft_rx(ep, 0);
+	return pingpong_rma_flag_wait(flag);
+}
+
+int pingpong_rma(enum ft_rma_opcodes rma_op, struct fi_rma_iov *remote)
+{
+	uint8_t flag;
+	int ret, i;
+
+	ret = ft_check_op_latency("pingpong tests");
+	if (ret)
+		return ret;
+
+	((uint8_t *) rx_buf)[ft_rx_prefix_size() + opts.transfer_size - 1] = 0;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	for (i = 0; i < opts.iterations + opts.warmup_iterations; i++) {
+		if (i == opts.warmup_iterations)
+			ft_start();
+
+		flag = (uint8_t) (i % 255 + 1);
+		if (rma_op == FT_RMA_READ) {
+			if (!opts.dst_addr)
+				continue;
+			ret = ft_post_rma(FT_RMA_READ, ep, opts.transfer_size,
+					remote, &tx_ctx);
+		} else if (opts.dst_addr) {
+			ret = pingpong_rma_post(rma_op, remote, flag);
+			if (!ret)
+				ret = pingpong_rma_wait(rma_op, flag);
+		} else {
+			ret = pingpong_rma_wait(rma_op, flag);
+			if (!ret)
+				ret = pingpong_rma_post(rma_op, remote, flag);
+		}
+		if (ret)
+			return ret;
+
+		ret = ft_get_tx_comp(tx_seq);
+		if (ret)
+			return ret;
+	}
+	ft_stop();
+
+	/* Reads report the full round trip, writes half of it */
+	if (rma_op == FT_RMA_READ && !opts.dst_addr)
+		return 0;
+
+	if (opts.machr)
+		show_perf_mr(opts.transfer_size, opts.iterations, &start, &end,
+				rma_op == FT_RMA_READ ? 1 : 2,
+				opts.argc, opts.argv);
+	else
+		show_perf(NULL, opts.transfer_size, opts.iterations, &start, &end,
+				rma_op == FT_RMA_READ ? 1 : 2);
+
+	if (opts.options & FT_OPT_QUEUE_STATS)
+		ft_show_queue_stats();
 	return 0;
 }
@@ -39,16 +39,70 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 
-#define BENCHMARK_OPTS "vPj:W:"
+/* Tests with their own loops take BENCHMARK_BASE_OPTS */
+#define BENCHMARK_BASE_OPTS "vPj:W:"
+#define BENCHMARK_OPTS BENCHMARK_BASE_OPTS "qL"
 #define FT_BENCHMARK_MAX_MSG_SIZE (test_size[TEST_CNT - 1].size)
 
+/*
+ * Log-linear histogram of nanosecond samples.  Values below
+ * 2 * FT_HIST_SUB get their own bucket, larger values are split into
+ * FT_HIST_SUB buckets per power of two (~12% resolution).
+ */
+#define FT_HIST_SUB_BITS	3
+#define FT_HIST_SUB		(1 << FT_HIST_SUB_BITS)
+#define FT_HIST_BUCKETS		(64 * FT_HIST_SUB)
+
+struct ft_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[FT_HIST_BUCKETS];
+};
+
+void ft_hist_reset(struct ft_hist *hist);
+void ft_hist_add(struct ft_hist *hist, uint64_t nsec);
+void ft_hist_merge(struct ft_hist *dst, const struct ft_hist *src);
+uint64_t ft_hist_percentile(const struct ft_hist *hist, double pct);
+void ft_hist_show(const char *name, const struct ft_hist *hist);
+
+static inline int64_t ft_gettime_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int ft_parse_int_list(const char *str, int *list, int *cnt, int max,
+		int lo, int hi);
+int ft_parse_mask(const char *str, const char **names, int cnt, int *mask);
+int ft_check_rx_fit(const char *what);
+
+enum ft_iov_layout {
+	FT_IOV_STRIDED,
+	FT_IOV_IRREGULAR,
+	FT_IOV_LAYOUT_MAX,
+};
+
+extern const char *ft_iov_layout_str[];
+
+size_t ft_format_iov_layout(struct iovec *iov, size_t cnt, char *buf,
+		size_t seg, enum ft_iov_layout layout);
+
 void ft_parse_benchmark_opts(int op, char *optarg);
+void ft_benchmark_base_usage(void);
 void ft_benchmark_usage(void);
 int ft_bw_init(void);
 int pingpong(void);
 int bandwidth(void);
 int bandwidth_rma(enum ft_rma_opcodes op, struct fi_rma_iov *remote);
+int pingpong_rma(enum ft_rma_opcodes op, struct fi_rma_iov *remote);
 
 #ifdef __cplusplus
 }
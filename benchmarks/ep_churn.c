@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Endpoint and domain create/destroy churn.
+ *
+ * Each thread owns a CQ, an AV (or an EQ for MSG endpoints) and repeats
+ * one cycle -I times.  The ep cycle opens an endpoint, binds it to those
+ * objects, enables it and closes it.  The domain cycle opens a domain
+ * with a CQ and an AV on it and closes all three.  Thread counts come from
+ * -T.  An untimed pass of a tenth of the cycles runs first so that
+ * one-time provider allocations are not counted as growth.  Each step
+ * reports the aggregate cycle rate, the per-cycle latency and the RSS
+ * growth across the timed pass.  Growth that keeps scaling with -I
+ * points at a leak.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_eq.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define CH_MAX_LIST	16
+
+enum ch_target {
+	CH_EP,
+	CH_DOMAIN,
+	CH_TARGET_MAX,
+};
+
+static const char *ch_target_str[] = {
+	[CH_EP] = "ep",
+	[CH_DOMAIN] = "domain",
+};
+
+struct ch_thread {
+	int id;
+	pthread_t thread;
+	enum ch_target target;
+	struct fid_cq *cq;
+	struct fid_av *av;
+	struct fid_eq *eq;
+	int cycles;
+
+	int64_t elapsed;
+	struct ft_hist lat;
+	int ret;
+};
+
+static int thread_cnts[CH_MAX_LIST] = { 1, 2, 4, 8 }, thread_cnt_cnt = 4;
+static int target_mask = (1 << CH_TARGET_MAX) - 1;
+static struct ch_thread *threads;
+static volatile int go;
+
+static int ch_open_cq(struct fid_domain *dom, struct fid_cq **cq)
+{
+	struct fi_cq_attr attr = {
+		.format = FI_CQ_FORMAT_CONTEXT,
+		.wait_obj = FI_WAIT_NONE,
+		.size = fi->tx_attr->size + fi->rx_attr->size,
+	};
+	int ret;
+
+	ret = fi_cq_open(dom, &attr, cq, NULL);
+	if (ret)
+		FT_PRINTERR("fi_cq_open", ret);
+	return ret;
+}
+
+static int ch_open_av(struct fid_domain *dom, struct fid_av **av)
+{
+	int ret;
+
+	if (fi->ep_attr->type == FI_EP_MSG)
+		return 0;
+
+	ret = fi_av_open(dom, &av_attr, av, NULL);
+	if (ret)
+		FT_PRINTERR("fi_av_open", ret);
+	return ret;
+}
+
+static int ch_open(struct ch_thread *th)
+{
+	int ret;
+
+	if (th->target != CH_EP)
+		return 0;
+
+	ret = ch_open_cq(domain, &th->cq);
+	if (ret)
+		return ret;
+
+	ret = ch_open_av(domain, &th->av);
+	if (ret)
+		return ret;
+
+	if (fi->ep_attr->type == FI_EP_MSG) {
+		ret = fi_eq_open(fabric, &eq_attr, &th->eq, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_eq_open", ret);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void ch_close(int n)
+{
+	int i;
+
+	for (i = 0; threads && i < n; i++) {
+		FT_CLOSE_FID(threads[i].av);
+		FT_CLOSE_FID(threads[i].cq);
+		FT_CLOSE_FID(threads[i].eq);
+	}
+	free(threads);
+	threads = NULL;
+}
+
+static int ch_ep_cycle(struct ch_thread *th)
+{
+	struct fid_ep *cep;
+	int ret, err;
+
+	ret = fi_endpoint(domain, fi, &cep, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_endpoint", ret);
+		return ret;
+	}
+
+	/* Not FT_EP_BIND: a failed cycle must still close the endpoint */
+	if (th->eq) {
+		ret = fi_ep_bind(cep, &th->eq->fid, 0);
+		if (ret) {
+			FT_PRINTERR("fi_ep_bind", ret);
+			goto close;
+		}
+	}
+	if (th->av) {
+		ret = fi_ep_bind(cep, &th->av->fid, 0);
+		if (ret) {
+			FT_PRINTERR("fi_ep_bind", ret);
+			goto close;
+		}
+	}
+	ret = fi_ep_bind(cep, &th->cq->fid, FI_TRANSMIT | FI_RECV);
+	if (ret) {
+		FT_PRINTERR("fi_ep_bind", ret);
+		goto close;
+	}
+
+	ret = fi_enable(cep);
+	if (ret)
+		FT_PRINTERR("fi_enable", ret);
+
+close:
+	err = fi_close(&cep->fid);
+	if (err) {
+		FT_PRINTERR("fi_close", err);
+		if (!ret)
+			ret = err;
+	}
+	return ret;
+}
+
+static int ch_domain_cycle(void)
+{
+	struct fid_domain *dom;
+	struct fid_cq *cq = NULL;
+	struct fid_av *av = NULL;
+	int ret;
+
+	ret = fi_domain(fabric, fi, &dom, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_domain", ret);
+		return ret;
+	}
+
+	ret = ch_open_cq(dom, &cq);
+	if (!ret)
+		ret = ch_open_av(dom, &av);
+
+	FT_CLOSE_FID(av);
+	FT_CLOSE_FID(cq);
+	FT_CLOSE_FID(dom);
+	return ret;
+}
+
+static void *ch_thread(void *arg)
+{
+	struct ch_thread *th = arg;
+	int64_t start, t;
+	int i;
+
+	while (!go)
+		;
+
+	start = ft_gettime_ns();
+	for (i = 0; i < th->cycles; i++) {
+		t = ft_gettime_ns();
+		th->ret = th->target == CH_EP ? ch_ep_cycle(th) :
+			  ch_domain_cycle();
+		if (th->ret)
+			break;
+		ft_hist_add(&th->lat, ft_gettime_ns() - t);
+	}
+	th->elapsed = ft_gettime_ns() - start;
+	return NULL;
+}
+
+static int ch_run(int n, int cycles)
+{
+	int i, ret = 0;
+
+	go = 0;
+	for (i = 0; i < n; i++) {
+		threads[i].cycles = cycles;
+		threads[i].ret = 0;
+		ft_hist_reset(&threads[i].lat);
+		ret = pthread_create(&threads[i].thread, NULL, ch_thread,
+				     &threads[i]);
+		if (ret) {
+			FT_PRINTERR("pthread_create", ret);
+			n = i;
+			ret = -ret;
+			break;
+		}
+	}
+
+	go = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (!ret)
+			ret = threads[i].ret;
+	}
+	return ret;
+}
+
+static void ch_show(enum ch_target target, int n, long long rss)
+{
+	struct ft_hist lat;
+	int64_t elapsed = 0;
+	double rate;
+	char name[FT_STR_LEN];
+	int i;
+
+	ft_hist_reset(&lat);
+	for (i = 0; i < n; i++) {
+		elapsed = MAX(elapsed, threads[i].elapsed);
+		ft_hist_merge(&lat, &threads[i].lat);
+	}
+
+	rate = (double) n * opts.iterations * 1e9 / elapsed;
+	if (opts.machr)
+		printf("- { target: %s, threads: %d, cycles: %d, ops/sec: %f, "
+			"rss_growth: %lld, bytes_per_op: %f }\n",
+			ch_target_str[target], n, opts.iterations, rate, rss,
+			(double) rss / n / opts.iterations);
+	else
+		printf("%-6s %3d threads: %10.1f ops/sec, RSS growth %lld KB "
+			"(%.2f bytes/op)\n", ch_target_str[target], n, rate,
+			rss / 1024, (double) rss / n / opts.iterations);
+
+	snprintf(name, sizeof name, "%s_t%d", ch_target_str[target], n);
+	ft_hist_show(name, &lat);
+}
+
+static int run_step(enum ch_target target, int n)
+{
+	long long rss;
+	int i, ret;
+
+	threads = calloc(n, sizeof *threads);
+	if (!threads)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		threads[i].id = i;
+		threads[i].target = target;
+		ret = ch_open(&threads[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = ch_run(n, MAX(opts.iterations / 10, 1));
+	if (ret)
+		goto out;
+
+	rss = ft_rss();
+	ret = ch_run(n, opts.iterations);
+	if (ret)
+		goto out;
+	rss = ft_rss() - rss;
+
+	ch_show(target, n, rss);
+out:
+	ch_close(n);
+	return ret;
+}
+
+static int run(void)
+{
+	enum ch_target target;
+	int i, ret;
+
+	ret = ft_getinfo(hints, &fi);
+	if (ret)
+		return ret;
+
+	ret = ft_open_fabric_res();
+	if (ret)
+		return ret;
+
+	if (!opts.machr)
+		printf("provider %s, %s endpoints, threading %d\n",
+			fi->fabric_attr->prov_name,
+			fi->ep_attr->type == FI_EP_MSG ? "msg" :
+			fi->ep_attr->type == FI_EP_DGRAM ? "dgram" : "rdm",
+			fi->domain_attr->threading);
+
+	for (target = 0; target < CH_TARGET_MAX; target++) {
+		if (!(target_mask & (1 << target)))
+			continue;
+
+		for (i = 0; i < thread_cnt_cnt; i++) {
+			ret = run_step(target, thread_cnts[i]);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n", name);
+	fprintf(stderr, "\nEndpoint and domain create/destroy churn.\n");
+	fprintf(stderr, "\nOptions:\n");
+	FT_PRINT_OPTS_USAGE("-f <provider>", "specific provider name eg sockets, verbs");
+	FT_PRINT_OPTS_USAGE("-e <ep_type>", "msg|rdm|dgram (default rdm)");
+	FT_PRINT_OPTS_USAGE("-n <domain>", "domain name");
+	FT_PRINT_OPTS_USAGE("-o <target>", "ep|domain|all (default all)");
+	FT_PRINT_OPTS_USAGE("-T <cnt,...>", "thread counts (default 1,2,4,8)");
+	FT_PRINT_OPTS_USAGE("-I <cycles>", "cycles per thread (default 10000)");
+	FT_PRINT_OPTS_USAGE("-m", "machine readable output");
+	FT_PRINT_OPTS_USAGE("-h", "display this help output");
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.iterations = 10000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hT:o:I:m" INFO_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'T':
+			if (ft_parse_int_list(optarg, thread_cnts,
+					      &thread_cnt_cnt, CH_MAX_LIST,
+					      1, 1024)) {
+				fprintf(stderr, "Invalid thread counts: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, ch_target_str,
+					  CH_TARGET_MAX, &target_mask)) {
+				fprintf(stderr, "Invalid target: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opts.iterations < 1) {
+		fprintf(stderr, "Cycle count must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!hints->ep_attr->type)
+		hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	hints->domain_attr->threading = FI_THREAD_COMPLETION;
+
+	ret = run();
+
+	ch_close(0);
+	ft_free_res();
+	return -ret;
+}
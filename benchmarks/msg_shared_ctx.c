@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Connected endpoint fan-in with and without shared contexts.
+ *
+ * For each endpoint count E (-E) and shared context count S (-C), the
+ * client connects E MSG endpoints to the server.  With S = 0 every
+ * endpoint has its own TX and RX context and the server posts -R receives
+ * on each one.  Otherwise endpoint i is bound to shared TX context i % S
+ * and shared RX context i % S, and the server posts -R receives per shared
+ * RX context.  The client then sends -I messages round-robin across the
+ * endpoints, keeping -W in flight.  Each step reports the message rate,
+ * the RSS growth per endpoint on both sides, and the server's posted
+ * receive buffers with the lowest number left on any receive queue.  The
+ * first step also pays for one-time provider setup in its RSS delta.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define SX_MAX_LIST	16
+#define SX_BATCH	16
+
+struct sx_stats {
+	uint64_t rx_bufs;
+	uint64_t rx_bytes;
+	int64_t min_posted;
+	int64_t rss;
+};
+
+static int ep_cnts[SX_MAX_LIST] = { 16, 256, 1024 }, ep_cnt_cnt = 3;
+static int ctx_cnts[SX_MAX_LIST] = { 0, 1, 4 }, ctx_cnt_cnt = 3;
+static int rx_depth = 8;
+
+static int n_ep, n_ctx, n_queue;
+static struct fid_ep **eps, **srxs;
+static struct fid_stx **stxs;
+static struct fid_cq *sx_txcq, *sx_rxcq;
+static struct fid_mr *sx_mr;
+static void *sx_desc;
+static char *sx_buf;
+static size_t slot_len;
+static struct fi_context *sx_tx_ctx, *sx_rx_ctx;
+static int *sx_posted;
+static int min_posted;
+
+/* Receive slots come first, the single send slot is last */
+static inline char *sx_slot(int slot)
+{
+	return sx_buf + slot_len * slot;
+}
+
+static int sx_post_recv(int slot)
+{
+	int q = slot / rx_depth;
+	ssize_t ret;
+
+	ret = fi_recv(n_ctx ? srxs[q] : eps[q], sx_slot(slot), slot_len,
+		      sx_desc, 0, &sx_rx_ctx[slot]);
+	if (ret) {
+		FT_PRINTERR("fi_recv", ret);
+		return (int) ret;
+	}
+	sx_posted[q]++;
+	return 0;
+}
+
+static int sx_post_queue(int q)
+{
+	int i, ret;
+
+	for (i = 0; i < rx_depth; i++) {
+		ret = sx_post_recv(q * rx_depth + i);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int sx_open_res(void)
+{
+	struct fi_cq_attr attr = {
+		.format = FI_CQ_FORMAT_CONTEXT,
+		.wait_obj = FI_WAIT_NONE,
+	};
+	int i, rx_slots, ret;
+
+	n_queue = n_ctx ? n_ctx : n_ep;
+	rx_slots = opts.dst_addr ? 0 : n_queue * rx_depth;
+
+	eps = calloc(n_ep, sizeof *eps);
+	sx_tx_ctx = calloc(opts.window_size, sizeof *sx_tx_ctx);
+	sx_rx_ctx = calloc(n_queue * rx_depth, sizeof *sx_rx_ctx);
+	sx_posted = calloc(n_queue, sizeof *sx_posted);
+	if (!eps || !sx_tx_ctx || !sx_rx_ctx || !sx_posted)
+		return -FI_ENOMEM;
+
+	slot_len = MAX(opts.transfer_size, FT_MAX_CTRL_MSG) +
+		MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+	sx_buf = calloc(rx_slots + 1, slot_len);
+	if (!sx_buf)
+		return -FI_ENOMEM;
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(domain, sx_buf, (rx_slots + 1) * slot_len,
+				FI_SEND | FI_RECV, 0, FT_MR_KEY + 1, 0,
+				&sx_mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		sx_desc = fi_mr_desc(sx_mr);
+	}
+
+	attr.size = opts.window_size;
+	ret = fi_cq_open(domain, &attr, &sx_txcq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	attr.size = MAX(rx_slots, 1);
+	ret = fi_cq_open(domain, &attr, &sx_rxcq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	if (!n_ctx)
+		return 0;
+
+	stxs = calloc(n_ctx, sizeof *stxs);
+	srxs = calloc(n_ctx, sizeof *srxs);
+	if (!stxs || !srxs)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < n_ctx; i++) {
+		ret = fi_stx_context(domain, fi->tx_attr, &stxs[i], NULL);
+		if (ret) {
+			FT_PRINTERR("fi_stx_context", ret);
+			return ret;
+		}
+
+		ret = fi_srx_context(domain, fi->rx_attr, &srxs[i], NULL);
+		if (ret) {
+			FT_PRINTERR("fi_srx_context", ret);
+			return ret;
+		}
+
+		if (!opts.dst_addr) {
+			ret = sx_post_queue(i);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static void sx_close(void)
+{
+	int i;
+
+	for (i = 0; eps && i < n_ep; i++)
+		FT_CLOSE_FID(eps[i]);
+	for (i = 0; srxs && i < n_ctx; i++)
+		FT_CLOSE_FID(srxs[i]);
+	for (i = 0; stxs && i < n_ctx; i++)
+		FT_CLOSE_FID(stxs[i]);
+	FT_CLOSE_FID(sx_txcq);
+	FT_CLOSE_FID(sx_rxcq);
+	FT_CLOSE_FID(sx_mr);
+
+	free(eps);
+	free(srxs);
+	free(stxs);
+	free(sx_buf);
+	free(sx_tx_ctx);
+	free(sx_rx_ctx);
+	free(sx_posted);
+	eps = srxs = NULL;
+	stxs = NULL;
+	sx_buf = NULL;
+	sx_tx_ctx = sx_rx_ctx = NULL;
+	sx_posted = NULL;
+}
+
+static int sx_open_ep(int i, struct fi_info *info)
+{
+	int ret;
+
+	if (n_ctx) {
+		info->ep_attr->tx_ctx_cnt = FI_SHARED_CONTEXT;
+		info->ep_attr->rx_ctx_cnt = FI_SHARED_CONTEXT;
+	}
+
+	ret = fi_endpoint(domain, info, &eps[i], NULL);
+	if (ret) {
+		FT_PRINTERR("fi_endpoint", ret);
+		return ret;
+	}
+
+	FT_EP_BIND(eps[i], eq, 0);
+	if (n_ctx) {
+		FT_EP_BIND(eps[i], stxs[i % n_ctx], 0);
+		FT_EP_BIND(eps[i], srxs[i % n_ctx], 0);
+	}
+	FT_EP_BIND(eps[i], sx_txcq, FI_SEND);
+	FT_EP_BIND(eps[i], sx_rxcq, FI_RECV);
+
+	ret = fi_enable(eps[i]);
+	if (ret) {
+		FT_PRINTERR("fi_enable", ret);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Reads the next CM event.  Endpoints closed by the previous step leave
+ * FI_SHUTDOWN events behind on the shared EQ; those are skipped.
+ */
+static int sx_eq_read(uint32_t *event, struct fi_eq_cm_entry *entry)
+{
+	ssize_t rd;
+
+	do {
+		rd = fi_eq_sread(eq, event, entry, sizeof *entry, -1, 0);
+		if (rd < 0) {
+			FT_PROCESS_EQ_ERR(rd, eq, "fi_eq_sread", "cm");
+			return (int) rd;
+		}
+	} while (*event == FI_SHUTDOWN);
+	return 0;
+}
+
+static int sx_connect(void)
+{
+	struct fi_eq_cm_entry entry;
+	struct fi_info *info;
+	uint32_t event;
+	int i, ret;
+
+	info = fi_dupinfo(fi);
+	if (!info)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < n_ep; i++) {
+		ret = sx_open_ep(i, info);
+		if (ret)
+			goto out;
+
+		ret = fi_connect(eps[i], fi->dest_addr, NULL, 0);
+		if (ret) {
+			FT_PRINTERR("fi_connect", ret);
+			goto out;
+		}
+
+		ret = sx_eq_read(&event, &entry);
+		if (ret)
+			goto out;
+
+		if (event != FI_CONNECTED || entry.fid != &eps[i]->fid) {
+			fprintf(stderr, "Unexpected CM event %d fid %p (ep %p)\n",
+				event, entry.fid, eps[i]);
+			ret = -FI_EOTHER;
+			goto out;
+		}
+	}
+out:
+	fi_freeinfo(info);
+	return ret;
+}
+
+/* Accept requests as they arrive until every endpoint is connected */
+static int sx_accept(void)
+{
+	struct fi_eq_cm_entry entry;
+	uint32_t event;
+	int reqs = 0, conns = 0, ret;
+
+	while (conns < n_ep) {
+		ret = sx_eq_read(&event, &entry);
+		if (ret)
+			return ret;
+
+		if (event == FI_CONNECTED) {
+			conns++;
+			continue;
+		}
+
+		if (event != FI_CONNREQ || reqs == n_ep) {
+			fprintf(stderr, "Unexpected CM event %d\n", event);
+			if (event == FI_CONNREQ) {
+				fi_reject(pep, entry.info->handle, NULL, 0);
+				fi_freeinfo(entry.info);
+			}
+			return -FI_EOTHER;
+		}
+
+		ret = sx_open_ep(reqs, entry.info);
+		if (!ret && !n_ctx)
+			ret = sx_post_queue(reqs);
+		if (!ret) {
+			ret = fi_accept(eps[reqs], NULL, 0);
+			if (ret)
+				FT_PRINTERR("fi_accept", ret);
+		}
+		if (ret)
+			fi_reject(pep, entry.info->handle, NULL, 0);
+		fi_freeinfo(entry.info);
+		if (ret)
+			return ret;
+		reqs++;
+	}
+	return 0;
+}
+
+static int sx_client(void)
+{
+	struct fi_cq_entry comp[SX_BATCH];
+	int sent = 0, done = 0;
+	ssize_t ret;
+
+	while (done < opts.iterations) {
+		while (sent < opts.iterations &&
+		       sent - done < opts.window_size) {
+			ret = fi_send(eps[sent % n_ep], sx_slot(0),
+				      opts.transfer_size + ft_tx_prefix_size(),
+				      sx_desc, 0,
+				      &sx_tx_ctx[sent % opts.window_size]);
+			if (ret == -FI_EAGAIN)
+				break;
+			if (ret) {
+				FT_PRINTERR("fi_send", ret);
+				return (int) ret;
+			}
+			sent++;
+		}
+
+		ret = fi_cq_read(sx_txcq, comp, SX_BATCH);
+		if (ret == -FI_EAGAIN)
+			continue;
+		if (ret == -FI_EAVAIL)
+			return ft_cq_readerr(sx_txcq);
+		if (ret < 0) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return (int) ret;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/* Every receive is reposted on the queue it came from */
+static int sx_server(void)
+{
+	struct fi_cq_entry comp[SX_BATCH];
+	int got = 0, slot, q, err;
+	ssize_t ret, i;
+
+	min_posted = rx_depth;
+	while (got < opts.iterations) {
+		ret = fi_cq_read(sx_rxcq, comp, SX_BATCH);
+		if (ret == -FI_EAGAIN)
+			continue;
+		if (ret == -FI_EAVAIL)
+			return ft_cq_readerr(sx_rxcq);
+		if (ret < 0) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return (int) ret;
+		}
+
+		for (i = 0; i < ret; i++) {
+			slot = (struct fi_context *) comp[i].op_context -
+			       sx_rx_ctx;
+			q = slot / rx_depth;
+			min_posted = MIN(min_posted, --sx_posted[q]);
+
+			err = sx_post_recv(slot);
+			if (err)
+				return err;
+		}
+		got += ret;
+	}
+	return 0;
+}
+
+static void sx_show(long long rss, struct sx_stats *stats)
+{
+	char ctx_str[FT_STR_LEN], bytes_str[FT_STR_LEN];
+	double rate;
+
+	rate = (double) opts.iterations / get_elapsed(&start, &end, MICRO);
+	snprintf(ctx_str, sizeof ctx_str, "%d", n_ctx);
+
+	if (opts.machr) {
+		printf("- { endpoints: %d, shared_ctx: %d, size: %d, "
+			"Mmsg/sec: %f, client_rss_per_ep: %f, "
+			"server_rss_per_ep: %f, rx_bufs: %lu, rx_bytes: %lu, "
+			"min_posted: %ld }\n", n_ep, n_ctx,
+			opts.transfer_size, rate, (double) rss / n_ep,
+			(double) stats->rss / n_ep,
+			(unsigned long) stats->rx_bufs,
+			(unsigned long) stats->rx_bytes,
+			(long) stats->min_posted);
+		return;
+	}
+
+	printf("%9d %6s %9.3f %10.1f %10.1f %8lu %9s %10ld\n", n_ep,
+		n_ctx ? ctx_str : "none", rate, rss / 1024.0 / n_ep,
+		stats->rss / 1024.0 / n_ep, (unsigned long) stats->rx_bufs,
+		size_str(bytes_str, stats->rx_bytes), (long) stats->min_posted);
+}
+
+static int run_step(void)
+{
+	struct sx_stats stats;
+	long long rss;
+	int ret;
+
+	rss = ft_rss();
+	ret = sx_open_res();
+	if (ret)
+		goto out;
+
+	ret = opts.dst_addr ? sx_connect() : sx_accept();
+	if (ret)
+		goto out;
+	rss = ft_rss() - rss;
+
+	ret = ft_sync();
+	if (ret)
+		goto out;
+
+	if (opts.dst_addr) {
+		ft_start();
+		ret = sx_client();
+		if (ret)
+			goto out;
+
+		ret = ft_sync();
+		if (ret)
+			goto out;
+		ft_stop();
+
+		ret = ft_rx(ep, sizeof stats);
+		if (ret)
+			goto out;
+
+		memcpy(&stats, (char *) rx_buf + ft_rx_prefix_size(),
+		       sizeof stats);
+		sx_show(rss, &stats);
+	} else {
+		ret = sx_server();
+		if (ret)
+			goto out;
+
+		ret = ft_sync();
+		if (ret)
+			goto out;
+
+		stats.rx_bufs = n_queue * rx_depth;
+		stats.rx_bytes = stats.rx_bufs * slot_len;
+		stats.min_posted = min_posted;
+		stats.rss = rss;
+		memcpy((char *) tx_buf + ft_tx_prefix_size(), &stats,
+		       sizeof stats);
+		ret = ft_tx(ep, remote_fi_addr, sizeof stats, &tx_ctx);
+	}
+out:
+	sx_close();
+	return ret;
+}
+
+static int run(void)
+{
+	int e, c, ret;
+
+	/*
+	 * The control connection carries ft_sync() and the server's stats.
+	 * The data endpoints of every step are opened on its domain and EQ,
+	 * and the server accepts them on the same passive endpoint.
+	 */
+	if (!opts.dst_addr) {
+		ret = ft_start_server();
+		if (ret)
+			return ret;
+	}
+
+	ret = opts.dst_addr ? ft_client_connect() : ft_server_connect();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr && !opts.machr)
+		printf("%9s %6s %9s %10s %10s %8s %9s %10s\n", "endpoints",
+			"shared", "Mmsg/s", "cli KB/ep", "srv KB/ep",
+			"rx bufs", "rx bytes", "min posted");
+
+	for (e = 0; e < ep_cnt_cnt; e++) {
+		for (c = 0; c < ctx_cnt_cnt; c++) {
+			if (ctx_cnts[c] > ep_cnts[e])
+				continue;
+
+			n_ep = ep_cnts[e];
+			n_ctx = ctx_cnts[c];
+			ret = run_step();
+			if (ret)
+				goto out;
+		}
+	}
+
+	ret = ft_finalize();
+out:
+	fi_shutdown(ep, 0);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.iterations = 100000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hE:C:R:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'E':
+			if (ft_parse_int_list(optarg, ep_cnts, &ep_cnt_cnt,
+					      SX_MAX_LIST, 1, 1 << 16)) {
+				fprintf(stderr, "Invalid endpoint counts: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'C':
+			if (ft_parse_int_list(optarg, ctx_cnts, &ctx_cnt_cnt,
+					      SX_MAX_LIST, 0, 1 << 16)) {
+				fprintf(stderr, "Invalid context counts: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			rx_depth = atoi(optarg);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Connected endpoint fan-in with and "
+					"without shared contexts.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-E <cnt,...>", "endpoint counts "
+					"(default 16,256,1024)");
+			FT_PRINT_OPTS_USAGE("-C <cnt,...>", "shared TX/RX context "
+					"counts, 0 for none (default 0,1,4)");
+			FT_PRINT_OPTS_USAGE("-R <depth>", "receives posted per "
+					"receive queue (default 8)");
+			fprintf(stderr, "Note: -I is the total number of messages "
+					"per step, and all options must match on "
+					"both sides.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (rx_depth < 1 || opts.window_size < 1) {
+		fprintf(stderr, "Receive depth and window must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	hints->ep_attr->type = FI_EP_MSG;
+	hints->caps = FI_MSG;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = run();
+
+	sx_close();
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Many initiators hammering a few remote words.
+ *
+ * The server exposes -K 64-bit words and stays passive.  The client starts
+ * N initiator threads, each with its own endpoint and CQ, and every thread
+ * increments a randomly chosen word -I times.  Three increment methods are
+ * compared: FI_SUM, fetch-add (fetching FI_SUM) and a FI_CSWAP retry loop.
+ * N doubles from 1 up to -N.  Each step reports the aggregate rate, the
+ * per-initiator fairness while all N are running and the per-increment
+ * latency histogram.  For the fetching methods, the server checks that no
+ * increment was lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_atomic.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+enum ca_op {
+	CA_SUM,
+	CA_FADD,
+	CA_CSWAP,
+	CA_OP_MAX,
+};
+
+static const char *ca_op_str[] = {
+	[CA_SUM] = "sum",
+	[CA_FADD] = "fadd",
+	[CA_CSWAP] = "cswap",
+};
+
+struct ca_local {
+	uint64_t operand;
+	uint64_t compare;
+	uint64_t result;
+};
+
+struct ca_initiator {
+	int id;
+	pthread_t thread;
+	struct fid_ep *ep;
+	struct fid_cq *cq;
+	struct fid_mr *mr;
+	void *desc;
+	struct ca_local *local;
+	struct fi_context context;
+	unsigned int seed;
+
+	enum ca_op op;
+	uint64_t retries;
+	int64_t elapsed;
+	int fair_ops;
+	int64_t fair_ns;
+	struct ft_hist lat;
+	int ret;
+};
+
+static int max_initiators = 8;
+static int words = 1;
+static int op_mask = (1 << CA_OP_MAX) - 1;
+static struct ca_initiator *initiators;
+static struct fi_rma_iov remote;
+static volatile int go;
+static volatile int first_done;
+
+/* Target words live past the control message area of the receive buffer */
+static uint64_t *ca_words(void)
+{
+	return (uint64_t *) ((char *) rx_buf + ft_rx_prefix_size() +
+			     FT_MAX_CTRL_MSG);
+}
+
+static int ca_open(struct ca_initiator *ini)
+{
+	struct fi_cq_attr attr = {
+		.format = FI_CQ_FORMAT_CONTEXT,
+		.wait_obj = FI_WAIT_NONE,
+		.size = fi->tx_attr->size,
+	};
+	int ret;
+
+	ini->local = calloc(1, sizeof *ini->local);
+	if (!ini->local)
+		return -FI_ENOMEM;
+	ini->local->operand = 1;
+	ini->seed = ini->id + 1;
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(domain, ini->local, sizeof *ini->local,
+				FI_READ | FI_WRITE, 0, FT_MR_KEY + 1 + ini->id,
+				0, &ini->mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		ini->desc = fi_mr_desc(ini->mr);
+	}
+
+	ret = fi_cq_open(domain, &attr, &ini->cq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	ret = fi_endpoint(domain, fi, &ini->ep, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_endpoint", ret);
+		return ret;
+	}
+
+	FT_EP_BIND(ini->ep, av, 0);
+	FT_EP_BIND(ini->ep, ini->cq, FI_TRANSMIT | FI_RECV);
+
+	ret = fi_enable(ini->ep);
+	if (ret) {
+		FT_PRINTERR("fi_enable", ret);
+		return ret;
+	}
+	return 0;
+}
+
+static void ca_close(void)
+{
+	int i;
+
+	for (i = 0; initiators && i < max_initiators; i++) {
+		FT_CLOSE_FID(initiators[i].ep);
+		FT_CLOSE_FID(initiators[i].cq);
+		FT_CLOSE_FID(initiators[i].mr);
+		free(initiators[i].local);
+	}
+	free(initiators);
+}
+
+static int ca_wait(struct ca_initiator *ini)
+{
+	struct fi_cq_entry comp;
+	ssize_t ret;
+
+	do {
+		ret = fi_cq_read(ini->cq, &comp, 1);
+	} while (ret == -FI_EAGAIN);
+
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(ini->cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	return 0;
+}
+
+/*
+ * One increment of the word at addr.  CSWAP guesses the value left by this
+ * initiator's previous increment and retries with the returned value until
+ * it wins, so with -K > 1 the retry count also includes stale guesses.
+ */
+static int ca_increment(struct ca_initiator *ini, uint64_t addr)
+{
+	struct ca_local *l = ini->local;
+	ssize_t ret;
+
+	do {
+		switch (ini->op) {
+		case CA_SUM:
+			ret = fi_atomic(ini->ep, &l->operand, 1, ini->desc,
+					remote_fi_addr, addr, remote.key,
+					FI_UINT64, FI_SUM, &ini->context);
+			break;
+		case CA_FADD:
+			ret = fi_fetch_atomic(ini->ep, &l->operand, 1, ini->desc,
+					&l->result, ini->desc, remote_fi_addr,
+					addr, remote.key, FI_UINT64, FI_SUM,
+					&ini->context);
+			break;
+		default:
+			l->operand = l->compare + 1;
+			ret = fi_compare_atomic(ini->ep, &l->operand, 1,
+					ini->desc, &l->compare, ini->desc,
+					&l->result, ini->desc, remote_fi_addr,
+					addr, remote.key, FI_UINT64, FI_CSWAP,
+					&ini->context);
+			break;
+		}
+		if (ret == -FI_EAGAIN)
+			continue;
+		if (ret) {
+			FT_PRINTERR("fi_atomic", ret);
+			return (int) ret;
+		}
+
+		ret = ca_wait(ini);
+		if (ret)
+			return (int) ret;
+
+		if (ini->op != CA_CSWAP || l->result == l->compare)
+			break;
+		l->compare = l->result;
+		ini->retries++;
+		ret = -FI_EAGAIN;
+	} while (ret == -FI_EAGAIN);
+
+	if (ini->op == CA_CSWAP)
+		l->compare++;
+	l->operand = 1;
+	return 0;
+}
+
+static void *ca_thread(void *arg)
+{
+	struct ca_initiator *ini = arg;
+	uint64_t addr;
+	int64_t start, t, now;
+	int i;
+
+	while (!go)
+		;
+
+	start = ft_gettime_ns();
+	for (i = 0; i < opts.iterations; i++) {
+		addr = remote.addr + FT_MAX_CTRL_MSG + sizeof(uint64_t) *
+		       (words > 1 ? rand_r(&ini->seed) % words : 0);
+		t = ft_gettime_ns();
+		ini->ret = ca_increment(ini, addr);
+		if (ini->ret)
+			break;
+		now = ft_gettime_ns();
+		ft_hist_add(&ini->lat, now - t);
+
+		/* sample progress once the first initiator has finished */
+		if (first_done && !ini->fair_ops) {
+			ini->fair_ops = i + 1;
+			ini->fair_ns = now - start;
+		}
+	}
+	ini->elapsed = ft_gettime_ns() - start;
+	if (!ini->fair_ops) {
+		ini->fair_ops = i;
+		ini->fair_ns = ini->elapsed;
+	}
+	first_done = 1;
+	return NULL;
+}
+
+/*
+ * Fairness is Jain's index over the per-initiator rates: 1.0 when all
+ * initiators progress equally, 1/N when one starves the rest.  The rates
+ * are sampled when the first initiator finishes, so the tail that the
+ * others run uncontended does not count.
+ */
+static void ca_show(enum ca_op op, int n)
+{
+	struct ft_hist lat;
+	double rate, sum = 0.0, sq = 0.0, lo = 0.0, hi = 0.0;
+	int64_t elapsed = 0;
+	uint64_t retries = 0;
+	char name[FT_STR_LEN];
+	int i;
+
+	ft_hist_reset(&lat);
+	for (i = 0; i < n; i++) {
+		rate = initiators[i].fair_ops * 1e9 / initiators[i].fair_ns;
+		sum += rate;
+		sq += rate * rate;
+		lo = i ? MIN(lo, rate) : rate;
+		hi = MAX(hi, rate);
+		elapsed = MAX(elapsed, initiators[i].elapsed);
+		retries += initiators[i].retries;
+		ft_hist_merge(&lat, &initiators[i].lat);
+	}
+
+	rate = (double) n * opts.iterations * 1e3 / elapsed;
+	if (opts.machr)
+		printf("- { op: %s, initiators: %d, words: %d, Mops/sec: %f, "
+			"fairness: %f, min_max_ratio: %f, cswap_retries: %lu }\n",
+			ca_op_str[op], n, words, rate, sum * sum / (n * sq),
+			lo / hi, (unsigned long) retries);
+	else
+		printf("%-5s %3d initiators %3d words: %8.3f Mops/sec, fairness "
+			"%.3f, min/max %.3f, cswap retries %lu\n",
+			ca_op_str[op], n, words, rate, sum * sum / (n * sq),
+			lo / hi, (unsigned long) retries);
+
+	snprintf(name, sizeof name, "%s_n%d", ca_op_str[op], n);
+	ft_hist_show(name, &lat);
+}
+
+static int ca_client(enum ca_op op, int n)
+{
+	int i, ret = 0;
+
+	go = 0;
+	first_done = 0;
+	for (i = 0; i < n; i++) {
+		initiators[i].op = op;
+		initiators[i].fair_ops = 0;
+		initiators[i].retries = 0;
+		initiators[i].ret = 0;
+		initiators[i].local->compare = 0;
+		ft_hist_reset(&initiators[i].lat);
+		ret = pthread_create(&initiators[i].thread, NULL, ca_thread,
+				     &initiators[i]);
+		if (ret) {
+			FT_PRINTERR("pthread_create", ret);
+			n = i;
+			ret = -ret;
+			break;
+		}
+	}
+
+	go = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(initiators[i].thread, NULL);
+		if (!ret)
+			ret = initiators[i].ret;
+	}
+	return ret;
+}
+
+static int ca_check(enum ca_op op, int n)
+{
+	uint64_t *w = ca_words(), sum = 0;
+	int i;
+
+	for (i = 0; i < words; i++)
+		sum += w[i];
+
+	if (op != CA_SUM && sum != (uint64_t) n * opts.iterations) {
+		FT_ERR("%s with %d initiators: target words sum to %lu, "
+			"expected %lu", ca_op_str[op], n, (unsigned long) sum,
+			(unsigned long) n * opts.iterations);
+		return -FI_EOTHER;
+	}
+	return 0;
+}
+
+static int run_step(enum ca_op op, int n)
+{
+	int ret;
+
+	if (!opts.dst_addr)
+		memset(ca_words(), 0, words * sizeof(uint64_t));
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr) {
+		ret = ca_client(op, n);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr)
+		ca_show(op, n);
+	else
+		ret = ca_check(op, n);
+	return ret;
+}
+
+static int run(void)
+{
+	enum ca_op op;
+	int i, n, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr) {
+		initiators = calloc(max_initiators, sizeof *initiators);
+		if (!initiators)
+			return -FI_ENOMEM;
+
+		for (i = 0; i < max_initiators; i++) {
+			initiators[i].id = i;
+			ret = ca_open(&initiators[i]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	for (op = 0; op < CA_OP_MAX; op++) {
+		if (!(op_mask & (1 << op)))
+			continue;
+
+		for (n = 1; ; n = MIN(n * 2, max_initiators)) {
+			ret = run_step(op, n);
+			if (ret)
+				return ret;
+			if (n == max_initiators)
+				break;
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.iterations = 10000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hN:K:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'N':
+			max_initiators = atoi(optarg);
+			break;
+		case 'K':
+			words = atoi(optarg);
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, ca_op_str,
+					  CA_OP_MAX, &op_mask)) {
+				fprintf(stderr, "Invalid op: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Contended remote atomics from many "
+					"initiators using RDM.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-N <count>", "maximum number of "
+					"initiator threads (default 8)");
+			FT_PRINT_OPTS_USAGE("-K <count>", "number of target "
+					"words (default 1)");
+			FT_PRINT_OPTS_USAGE("-o <op>", "increment method: "
+					"sum|fadd|cswap|all (default all)");
+			fprintf(stderr, "Note: -I is the number of increments per "
+					"initiator, and all options must match on "
+					"both sides.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (max_initiators < 1 || words < 1) {
+		fprintf(stderr, "Initiator and word counts must be positive\n");
+		return EXIT_FAILURE;
+	}
+	opts.transfer_size = FT_MAX_CTRL_MSG + words * sizeof(uint64_t);
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_ATOMICS;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	hints->domain_attr->threading = FI_THREAD_COMPLETION;
+
+	ret = run();
+
+	ca_close();
+	ft_free_res();
+	return -ret;
+}
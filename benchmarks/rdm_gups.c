@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Random remote updates in the style of HPCC RandomAccess.
+ *
+ * The server exposes a table of 2^-T 64-bit words, initialised so that
+ * T[i] == i.  The client walks the HPCC pseudo-random stream and XORs each
+ * value into the word it selects.  Each update is done either with a
+ * single FI_BXOR atomic or with a read, a local XOR and a write back.  Up
+ * to -W updates are in flight, and with -B the client generates updates in
+ * batches sorted by target address before issuing them.
+ *
+ * XOR is its own inverse, so after each run the server replays the same
+ * stream locally and counts the words that did not return to T[i] == i.
+ * Updates lost to races in the read/modify/write variant show up as
+ * errors.  As in HPCC, the run fails if more than 1% of updates are lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_atomic.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define GUPS_POLY	0x0000000000000007ULL
+#define GUPS_BATCH	16
+
+enum gups_mode {
+	GUPS_XOR,
+	GUPS_RMW,
+	GUPS_MODE_MAX,
+};
+
+static const char *gups_mode_str[] = {
+	[GUPS_XOR] = "xor",
+	[GUPS_RMW] = "rmw",
+};
+
+enum gups_state {
+	GUPS_FREE,
+	GUPS_READ,
+	GUPS_WRITE,
+};
+
+struct gups_slot {
+	struct fi_context context;
+	uint64_t *val;
+	uint64_t ran;
+	enum gups_state state;
+};
+
+static int table_bits = 20;
+static uint64_t table_size;
+static uint64_t updates;
+static int batch = 1;
+static int mode_mask = (1 << GUPS_MODE_MAX) - 1;
+static struct fi_rma_iov remote;
+static struct gups_slot *slots;
+static uint64_t *pending;
+static struct fi_cq_entry *backlog;
+static int nbacklog;
+
+static inline uint64_t gups_next(uint64_t ran)
+{
+	return (ran << 1) ^ ((int64_t) ran < 0 ? GUPS_POLY : 0);
+}
+
+static uint64_t *gups_table(void)
+{
+	return (uint64_t *) ((char *) rx_buf + ft_rx_prefix_size() +
+			     FT_MAX_CTRL_MSG);
+}
+
+static inline uint64_t gups_addr(uint64_t ran)
+{
+	return remote.addr + FT_MAX_CTRL_MSG +
+	       (ran & (table_size - 1)) * sizeof(uint64_t);
+}
+
+static int gups_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a & (table_size - 1);
+	uint64_t y = *(const uint64_t *) b & (table_size - 1);
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Move whatever txcq holds into the backlog.  Each slot has at most one
+ * operation outstanding, so -W entries always suffice.
+ */
+static int gups_stash(void)
+{
+	ssize_t ret;
+
+	if (nbacklog == opts.window_size)
+		return 0;
+
+	ret = fi_cq_read(txcq, backlog + nbacklog, opts.window_size - nbacklog);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	nbacklog += ret;
+	return 0;
+}
+
+static ssize_t gups_post(enum gups_mode mode, struct gups_slot *slot)
+{
+	void *desc = fi_mr_desc(mr);
+	ssize_t ret;
+
+	for (;;) {
+		if (mode == GUPS_XOR) {
+			*slot->val = slot->ran;
+			ret = fi_atomic(ep, slot->val, 1, desc, remote_fi_addr,
+					gups_addr(slot->ran), remote.key,
+					FI_UINT64, FI_BXOR, &slot->context);
+		} else if (slot->state == GUPS_READ) {
+			ret = fi_read(ep, slot->val, sizeof(uint64_t), desc,
+				      remote_fi_addr, gups_addr(slot->ran),
+				      remote.key, &slot->context);
+		} else {
+			ret = fi_write(ep, slot->val, sizeof(uint64_t), desc,
+				       remote_fi_addr, gups_addr(slot->ran),
+				       remote.key, &slot->context);
+		}
+		if (ret != -FI_EAGAIN)
+			break;
+
+		/* stash completions so the provider can free tx credits */
+		ret = gups_stash();
+		if (ret)
+			return ret;
+	}
+
+	if (ret)
+		FT_PRINTERR("gups_post", ret);
+	return ret;
+}
+
+/* Next update to issue, refilling and sorting the batch when it runs dry */
+static uint64_t gups_pop(uint64_t *ran, int *npending, int *next)
+{
+	int i;
+
+	if (*next == *npending) {
+		for (i = 0; i < batch; i++)
+			pending[i] = *ran = gups_next(*ran);
+		if (batch > 1)
+			qsort(pending, batch, sizeof *pending, gups_cmp);
+		*npending = batch;
+		*next = 0;
+	}
+	return pending[(*next)++];
+}
+
+static int gups_client(enum gups_mode mode)
+{
+	struct gups_slot *slot;
+	uint64_t ran = 1, issued = 0, done = 0;
+	int npending = 0, next = 0, i;
+	ssize_t ret;
+
+	for (i = 0; i < opts.window_size; i++)
+		slots[i].state = GUPS_FREE;
+	nbacklog = 0;
+
+	ft_start();
+	while (done < updates) {
+		for (i = 0; i < opts.window_size && issued < updates; i++) {
+			if (slots[i].state != GUPS_FREE)
+				continue;
+			slots[i].ran = gups_pop(&ran, &npending, &next);
+			slots[i].state = mode == GUPS_XOR ? GUPS_WRITE : GUPS_READ;
+			ret = gups_post(mode, &slots[i]);
+			if (ret)
+				return (int) ret;
+			issued++;
+		}
+
+		ret = gups_stash();
+		if (ret)
+			return (int) ret;
+
+		/* reposting a read may stash more entries; take from the end */
+		while (nbacklog) {
+			slot = backlog[--nbacklog].op_context;
+			if (slot->state == GUPS_READ) {
+				*slot->val ^= slot->ran;
+				slot->state = GUPS_WRITE;
+				if (gups_post(mode, slot))
+					return -FI_EOTHER;
+			} else {
+				slot->state = GUPS_FREE;
+				done++;
+			}
+		}
+	}
+	ft_stop();
+	return 0;
+}
+
+static void gups_init_table(void)
+{
+	uint64_t *table = gups_table(), i;
+
+	for (i = 0; i < table_size; i++)
+		table[i] = i;
+}
+
+/* Server: undo the update stream and count words that did not return */
+static uint64_t gups_errors(void)
+{
+	uint64_t *table = gups_table(), ran = 1, i, errors = 0;
+
+	for (i = 0; i < updates; i++) {
+		ran = gups_next(ran);
+		table[ran & (table_size - 1)] ^= ran;
+	}
+
+	for (i = 0; i < table_size; i++) {
+		if (table[i] != i)
+			errors++;
+	}
+	return errors;
+}
+
+static void gups_show(enum gups_mode mode, uint64_t errors)
+{
+	int64_t elapsed = get_elapsed(&start, &end, NANO);
+	double gups = (double) updates / elapsed;
+
+	if (opts.machr)
+		printf("- { mode: %s, table_entries: %lu, updates: %lu, "
+			"window: %d, batch: %d, GUPS: %f, errors: %lu, "
+			"error_rate: %f }\n", gups_mode_str[mode],
+			(unsigned long) table_size, (unsigned long) updates,
+			opts.window_size, batch, gups, (unsigned long) errors,
+			(double) errors / updates);
+	else
+		printf("%-4s table 2^%d updates %lu window %d batch %d: "
+			"%.6f GUPS, %lu errors (%.4f%%)\n", gups_mode_str[mode],
+			table_bits, (unsigned long) updates, opts.window_size,
+			batch, gups, (unsigned long) errors,
+			100.0 * errors / updates);
+}
+
+static int run_mode(enum gups_mode mode)
+{
+	uint64_t errors;
+	int ret;
+
+	if (!opts.dst_addr)
+		gups_init_table();
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr) {
+		ret = gups_client(mode);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	/* the server reports its error count back to the client */
+	if (opts.dst_addr) {
+		ret = ft_get_rx_comp(rx_seq);
+		if (ret)
+			return ret;
+		errors = *(uint64_t *) ((char *) rx_buf + ft_rx_prefix_size());
+		ret = ft_post_rx(ep, rx_size, &rx_ctx);
+		if (ret)
+			return ret;
+		gups_show(mode, errors);
+	} else {
+		errors = gups_errors();
+		*(uint64_t *) ((char *) tx_buf + ft_tx_prefix_size()) = errors;
+		ret = ft_tx(ep, remote_fi_addr, sizeof errors, &tx_ctx);
+		if (ret)
+			return ret;
+	}
+
+	if (errors * 100 > updates) {
+		FT_ERR("%s: %lu of %lu updates lost", gups_mode_str[mode],
+			(unsigned long) errors, (unsigned long) updates);
+		return -FI_EOTHER;
+	}
+	return 0;
+}
+
+static int run(void)
+{
+	enum gups_mode mode;
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Table");
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	slots = calloc(opts.window_size, sizeof *slots);
+	pending = calloc(batch, sizeof *pending);
+	backlog = calloc(opts.window_size, sizeof *backlog);
+	if (!slots || !pending || !backlog)
+		return -FI_ENOMEM;
+
+	/* operand and read buffers for each slot, inside the registered tx_buf */
+	for (i = 0; i < opts.window_size; i++)
+		slots[i].val = (uint64_t *) ((char *) tx_buf +
+			       ft_tx_prefix_size() + FT_MAX_CTRL_MSG) + i;
+
+	for (mode = 0; mode < GUPS_MODE_MAX; mode++) {
+		if (mode_mask & (1 << mode)) {
+			ret = run_mode(mode);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hT:B:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'T':
+			table_bits = atoi(optarg);
+			break;
+		case 'B':
+			batch = atoi(optarg);
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, gups_mode_str,
+					  GUPS_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid update mode: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Random remote table updates (GUPS) "
+					"using RDM atomics or RMA.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-T <bits>", "log2 of the table "
+					"entries (default 20)");
+			FT_PRINT_OPTS_USAGE("-B <count>", "updates generated and "
+					"sorted by address per batch (default 1)");
+			FT_PRINT_OPTS_USAGE("-o <mode>", "update method: "
+					"xor|rmw|all (default all)");
+			fprintf(stderr, "Note: -I is the number of updates "
+					"(default 4 per table entry), -W the "
+					"updates in flight.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (table_bits < 1 || table_bits > 27 || batch < 1 ||
+	    opts.window_size < 1) {
+		fprintf(stderr, "Invalid table size, batch or window\n");
+		return EXIT_FAILURE;
+	}
+
+	table_size = 1ULL << table_bits;
+	updates = opts.options & FT_OPT_ITER ? opts.iterations : 4 * table_size;
+	/* whole batches only, so the server replays exactly what was issued */
+	updates = (updates + batch - 1) / batch * batch;
+	opts.transfer_size = FT_MAX_CTRL_MSG + MAX(table_size,
+			     opts.window_size) * sizeof(uint64_t);
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_RMA | FI_ATOMICS | FI_READ | FI_WRITE |
+		      FI_REMOTE_READ | FI_REMOTE_WRITE;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+
+	ret = run();
+
+	free(slots);
+	free(pending);
+	free(backlog);
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Key-value GETs against a remote open-addressing hash table.
+ *
+ * The server publishes a table of -B buckets followed by a value area,
+ * both in the buffer shared through ft_exchange_keys().  Each bucket
+ * holds a key, a version and the location of its value.  A value is
+ * stored between a header (version, key) and a trailing version.  The
+ * table is filled to each -F load factor with keys 1..N, using linear
+ * probing.
+ *
+ * The one-sided GET reads buckets with fi_read until the key is found,
+ * then reads the value and checks that both of its versions match the
+ * bucket.  A mismatch counts as a torn read and the GET is retried.  The
+ * RPC variant sends the key to the server, which looks it up locally and
+ * returns the value.  Both are run for every -V value size and report
+ * lookups/sec, probes per GET and latency percentiles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define KV_MAX_LIST	16
+
+enum kv_mode {
+	KV_RMA,
+	KV_RPC,
+	KV_MODE_MAX,
+};
+
+static const char *kv_mode_str[] = {
+	[KV_RMA] = "rma",
+	[KV_RPC] = "rpc",
+};
+
+struct kv_bucket {
+	uint64_t key;
+	uint64_t version;
+	uint64_t value_off;
+	uint64_t value_len;
+};
+
+struct kv_value_hdr {
+	uint64_t version;
+	uint64_t key;
+};
+
+static uint64_t buckets = 1 << 14;
+static int vsizes[KV_MAX_LIST] = { 8, 64, 1024 };
+static int vsize_cnt = 3;
+static int loads[KV_MAX_LIST] = { 50, 75, 90 };
+static int load_cnt = 3;
+static int mode_mask = (1 << KV_MODE_MAX) - 1;
+static struct fi_rma_iov remote;
+static uint64_t table_version;
+static struct ft_hist kv_lat;
+static uint64_t probes, torn;
+
+static inline uint64_t kv_hash(uint64_t key)
+{
+	key += 0x9e3779b97f4a7c15ULL;
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+	return key ^ (key >> 31);
+}
+
+static inline size_t kv_value_size(int vsize)
+{
+	return sizeof(struct kv_value_hdr) + vsize + sizeof(uint64_t);
+}
+
+/* The table starts past the control message area of the receive buffer */
+static char *kv_table(void)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static char *kv_local(void)
+{
+	return (char *) tx_buf + ft_tx_prefix_size();
+}
+
+static inline uint64_t kv_keys(int load)
+{
+	return MAX(buckets * load / 100, 1);
+}
+
+/* Server: insert keys 1..N with linear probing */
+static void kv_build(int vsize, int load)
+{
+	struct kv_bucket *bkt = (struct kv_bucket *) kv_table();
+	char *values = kv_table() + buckets * sizeof *bkt;
+	struct kv_value_hdr *hdr;
+	uint64_t key, h, off = 0;
+
+	table_version += 2;
+	memset(bkt, 0, buckets * sizeof *bkt);
+	for (key = 1; key <= kv_keys(load); key++) {
+		for (h = kv_hash(key) & (buckets - 1); bkt[h].key;
+		     h = (h + 1) & (buckets - 1))
+			;
+
+		hdr = (struct kv_value_hdr *) (values + off);
+		hdr->version = table_version;
+		hdr->key = key;
+		memset(hdr + 1, (int) key, vsize);
+		*(uint64_t *) ((char *) (hdr + 1) + vsize) = table_version;
+
+		bkt[h].value_off = buckets * sizeof *bkt + off;
+		bkt[h].value_len = vsize;
+		bkt[h].version = table_version;
+		bkt[h].key = key;
+		off += kv_value_size(vsize);
+	}
+}
+
+static struct kv_bucket *kv_find_local(uint64_t key)
+{
+	struct kv_bucket *bkt = (struct kv_bucket *) kv_table();
+	uint64_t h;
+
+	for (h = kv_hash(key) & (buckets - 1); bkt[h].key;
+	     h = (h + 1) & (buckets - 1)) {
+		if (bkt[h].key == key)
+			return &bkt[h];
+	}
+	return NULL;
+}
+
+static int kv_read(void *local, size_t len, uint64_t off)
+{
+	ssize_t ret;
+
+	do {
+		ret = fi_read(ep, local, len, fi_mr_desc(mr), remote_fi_addr,
+			      remote.addr + FT_MAX_CTRL_MSG + off, remote.key,
+			      &tx_ctx);
+	} while (ret == -FI_EAGAIN);
+	if (ret) {
+		FT_PRINTERR("fi_read", ret);
+		return (int) ret;
+	}
+
+	return ft_get_tx_comp(++tx_seq);
+}
+
+static int kv_get_rma(uint64_t key)
+{
+	struct kv_bucket *bkt = (struct kv_bucket *) kv_local();
+	struct kv_value_hdr *hdr = (struct kv_value_hdr *) (bkt + 1);
+	uint64_t h;
+	int ret;
+
+retry:
+	for (h = kv_hash(key) & (buckets - 1); ; h = (h + 1) & (buckets - 1)) {
+		probes++;
+		ret = kv_read(bkt, sizeof *bkt, h * sizeof *bkt);
+		if (ret)
+			return ret;
+		if (bkt->key == key)
+			break;
+		if (!bkt->key) {
+			FT_ERR("Key %lu not found", (unsigned long) key);
+			return -FI_ENODATA;
+		}
+	}
+
+	ret = kv_read(hdr, kv_value_size(bkt->value_len), bkt->value_off);
+	if (ret)
+		return ret;
+
+	if (hdr->version != bkt->version || hdr->key != key ||
+	    *(uint64_t *) ((char *) (hdr + 1) + bkt->value_len) !=
+	    bkt->version) {
+		torn++;
+		goto retry;
+	}
+	return 0;
+}
+
+static int kv_get_rpc(uint64_t key)
+{
+	struct kv_value_hdr *hdr;
+	int ret;
+
+	*(uint64_t *) kv_local() = key;
+	ret = ft_tx(ep, remote_fi_addr, sizeof key, &tx_ctx);
+	if (ret)
+		return ret;
+
+	ret = ft_get_rx_comp(rx_seq);
+	if (ret)
+		return ret;
+
+	hdr = (struct kv_value_hdr *) ((char *) rx_buf + ft_rx_prefix_size());
+	if (hdr->key != key) {
+		FT_ERR("RPC reply for key %lu, expected %lu",
+			(unsigned long) hdr->key, (unsigned long) key);
+		return -FI_EOTHER;
+	}
+	probes++;
+	return ft_post_rx(ep, rx_size, &rx_ctx);
+}
+
+/* Server side of the RPC variant: one reply per request */
+static int kv_serve_rpc(void)
+{
+	struct kv_bucket *bkt;
+	uint64_t key;
+	int i, ret;
+
+	for (i = 0; i < opts.iterations; i++) {
+		ret = ft_get_rx_comp(rx_seq);
+		if (ret)
+			return ret;
+
+		key = *(uint64_t *) ((char *) rx_buf + ft_rx_prefix_size());
+		ret = ft_post_rx(ep, rx_size, &rx_ctx);
+		if (ret)
+			return ret;
+
+		bkt = kv_find_local(key);
+		if (!bkt) {
+			FT_ERR("Key %lu not found", (unsigned long) key);
+			return -FI_ENODATA;
+		}
+
+		memcpy(kv_local(), kv_table() + bkt->value_off,
+		       kv_value_size(bkt->value_len));
+		ret = ft_tx(ep, remote_fi_addr, kv_value_size(bkt->value_len),
+			    &tx_ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void kv_show(enum kv_mode mode, int vsize, int load, int64_t elapsed)
+{
+	static int header = 1;
+	double rate = opts.iterations * 1e9 / elapsed;
+	double avg = (double) kv_lat.sum / kv_lat.count / 1000.0;
+
+	if (opts.machr) {
+		printf("- { mode: %s, value_size: %d, load: %d, lookups/sec: "
+			"%.0f, probes/get: %f, torn: %lu, avg: %f, p50: %f, "
+			"p99: %f, p99.9: %f }\n", kv_mode_str[mode], vsize,
+			load, rate, (double) probes / opts.iterations,
+			(unsigned long) torn, avg,
+			ft_hist_percentile(&kv_lat, 50.0) / 1000.0,
+			ft_hist_percentile(&kv_lat, 99.0) / 1000.0,
+			ft_hist_percentile(&kv_lat, 99.9) / 1000.0);
+		return;
+	}
+
+	if (header) {
+		printf("%-5s%8s%6s%14s%10s%7s%10s%10s%10s%10s\n", "mode",
+			"value", "load", "lookups/sec", "probes", "torn",
+			"avg", "p50", "p99", "p99.9");
+		header = 0;
+	}
+	printf("%-5s%8d%5d%%%14.0f%10.2f%7lu%10.2f%10.2f%10.2f%10.2f\n",
+		kv_mode_str[mode], vsize, load, rate,
+		(double) probes / opts.iterations, (unsigned long) torn, avg,
+		ft_hist_percentile(&kv_lat, 50.0) / 1000.0,
+		ft_hist_percentile(&kv_lat, 99.0) / 1000.0,
+		ft_hist_percentile(&kv_lat, 99.9) / 1000.0);
+}
+
+static int run_lookups(enum kv_mode mode, int vsize, int load)
+{
+	uint64_t nkeys = kv_keys(load), key;
+	int64_t start, t;
+	int i, ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr) {
+		if (mode == KV_RPC) {
+			ret = kv_serve_rpc();
+			if (ret)
+				return ret;
+		}
+		return ft_sync();
+	}
+
+	probes = torn = 0;
+	ft_hist_reset(&kv_lat);
+	start = ft_gettime_ns();
+	for (i = 0; i < opts.iterations; i++) {
+		key = lrand48() % nkeys + 1;
+		t = ft_gettime_ns();
+		ret = mode == KV_RMA ? kv_get_rma(key) : kv_get_rpc(key);
+		if (ret)
+			return ret;
+		ft_hist_add(&kv_lat, ft_gettime_ns() - t);
+	}
+	kv_show(mode, vsize, load, ft_gettime_ns() - start);
+
+	return ft_sync();
+}
+
+static int run(void)
+{
+	enum kv_mode mode;
+	int i, j, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Table");
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	srand48(1);
+	for (i = 0; i < vsize_cnt; i++) {
+		for (j = 0; j < load_cnt; j++) {
+			if (!opts.dst_addr)
+				kv_build(vsizes[i], loads[j]);
+
+			for (mode = 0; mode < KV_MODE_MAX; mode++) {
+				if (!(mode_mask & (1 << mode)))
+					continue;
+				ret = run_lookups(mode, vsizes[i], loads[j]);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, i, ret, max_vsize;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.iterations = 10000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hB:F:V:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'B':
+			buckets = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			if (ft_parse_int_list(optarg, loads, &load_cnt,
+					      KV_MAX_LIST, 1, 95)) {
+				fprintf(stderr, "Invalid load factors: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'V':
+			if (ft_parse_int_list(optarg, vsizes, &vsize_cnt,
+					      KV_MAX_LIST, 1, 1 << 20)) {
+				fprintf(stderr, "Invalid value sizes: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, kv_mode_str,
+					  KV_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Key-value GETs over one-sided RMA "
+					"reads or send/recv RPC.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-B <count>", "hash table buckets, "
+					"a power of two (default 16384)");
+			FT_PRINT_OPTS_USAGE("-F <pct,...>", "table load factors "
+					"(default 50,75,90)");
+			FT_PRINT_OPTS_USAGE("-V <size,...>", "value sizes "
+					"(default 8,64,1024)");
+			FT_PRINT_OPTS_USAGE("-o <mode>", "rma|rpc|all "
+					"(default all)");
+			fprintf(stderr, "Note: -I is the number of GETs per "
+					"value size and load factor, and all "
+					"options must match on both sides.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (!buckets || (buckets & (buckets - 1))) {
+		fprintf(stderr, "Bucket count must be a power of two\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0, max_vsize = 0; i < vsize_cnt; i++)
+		max_vsize = MAX(max_vsize, vsizes[i]);
+	if (buckets * (sizeof(struct kv_bucket) + kv_value_size(max_vsize)) >
+	    (1ULL << 30)) {
+		fprintf(stderr, "Table larger than 1g\n");
+		return EXIT_FAILURE;
+	}
+	opts.transfer_size = FT_MAX_CTRL_MSG + buckets *
+			     (sizeof(struct kv_bucket) + kv_value_size(max_vsize));
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_RMA | FI_READ | FI_REMOTE_READ;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	opts.rma_op = FT_RMA_READ;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
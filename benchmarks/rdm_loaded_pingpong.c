@@ -0,0 +1,618 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Small message latency while the same link carries bulk traffic.
+ *
+ * The foreground flow is a regular ping-pong on the endpoint opened by
+ * ft_init_fabric().  The background flow runs on a second endpoint with its
+ * own CQs, driven by a separate thread: the client sends windows of -W
+ * messages of -B bytes, and the server acknowledges every window.  The
+ * client first measures how fast the background flow runs alone, then
+ * repeats the ping-pong with the background paced to each -U load level,
+ * given as a percentage of that saturation rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define BG_MAX_LEVELS	16
+#define BG_CAL_NSEC	1000000000LL
+#define BG_BATCH	16
+#define BG_ACK_SIZE	4
+
+struct bg_flow {
+	struct fid_ep *ep;
+	struct fid_cq *txcq, *rxcq;
+	struct fid_mr *mr;
+	void *desc;
+	void *buf, *tx_buf, *rx_buf;
+	size_t size;
+	int depth;
+	fi_addr_t remote_addr;
+	struct fi_context *tx_ctx, *rx_ctx;
+	uint64_t tx_seq, tx_cq_cntr;
+	uint64_t rx_seq, rx_cq_cntr;
+
+	pthread_t thread;
+	volatile int stop;
+	int ret;
+	int64_t interval;
+	uint64_t windows;
+	struct timespec start, end;
+};
+
+static struct bg_flow bg = { .size = 1 << 16 };
+static int levels[BG_MAX_LEVELS] = { 0, 25, 50, 75, 100 };
+static int level_cnt = 5;
+static int64_t sat_window_nsec;
+static struct ft_hist fg_lat;
+
+static int bg_open(void)
+{
+	struct fi_cq_attr attr = {
+		.format = FI_CQ_FORMAT_CONTEXT,
+		.wait_obj = FI_WAIT_NONE,
+	};
+	size_t len;
+	int ret;
+
+	bg.tx_ctx = calloc(bg.depth, sizeof *bg.tx_ctx);
+	bg.rx_ctx = calloc(bg.depth, sizeof *bg.rx_ctx);
+	if (!bg.tx_ctx || !bg.rx_ctx)
+		return -FI_ENOMEM;
+
+	len = MAX(bg.size, FT_MAX_CTRL_MSG) +
+		MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+	bg.buf = calloc(2, len);
+	if (!bg.buf)
+		return -FI_ENOMEM;
+	bg.tx_buf = bg.buf;
+	bg.rx_buf = (char *) bg.buf + len;
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(domain, bg.buf, 2 * len, FI_SEND | FI_RECV, 0,
+				FT_MR_KEY + 1, 0, &bg.mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		bg.desc = fi_mr_desc(bg.mr);
+	}
+
+	attr.size = fi->tx_attr->size;
+	ret = fi_cq_open(domain, &attr, &bg.txcq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	attr.size = fi->rx_attr->size;
+	ret = fi_cq_open(domain, &attr, &bg.rxcq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	ret = fi_endpoint(domain, fi, &bg.ep, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_endpoint", ret);
+		return ret;
+	}
+
+	FT_EP_BIND(bg.ep, av, 0);
+	FT_EP_BIND(bg.ep, bg.txcq, FI_TRANSMIT);
+	FT_EP_BIND(bg.ep, bg.rxcq, FI_RECV);
+
+	ret = fi_enable(bg.ep);
+	if (ret) {
+		FT_PRINTERR("fi_enable", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void bg_close(void)
+{
+	FT_CLOSE_FID(bg.ep);
+	FT_CLOSE_FID(bg.txcq);
+	FT_CLOSE_FID(bg.rxcq);
+	FT_CLOSE_FID(bg.mr);
+	free(bg.buf);
+	free(bg.tx_ctx);
+	free(bg.rx_ctx);
+}
+
+/* Trade background endpoint names over the foreground endpoint */
+static int bg_exchange_addr(void)
+{
+	size_t addrlen = FT_MAX_CTRL_MSG;
+	int ret;
+
+	ret = fi_getname(&bg.ep->fid, (char *) tx_buf + ft_tx_prefix_size(),
+			 &addrlen);
+	if (ret) {
+		FT_PRINTERR("fi_getname", ret);
+		return ret;
+	}
+
+	if (opts.dst_addr) {
+		ret = ft_tx(ep, remote_fi_addr, addrlen, &tx_ctx);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_get_rx_comp(rx_seq);
+	if (ret)
+		return ret;
+
+	ret = ft_av_insert(av, (char *) rx_buf + ft_rx_prefix_size(), 1,
+			   &bg.remote_addr, 0, NULL);
+	if (ret)
+		return ret;
+
+	ret = ft_post_rx(ep, rx_size, &rx_ctx);
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr)
+		ret = ft_tx(ep, remote_fi_addr, addrlen, &tx_ctx);
+
+	return ret;
+}
+
+/*
+ * Reads whatever completions are available.  Receive contexts returned on
+ * the server are reposted immediately so that depth receives stay queued.
+ */
+static int bg_reap(struct fid_cq *cq, uint64_t *cnt, int repost)
+{
+	struct fi_cq_entry comp[BG_BATCH];
+	ssize_t ret, err, i;
+
+	ret = fi_cq_read(cq, comp, BG_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	*cnt += ret;
+	for (i = 0; repost && i < ret; i++) {
+		do {
+			err = fi_recv(bg.ep, bg.rx_buf,
+				      bg.size + ft_rx_prefix_size(), bg.desc,
+				      0, comp[i].op_context);
+		} while (err == -FI_EAGAIN);
+		if (err) {
+			FT_PRINTERR("fi_recv", err);
+			return (int) err;
+		}
+		bg.rx_seq++;
+	}
+	return 0;
+}
+
+static int bg_post_send(size_t size, void *ctx)
+{
+	ssize_t ret;
+
+	while ((ret = fi_send(bg.ep, bg.tx_buf, size + ft_tx_prefix_size(),
+			      bg.desc, bg.remote_addr, ctx)) == -FI_EAGAIN) {
+		ret = bg_reap(bg.txcq, &bg.tx_cq_cntr, 0);
+		if (ret)
+			return (int) ret;
+	}
+	if (ret) {
+		FT_PRINTERR("fi_send", ret);
+		return (int) ret;
+	}
+	bg.tx_seq++;
+	return 0;
+}
+
+static int bg_wait(struct fid_cq *cq, uint64_t *cnt, uint64_t total,
+		   int repost)
+{
+	int ret;
+
+	while (*cnt < total) {
+		ret = bg_reap(cq, cnt, repost);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Client: send one window and wait for the server's acknowledgement */
+static int bg_send_window(void)
+{
+	ssize_t ret;
+	int i;
+
+	do {
+		ret = fi_recv(bg.ep, bg.rx_buf,
+			      FT_MAX_CTRL_MSG + ft_rx_prefix_size(), bg.desc,
+			      0, &bg.rx_ctx[0]);
+	} while (ret == -FI_EAGAIN);
+	if (ret) {
+		FT_PRINTERR("fi_recv", ret);
+		return (int) ret;
+	}
+	bg.rx_seq++;
+
+	for (i = 0; i < bg.depth; i++) {
+		ret = bg_post_send(bg.size, &bg.tx_ctx[i]);
+		if (ret)
+			return (int) ret;
+	}
+
+	ret = bg_wait(bg.txcq, &bg.tx_cq_cntr, bg.tx_seq, 0);
+	if (ret)
+		return (int) ret;
+
+	return bg_wait(bg.rxcq, &bg.rx_cq_cntr, bg.rx_seq, 0);
+}
+
+static void *bg_sender(void *arg)
+{
+	struct timespec now, next;
+
+	clock_gettime(CLOCK_MONOTONIC, &bg.start);
+	next = bg.start;
+	while (!bg.stop) {
+		if (bg.interval) {
+			do {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+			} while (get_elapsed(&next, &now, NANO) < 0 && !bg.stop);
+
+			/* fall behind rather than burst to catch up */
+			if (get_elapsed(&next, &now, NANO) > bg.interval)
+				next = now;
+			next.tv_nsec += bg.interval;
+			next.tv_sec += next.tv_nsec / 1000000000;
+			next.tv_nsec %= 1000000000;
+		}
+
+		bg.ret = bg_send_window();
+		if (bg.ret)
+			break;
+		bg.windows++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &bg.end);
+	return NULL;
+}
+
+/* Server: keep depth receives posted and acknowledge every window */
+static void *bg_receiver(void *arg)
+{
+	uint64_t acked = 0;
+	int i;
+
+	for (i = 0; i < bg.depth; i++) {
+		do {
+			bg.ret = fi_recv(bg.ep, bg.rx_buf,
+					 bg.size + ft_rx_prefix_size(),
+					 bg.desc, 0, &bg.rx_ctx[i]);
+		} while (bg.ret == -FI_EAGAIN);
+		if (bg.ret) {
+			FT_PRINTERR("fi_recv", bg.ret);
+			return NULL;
+		}
+		bg.rx_seq++;
+	}
+
+	while (!bg.stop) {
+		bg.ret = bg_reap(bg.rxcq, &bg.rx_cq_cntr, 1);
+		if (bg.ret)
+			return NULL;
+
+		for (; acked + bg.depth <= bg.rx_cq_cntr; acked += bg.depth) {
+			bg.ret = bg_post_send(BG_ACK_SIZE, &bg.tx_ctx[0]);
+			if (bg.ret)
+				return NULL;
+			bg.ret = bg_wait(bg.txcq, &bg.tx_cq_cntr, bg.tx_seq, 0);
+			if (bg.ret)
+				return NULL;
+		}
+	}
+	return NULL;
+}
+
+static int bg_start(void *(*fn)(void *))
+{
+	int ret;
+
+	bg.stop = 0;
+	bg.ret = 0;
+	bg.windows = 0;
+	ret = pthread_create(&bg.thread, NULL, fn, NULL);
+	if (ret) {
+		FT_PRINTERR("pthread_create", ret);
+		return -ret;
+	}
+	return 0;
+}
+
+static int bg_join(void)
+{
+	bg.stop = 1;
+	pthread_join(bg.thread, NULL);
+	return bg.ret;
+}
+
+/* Client: time the background flow alone to find its saturation rate */
+static int bg_calibrate(void)
+{
+	struct timespec a, b;
+	uint64_t windows = 0;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	do {
+		ret = bg_send_window();
+		if (ret)
+			return ret;
+		windows++;
+		clock_gettime(CLOCK_MONOTONIC, &b);
+	} while (get_elapsed(&a, &b, NANO) < BG_CAL_NSEC);
+
+	sat_window_nsec = get_elapsed(&a, &b, NANO) / windows;
+	return 0;
+}
+
+static void show_level(int pct)
+{
+	int64_t elapsed;
+	double mbps = 0.0;
+	char str[FT_STR_LEN];
+
+	if (pct) {
+		elapsed = get_elapsed(&bg.start, &bg.end, MICRO);
+		if (elapsed > 0)
+			mbps = (double) bg.windows * bg.depth * bg.size / elapsed;
+	}
+
+	if (opts.machr)
+		printf("- { bg_load: %d, bg_xfer_size: %zu, bg_window: %d, "
+			"bg_MB/sec: %f }\n", pct, bg.size, bg.depth, mbps);
+	else
+		printf("bg load %3d%%: %d x %s window, %.2f MB/sec\n", pct,
+			bg.depth, size_str(str, bg.size), mbps);
+
+	ft_hist_show("fg_pingpong", &fg_lat);
+}
+
+/*
+ * Client: one ping-pong run with the background flow paced to pct percent
+ * of saturation.  Half of each round trip is recorded.
+ */
+static int run_level(int pct)
+{
+	struct timespec a, b;
+	int ret, i;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr && pct) {
+		bg.interval = pct < 100 ? sat_window_nsec * 100 / pct : 0;
+		ret = bg_start(bg_sender);
+		if (ret)
+			return ret;
+	}
+
+	ft_hist_reset(&fg_lat);
+	for (i = 0; i < opts.iterations + opts.warmup_iterations; i++) {
+		if (i == opts.warmup_iterations)
+			ft_start();
+
+		if (opts.dst_addr) {
+			clock_gettime(CLOCK_MONOTONIC, &a);
+			if (opts.transfer_size < fi->tx_attr->inject_size)
+				ret = ft_inject(ep, opts.transfer_size);
+			else
+				ret = ft_tx(ep, remote_fi_addr, opts.transfer_size,
+					    &tx_ctx);
+			if (ret)
+				break;
+
+			ret = ft_rx(ep, opts.transfer_size);
+			if (ret)
+				break;
+			clock_gettime(CLOCK_MONOTONIC, &b);
+
+			if (i >= opts.warmup_iterations)
+				ft_hist_add(&fg_lat,
+					    get_elapsed(&a, &b, NANO) / 2);
+		} else {
+			ret = ft_rx(ep, opts.transfer_size);
+			if (ret)
+				break;
+
+			if (opts.transfer_size < fi->tx_attr->inject_size)
+				ret = ft_inject(ep, opts.transfer_size);
+			else
+				ret = ft_tx(ep, remote_fi_addr, opts.transfer_size,
+					    &tx_ctx);
+			if (ret)
+				break;
+		}
+	}
+	ft_stop();
+
+	if (opts.dst_addr && pct) {
+		i = bg_join();
+		if (!ret)
+			ret = i;
+	}
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr)
+		show_level(pct);
+	return 0;
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = bg_open();
+	if (ret)
+		return ret;
+
+	ret = bg_exchange_addr();
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr) {
+		ret = bg_start(bg_receiver);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_sync();
+	if (ret)
+		goto out;
+
+	if (opts.dst_addr) {
+		for (i = 0; i < level_cnt; i++) {
+			if (levels[i] && levels[i] < 100)
+				break;
+		}
+		if (i < level_cnt) {
+			ret = bg_calibrate();
+			if (ret)
+				goto out;
+		}
+	}
+
+	init_test(&opts, test_name, sizeof(test_name));
+	for (i = 0; i < level_cnt; i++) {
+		ret = run_level(levels[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = ft_finalize();
+out:
+	if (!opts.dst_addr) {
+		i = bg_join();
+		if (!ret)
+			ret = i;
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = 64;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hB:U:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'B':
+			bg.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'U':
+			if (ft_parse_int_list(optarg, levels, &level_cnt,
+					      BG_MAX_LEVELS, 0, 100)) {
+				fprintf(stderr, "Invalid load list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Ping pong latency under background "
+					"bandwidth load using RDM.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-B <size>", "background message size "
+					"(default 64k)");
+			FT_PRINT_OPTS_USAGE("-U <pct,...>", "background load levels, "
+					"in percent of saturation "
+					"(default 0,25,50,75,100)");
+			fprintf(stderr, "Note: -S sets the foreground message size "
+					"(default 64), -W the background window.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	bg.depth = MAX(opts.window_size, 1);
+	av_attr.count = 2;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	hints->domain_attr->threading = FI_THREAD_COMPLETION;
+	hints->domain_attr->resource_mgmt = FI_RM_ENABLED;
+
+	ret = run();
+
+	bg_close();
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Ping-pong across many domains and endpoints driven by a few threads.
+ *
+ * For each domain count D (-D) and endpoint count E (-E), both sides open
+ * D domains, each with its own AV and E endpoints.  Every endpoint has its
+ * own CQ and runs a ping-pong with the peer endpoint of the same index.
+ * -T threads drive all D x E endpoints: thread t owns every endpoint
+ * whose index is t modulo the thread count, and polls its CQs round-robin.
+ * For each D x E the client reports the aggregate message rate, the
+ * half round trip latency and the polling overhead: CQ reads per
+ * completion, the share of empty reads and the average time spent
+ * inside each fi_cq_read() call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define MD_MAX_LIST	16
+
+struct md_domain {
+	struct fid_domain *domain;
+	struct fid_av *av;
+};
+
+struct md_lane {
+	struct md_domain *dom;
+	struct fid_ep *ep;
+	struct fid_cq *cq;
+	struct fid_mr *mr;
+	void *desc;
+	void *buf;
+	void *tx_buf;
+	void *rx_buf;
+	fi_addr_t dest;
+	struct fi_context tx_ctx;
+	struct fi_context rx_ctx;
+
+	int rounds;
+	int tx_busy;
+	int rx_ready;
+	int want_send;
+	int want_recv;
+	int64_t sent_at;
+};
+
+struct md_thread {
+	int id;
+	pthread_t thread;
+	uint64_t polls;
+	uint64_t empty;
+	uint64_t comps;
+	int64_t poll_ns;
+	int64_t elapsed;
+	struct ft_hist lat;
+	int ret;
+};
+
+static int dom_cnts[MD_MAX_LIST] = { 1, 2, 4 }, dom_cnt_cnt = 3;
+static int ep_cnts[MD_MAX_LIST] = { 1, 4, 16 }, ep_cnt_cnt = 3;
+static int max_threads = 2;
+
+static int n_dom, n_lane, n_thread;
+static struct md_domain *doms;
+static struct md_lane *lanes;
+static struct md_thread *threads;
+static volatile int go;
+
+static int md_open_lane(struct md_lane *lane, int id)
+{
+	struct fi_cq_attr attr = {
+		.format = FI_CQ_FORMAT_CONTEXT,
+		.wait_obj = FI_WAIT_NONE,
+		.size = fi->tx_attr->size + fi->rx_attr->size,
+	};
+	size_t len;
+	int ret;
+
+	len = MAX(opts.transfer_size, FT_MAX_CTRL_MSG) +
+		MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+	lane->buf = calloc(2, len);
+	if (!lane->buf)
+		return -FI_ENOMEM;
+	lane->tx_buf = lane->buf;
+	lane->rx_buf = (char *) lane->buf + len;
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(lane->dom->domain, lane->buf, 2 * len,
+				FI_SEND | FI_RECV, 0, FT_MR_KEY + 1 + id, 0,
+				&lane->mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		lane->desc = fi_mr_desc(lane->mr);
+	}
+
+	ret = fi_cq_open(lane->dom->domain, &attr, &lane->cq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+
+	ret = fi_endpoint(lane->dom->domain, fi, &lane->ep, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_endpoint", ret);
+		return ret;
+	}
+
+	FT_EP_BIND(lane->ep, lane->dom->av, 0);
+	FT_EP_BIND(lane->ep, lane->cq, FI_TRANSMIT | FI_RECV);
+
+	ret = fi_enable(lane->ep);
+	if (ret) {
+		FT_PRINTERR("fi_enable", ret);
+		return ret;
+	}
+	return 0;
+}
+
+static int md_open(int d, int e)
+{
+	int i, ret;
+
+	n_dom = d;
+	n_lane = d * e;
+	n_thread = MIN(max_threads, n_lane);
+
+	doms = calloc(n_dom, sizeof *doms);
+	lanes = calloc(n_lane, sizeof *lanes);
+	threads = calloc(n_thread, sizeof *threads);
+	if (!doms || !lanes || !threads)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < n_dom; i++) {
+		ret = fi_domain(fabric, fi, &doms[i].domain, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_domain", ret);
+			return ret;
+		}
+
+		ret = fi_av_open(doms[i].domain, &av_attr, &doms[i].av, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_av_open", ret);
+			return ret;
+		}
+	}
+
+	for (i = 0; i < n_lane; i++) {
+		lanes[i].dom = &doms[i / e];
+		ret = md_open_lane(&lanes[i], i);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void md_close(void)
+{
+	int i;
+
+	for (i = 0; lanes && i < n_lane; i++) {
+		FT_CLOSE_FID(lanes[i].ep);
+		FT_CLOSE_FID(lanes[i].cq);
+		FT_CLOSE_FID(lanes[i].mr);
+		free(lanes[i].buf);
+	}
+	for (i = 0; doms && i < n_dom; i++) {
+		FT_CLOSE_FID(doms[i].av);
+		FT_CLOSE_FID(doms[i].domain);
+	}
+	free(lanes);
+	free(doms);
+	free(threads);
+	lanes = NULL;
+	doms = NULL;
+	threads = NULL;
+}
+
+/* Trade an endpoint name over the control endpoint */
+static int md_exchange_addr(struct md_lane *lane)
+{
+	size_t addrlen = FT_MAX_CTRL_MSG;
+	int ret;
+
+	ret = fi_getname(&lane->ep->fid, (char *) tx_buf + ft_tx_prefix_size(),
+			 &addrlen);
+	if (ret) {
+		FT_PRINTERR("fi_getname", ret);
+		return ret;
+	}
+
+	if (opts.dst_addr) {
+		ret = ft_tx(ep, remote_fi_addr, addrlen, &tx_ctx);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_get_rx_comp(rx_seq);
+	if (ret)
+		return ret;
+
+	ret = ft_av_insert(lane->dom->av, (char *) rx_buf + ft_rx_prefix_size(),
+			   1, &lane->dest, 0, NULL);
+	if (ret)
+		return ret;
+
+	ret = ft_post_rx(ep, rx_size, &rx_ctx);
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr)
+		ret = ft_tx(ep, remote_fi_addr, addrlen, &tx_ctx);
+
+	return ret;
+}
+
+/*
+ * A blocked post is retried on the next pass over the lane rather than
+ * spun on, so a thread keeps progressing its other endpoints.  The
+ * receive for the next round is always posted before the send.
+ */
+static int md_post(struct md_lane *lane)
+{
+	ssize_t ret;
+
+	if (lane->want_recv) {
+		ret = fi_recv(lane->ep, lane->rx_buf,
+			      MAX(opts.transfer_size, FT_MAX_CTRL_MSG) +
+			      ft_rx_prefix_size(), lane->desc, 0,
+			      &lane->rx_ctx);
+		if (ret == -FI_EAGAIN)
+			return 0;
+		if (ret) {
+			FT_PRINTERR("fi_recv", ret);
+			return (int) ret;
+		}
+		lane->want_recv = 0;
+	}
+
+	if (lane->want_send) {
+		lane->sent_at = ft_gettime_ns();
+		ret = fi_send(lane->ep, lane->tx_buf,
+			      opts.transfer_size + ft_tx_prefix_size(),
+			      lane->desc, lane->dest, &lane->tx_ctx);
+		if (ret == -FI_EAGAIN)
+			return 0;
+		if (ret) {
+			FT_PRINTERR("fi_send", ret);
+			return (int) ret;
+		}
+		lane->want_send = 0;
+		lane->tx_busy = 1;
+	}
+	return 0;
+}
+
+static inline int md_done(struct md_lane *lane)
+{
+	return lane->rounds == opts.iterations && !lane->tx_busy &&
+	       !lane->want_send;
+}
+
+static int md_progress(struct md_thread *th, struct md_lane *lane)
+{
+	struct fi_cq_entry comp[2];
+	int64_t start;
+	ssize_t ret, i;
+
+	start = ft_gettime_ns();
+	ret = fi_cq_read(lane->cq, comp, 2);
+	th->poll_ns += ft_gettime_ns() - start;
+	th->polls++;
+	if (ret == -FI_EAGAIN) {
+		th->empty++;
+	} else if (ret == -FI_EAVAIL) {
+		return ft_cq_readerr(lane->cq);
+	} else if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	for (i = 0; i < ret; i++) {
+		th->comps++;
+		if (comp[i].op_context == &lane->tx_ctx)
+			lane->tx_busy = 0;
+		else
+			lane->rx_ready = 1;
+	}
+
+	if (lane->rx_ready && !lane->tx_busy) {
+		lane->rx_ready = 0;
+		lane->rounds++;
+		if (opts.dst_addr)
+			ft_hist_add(&th->lat,
+				    (ft_gettime_ns() - lane->sent_at) / 2);
+
+		lane->want_recv = lane->rounds < opts.iterations;
+		lane->want_send = opts.dst_addr ? lane->want_recv : 1;
+	}
+
+	return md_post(lane);
+}
+
+static void *md_thread(void *arg)
+{
+	struct md_thread *th = arg;
+	int64_t start;
+	int i, active;
+
+	while (!go)
+		;
+
+	start = ft_gettime_ns();
+	do {
+		active = 0;
+		for (i = th->id; i < n_lane; i += n_thread) {
+			if (md_done(&lanes[i]))
+				continue;
+
+			th->ret = md_progress(th, &lanes[i]);
+			if (th->ret)
+				goto out;
+			active++;
+		}
+	} while (active);
+out:
+	th->elapsed = ft_gettime_ns() - start;
+	return NULL;
+}
+
+/* Each server receive is posted before the step's ft_sync() */
+static int md_prepare(void)
+{
+	int i, ret;
+
+	for (i = 0; i < n_lane; i++) {
+		ret = md_exchange_addr(&lanes[i]);
+		if (ret)
+			return ret;
+
+		lanes[i].want_recv = 1;
+		lanes[i].want_send = 0;
+		ret = md_post(&lanes[i]);
+		if (ret)
+			return ret;
+		if (lanes[i].want_recv) {
+			FT_ERR("fi_recv: receive queue full");
+			return -FI_EAGAIN;
+		}
+		lanes[i].want_send = opts.dst_addr ? 1 : 0;
+	}
+	return 0;
+}
+
+static int md_run(void)
+{
+	int i, ret = 0, n = n_thread;
+
+	go = 0;
+	for (i = 0; i < n; i++) {
+		threads[i].id = i;
+		ft_hist_reset(&threads[i].lat);
+		ret = pthread_create(&threads[i].thread, NULL, md_thread,
+				     &threads[i]);
+		if (ret) {
+			FT_PRINTERR("pthread_create", ret);
+			n = i;
+			ret = -ret;
+			break;
+		}
+	}
+
+	go = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (!ret)
+			ret = threads[i].ret;
+	}
+	return ret;
+}
+
+static void md_show(int e)
+{
+	struct ft_hist lat;
+	uint64_t polls = 0, empty = 0, comps = 0;
+	int64_t elapsed = 0, poll_ns = 0;
+	double rate;
+	char name[FT_STR_LEN];
+	int i;
+
+	ft_hist_reset(&lat);
+	for (i = 0; i < n_thread; i++) {
+		elapsed = MAX(elapsed, threads[i].elapsed);
+		poll_ns += threads[i].poll_ns;
+		polls += threads[i].polls;
+		empty += threads[i].empty;
+		comps += threads[i].comps;
+		ft_hist_merge(&lat, &threads[i].lat);
+	}
+
+	rate = 2.0 * n_lane * opts.iterations * 1e3 / elapsed;
+	if (opts.machr)
+		printf("- { domains: %d, endpoints: %d, threads: %d, "
+			"Mmsg/sec: %f, polls_per_comp: %f, empty_polls: %f, "
+			"nsec_per_poll: %f }\n", n_dom, e, n_thread, rate,
+			(double) polls / comps, (double) empty / polls,
+			(double) poll_ns / polls);
+	else
+		printf("%7d %9d %7d %9.3f %10.2f %8.1f%% %10.1f\n", n_dom, e,
+			n_thread, rate, (double) polls / comps,
+			100.0 * empty / polls, (double) poll_ns / polls);
+
+	snprintf(name, sizeof name, "d%d_e%d", n_dom, e);
+	ft_hist_show(name, &lat);
+}
+
+static int run_step(int d, int e)
+{
+	int ret;
+
+	ret = md_open(d, e);
+	if (ret)
+		goto out;
+
+	ret = md_prepare();
+	if (ret)
+		goto out;
+
+	ret = ft_sync();
+	if (ret)
+		goto out;
+
+	ret = md_run();
+	if (ret)
+		goto out;
+
+	ret = ft_sync();
+	if (ret)
+		goto out;
+
+	if (opts.dst_addr)
+		md_show(e);
+out:
+	md_close();
+	return ret;
+}
+
+static int run(void)
+{
+	int d, e, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	for (d = 0; d < dom_cnt_cnt; d++) {
+		for (e = 0; e < ep_cnt_cnt; e++) {
+			if (opts.dst_addr && !opts.machr)
+				printf("%7s %9s %7s %9s %10s %9s %10s\n",
+					"domains", "endpoints", "threads",
+					"Mmsg/s", "polls/comp", "empty",
+					"ns/poll");
+
+			ret = run_step(dom_cnts[d], ep_cnts[e]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.iterations = 10000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hD:E:T:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'D':
+			if (ft_parse_int_list(optarg, dom_cnts, &dom_cnt_cnt,
+					      MD_MAX_LIST, 1, 256)) {
+				fprintf(stderr, "Invalid domain counts: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'E':
+			if (ft_parse_int_list(optarg, ep_cnts, &ep_cnt_cnt,
+					      MD_MAX_LIST, 1, 4096)) {
+				fprintf(stderr, "Invalid endpoint counts: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			max_threads = atoi(optarg);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Ping-pong across many domains and "
+					"endpoints driven by a few threads.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-D <cnt,...>", "domain counts "
+					"(default 1,2,4)");
+			FT_PRINT_OPTS_USAGE("-E <cnt,...>", "endpoints per domain "
+					"(default 1,4,16)");
+			FT_PRINT_OPTS_USAGE("-T <count>", "polling threads "
+					"(default 2)");
+			fprintf(stderr, "Note: -I is the number of round trips "
+					"per endpoint, and all options must match "
+					"on both sides.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (max_threads < 1) {
+		fprintf(stderr, "Thread count must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	hints->domain_attr->threading = FI_THREAD_COMPLETION;
+
+	ret = run();
+
+	md_close();
+	ft_free_res();
+	return -ret;
+}
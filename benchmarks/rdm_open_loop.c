@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Open-loop request/reply load generator.
+ *
+ * Closed-loop tests only issue the next message once an earlier one has
+ * completed, so a slow response also delays the requests that would have
+ * observed it.  Here the client builds a send schedule up front for the
+ * target rate, posts each request when its scheduled time arrives, and
+ * measures latency from the scheduled time rather than the actual post
+ * time.  The server echoes every request back.  Sweeping the offered rate
+ * with -R gives a latency versus throughput curve.
+ *
+ * Request traffic is tagged with OL_TAG, above the sequence number tags
+ * that ft_sync() control messages use, so the two never match.  The
+ * control receive still completes on the shared rxcq, so ol_read()
+ * filters it out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define OL_TAG		(1ULL << 40)
+#define OL_MAX_RATES	16
+#define OL_BATCH	16
+
+enum ol_arrival {
+	OL_CONSTANT,
+	OL_POISSON,
+	OL_BURST,
+};
+
+static const char *ol_arrival_str[] = {
+	[OL_CONSTANT] = "constant",
+	[OL_POISSON] = "poisson",
+	[OL_BURST] = "burst",
+};
+
+struct ol_slot {
+	struct fi_context context;
+	char *buf;
+};
+
+static enum ol_arrival arrival = OL_CONSTANT;
+static int burst = 32;
+static uint64_t rates[OL_MAX_RATES] = { 10000, 100000, 250000, 500000, 1000000 };
+static int rate_cnt = 5;
+
+static int depth;
+static size_t slot_size;
+static void *slot_buf;
+static struct fid_mr *slot_mr;
+static void *slot_desc;
+static struct ol_slot *tx_slots, *rx_slots;
+static struct ol_slot **tx_free;
+static int tx_free_cnt;
+
+static int64_t *sched;
+static struct ft_hist ol_lat;
+
+static int parse_rates(char *str)
+{
+	char *end;
+	uint64_t rate;
+
+	for (rate_cnt = 0; *str; str = end) {
+		rate = strtoull(str, &end, 0);
+		if (end == str || !rate || rate_cnt == OL_MAX_RATES)
+			return -FI_EINVAL;
+		rates[rate_cnt++] = rate;
+		if (*end == ',')
+			end++;
+	}
+	return rate_cnt ? 0 : -FI_EINVAL;
+}
+
+static int parse_arrival(char *str)
+{
+	int i;
+
+	for (i = 0; i <= OL_BURST; i++) {
+		if (!strcmp(str, ol_arrival_str[i])) {
+			arrival = i;
+			return 0;
+		}
+	}
+	return -FI_EINVAL;
+}
+
+/* Intended send times, in ns from the start of the run */
+static void ol_build_sched(uint64_t rate)
+{
+	double gap = 1e9 / rate, t = 0.0;
+	int i;
+
+	srand48(1);
+	for (i = 0; i < opts.iterations; i++) {
+		switch (arrival) {
+		case OL_CONSTANT:
+			sched[i] = (int64_t) (i * gap);
+			break;
+		case OL_POISSON:
+			sched[i] = (int64_t) t;
+			t -= log(1.0 - drand48()) * gap;
+			break;
+		case OL_BURST:
+			sched[i] = (int64_t) ((i / burst) * burst * gap);
+			break;
+		}
+	}
+}
+
+static int ol_alloc(void)
+{
+	int i, ret;
+
+	depth = MAX(opts.window_size, 1);
+	slot_size = MAX(opts.transfer_size, sizeof(uint64_t)) +
+		    MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+
+	slot_buf = calloc(2 * depth, slot_size);
+	tx_slots = calloc(depth, sizeof *tx_slots);
+	rx_slots = calloc(depth, sizeof *rx_slots);
+	tx_free = calloc(depth, sizeof *tx_free);
+	sched = calloc(opts.iterations, sizeof *sched);
+	if (!slot_buf || !tx_slots || !rx_slots || !tx_free || !sched)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < depth; i++) {
+		rx_slots[i].buf = (char *) slot_buf + i * slot_size;
+		tx_slots[i].buf = (char *) slot_buf + (depth + i) * slot_size;
+		tx_free[i] = &tx_slots[i];
+	}
+	tx_free_cnt = depth;
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(domain, slot_buf, 2 * depth * slot_size,
+				FI_SEND | FI_RECV, 0, FT_MR_KEY + 1, 0,
+				&slot_mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		slot_desc = fi_mr_desc(slot_mr);
+	}
+	return 0;
+}
+
+static void ol_free(void)
+{
+	FT_CLOSE_FID(slot_mr);
+	free(slot_buf);
+	free(tx_slots);
+	free(rx_slots);
+	free(tx_free);
+	free(sched);
+}
+
+static int ol_post_recv(struct ol_slot *slot)
+{
+	ssize_t ret;
+
+	do {
+		ret = fi_trecv(ep, slot->buf, slot_size, slot_desc, 0, OL_TAG,
+			       0, &slot->context);
+	} while (ret == -FI_EAGAIN);
+	if (ret)
+		FT_PRINTERR("fi_trecv", ret);
+	return (int) ret;
+}
+
+/*
+ * The receive ft_rx() keeps posted for the next sync completes on rxcq if
+ * the peer reaches that sync first.  It is dropped from the batch and
+ * credited to rx_cq_cntr so that ft_rx() still finds it.
+ */
+static int ol_read(struct fid_cq *cq, struct fi_cq_entry *comp)
+{
+	ssize_t ret;
+	int i, n;
+
+	ret = fi_cq_read(cq, comp, OL_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	for (i = n = 0; i < ret; i++) {
+		if (comp[i].op_context == &rx_ctx)
+			rx_cq_cntr++;
+		else
+			comp[n++] = comp[i];
+	}
+	return n;
+}
+
+/* Server: a send completion releases the request buffer for reuse */
+static int ol_server_reap_tx(int *replied)
+{
+	struct fi_cq_entry comp[OL_BATCH];
+	int i, ret;
+
+	ret = ol_read(txcq, comp);
+	for (i = 0; i < ret; i++) {
+		(*replied)++;
+		if (ol_post_recv(comp[i].op_context))
+			return -FI_EOTHER;
+	}
+	return ret < 0 ? ret : 0;
+}
+
+static int ol_server(void)
+{
+	struct fi_cq_entry comp[OL_BATCH];
+	struct ol_slot *slot;
+	int replied = 0, i, ret;
+	ssize_t rc;
+
+	while (replied < opts.iterations) {
+		ret = ol_read(rxcq, comp);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < ret; i++) {
+			slot = comp[i].op_context;
+			while ((rc = fi_tsend(ep, slot->buf,
+					      opts.transfer_size +
+					      ft_tx_prefix_size(), slot_desc,
+					      remote_fi_addr, OL_TAG,
+					      &slot->context)) == -FI_EAGAIN) {
+				rc = ol_server_reap_tx(&replied);
+				if (rc)
+					return (int) rc;
+			}
+			if (rc) {
+				FT_PRINTERR("fi_tsend", rc);
+				return (int) rc;
+			}
+		}
+
+		ret = ol_server_reap_tx(&replied);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void ol_show(uint64_t rate, int64_t elapsed, int64_t max_lag)
+{
+	double achieved = opts.iterations * 1e9 / elapsed;
+
+	if (opts.machr)
+		printf("- { arrival: %s, xfer_size: %d, offered_msgs/sec: %lu, "
+			"achieved_msgs/sec: %.0f, max_post_lag_usec: %.2f }\n",
+			ol_arrival_str[arrival], opts.transfer_size,
+			(unsigned long) rate, achieved, max_lag / 1000.0);
+	else
+		printf("%s arrivals: offered %lu msgs/sec, achieved %.0f "
+			"msgs/sec, max post lag %.2f usec\n",
+			ol_arrival_str[arrival], (unsigned long) rate,
+			achieved, max_lag / 1000.0);
+
+	ft_hist_show("open_loop", &ol_lat);
+}
+
+/*
+ * Client: post each request once its scheduled time has passed.  At most
+ * depth requests are outstanding; a request held back by that limit is
+ * still charged from its scheduled time, and the delay shows up as post
+ * lag.
+ */
+static int ol_client(uint64_t rate)
+{
+	struct fi_cq_entry comp[OL_BATCH];
+	struct ol_slot *slot;
+	int64_t start, now, lag, max_lag = 0;
+	int sent = 0, done = 0, i, ret;
+	uint64_t seq;
+	ssize_t rc;
+
+	ft_hist_reset(&ol_lat);
+	start = ft_gettime_ns();
+	while (done < opts.iterations) {
+		now = ft_gettime_ns();
+		while (sent < opts.iterations && tx_free_cnt &&
+		       sent - done < depth && now - start >= sched[sent]) {
+			slot = tx_free[--tx_free_cnt];
+			*(uint64_t *) (slot->buf + ft_tx_prefix_size()) = sent;
+			rc = fi_tsend(ep, slot->buf,
+				      opts.transfer_size + ft_tx_prefix_size(),
+				      slot_desc, remote_fi_addr, OL_TAG,
+				      &slot->context);
+			if (rc == -FI_EAGAIN) {
+				tx_free_cnt++;
+				break;
+			}
+			if (rc) {
+				FT_PRINTERR("fi_tsend", rc);
+				return (int) rc;
+			}
+
+			lag = now - start - sched[sent];
+			if (lag > max_lag)
+				max_lag = lag;
+			sent++;
+		}
+
+		ret = ol_read(txcq, comp);
+		if (ret < 0)
+			return ret;
+		for (i = 0; i < ret; i++)
+			tx_free[tx_free_cnt++] = comp[i].op_context;
+
+		ret = ol_read(rxcq, comp);
+		if (ret < 0)
+			return ret;
+		if (ret)
+			now = ft_gettime_ns();
+		for (i = 0; i < ret; i++) {
+			slot = comp[i].op_context;
+			seq = *(uint64_t *) (slot->buf + ft_rx_prefix_size());
+			ft_hist_add(&ol_lat, now - start - sched[seq]);
+			done++;
+			if (ol_post_recv(slot))
+				return -FI_EOTHER;
+		}
+	}
+
+	while (tx_free_cnt < depth) {
+		ret = ol_read(txcq, comp);
+		if (ret < 0)
+			return ret;
+		for (i = 0; i < ret; i++)
+			tx_free[tx_free_cnt++] = comp[i].op_context;
+	}
+
+	ol_show(rate, ft_gettime_ns() - start, max_lag);
+	return 0;
+}
+
+static int run(void)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ol_alloc();
+	if (ret)
+		return ret;
+
+	for (i = 0; i < depth; i++) {
+		ret = ol_post_recv(&rx_slots[i]);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < rate_cnt; i++) {
+		if (opts.dst_addr)
+			ol_build_sched(rates[i]);
+
+		ret = ft_sync();
+		if (ret)
+			return ret;
+
+		ret = opts.dst_addr ? ol_client(rates[i]) : ol_server();
+		if (ret)
+			return ret;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = 64;
+	opts.iterations = 100000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hA:B:R:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'A':
+			if (parse_arrival(optarg)) {
+				fprintf(stderr, "Invalid arrival process: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'B':
+			burst = atoi(optarg);
+			if (burst < 1) {
+				fprintf(stderr, "Invalid burst length: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if (parse_rates(optarg)) {
+				fprintf(stderr, "Invalid rate list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Open-loop request/reply latency "
+					"versus offered load using RDM.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-A <arrival>", "send schedule: "
+					"constant|poisson|burst (default constant)");
+			FT_PRINT_OPTS_USAGE("-B <count>", "messages per burst "
+					"for -A burst (default 32)");
+			FT_PRINT_OPTS_USAGE("-R <rate,...>", "offered rates in "
+					"msgs/sec, same list on both sides");
+			fprintf(stderr, "Note: -W bounds the outstanding requests, "
+					"-I is the number of requests per rate.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (opts.transfer_size < (int) sizeof(uint64_t)) {
+		fprintf(stderr, "Transfer size must be at least %zu\n",
+			sizeof(uint64_t));
+		return EXIT_FAILURE;
+	}
+
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_TAGGED;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = run();
+
+	ol_free();
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Ping-pong with several independent streams in flight on one endpoint.
+ *
+ * Stream i sends with tag PP_TAG | i and the server echoes each message
+ * back on the same tag, so every stream keeps exactly one round trip
+ * outstanding.  The number of streams is doubled from 1 up to -Q.  Each
+ * step reports the round trip time histogram and the aggregate
+ * transactions per second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define PP_TAG		(1ULL << 40)
+#define PP_BATCH	16
+
+struct pp_slot {
+	struct fi_context context;
+	char *buf;
+	int stream;
+};
+
+struct pp_stream {
+	struct pp_slot tx, rx;
+	int remaining;
+	int tx_busy, rx_busy;
+	int64_t post;
+};
+
+/* Completions reaped while a post was retrying, returned by pp_read() */
+struct pp_backlog {
+	struct fi_cq_entry *comp;
+	int cnt;
+};
+
+static int max_streams = 256;
+static struct pp_stream *streams;
+static struct pp_backlog tx_backlog, rx_backlog;
+static size_t slot_size;
+static void *slot_buf;
+static struct fid_mr *slot_mr;
+static void *slot_desc;
+static struct ft_hist rtt;
+
+static int pp_alloc(void)
+{
+	int i, ret;
+
+	slot_size = opts.transfer_size +
+		    MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+	slot_buf = calloc(2 * max_streams, slot_size);
+	streams = calloc(max_streams, sizeof *streams);
+	/* one entry per stream, plus the sync receive on rxcq */
+	tx_backlog.comp = calloc(max_streams + 1, sizeof *tx_backlog.comp);
+	rx_backlog.comp = calloc(max_streams + 1, sizeof *rx_backlog.comp);
+	if (!slot_buf || !streams || !tx_backlog.comp || !rx_backlog.comp)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < max_streams; i++) {
+		streams[i].rx.buf = (char *) slot_buf + 2 * i * slot_size;
+		streams[i].tx.buf = streams[i].rx.buf + slot_size;
+		streams[i].rx.stream = streams[i].tx.stream = i;
+	}
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(domain, slot_buf, 2 * max_streams * slot_size,
+				FI_SEND | FI_RECV, 0, FT_MR_KEY + 1, 0,
+				&slot_mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		slot_desc = fi_mr_desc(slot_mr);
+	}
+	return 0;
+}
+
+static void pp_free(void)
+{
+	FT_CLOSE_FID(slot_mr);
+	free(slot_buf);
+	free(streams);
+	free(tx_backlog.comp);
+	free(rx_backlog.comp);
+}
+
+static int pp_read(struct fid_cq *cq, struct fi_cq_entry *comp)
+{
+	struct pp_backlog *bl = cq == txcq ? &tx_backlog : &rx_backlog;
+	ssize_t ret;
+
+	if (bl->cnt) {
+		ret = MIN(bl->cnt, PP_BATCH);
+		memcpy(comp, bl->comp, ret * sizeof *comp);
+		bl->cnt -= ret;
+		memmove(bl->comp, bl->comp + ret, bl->cnt * sizeof *comp);
+		return (int) ret;
+	}
+
+	ret = fi_cq_read(cq, comp, PP_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(cq);
+	if (ret < 0)
+		FT_PRINTERR("fi_cq_read", ret);
+	return (int) ret;
+}
+
+/*
+ * The receive that ft_rx() reposts for the next sync shares rxcq with the
+ * streams and can complete while they are still running if the peer gets
+ * to its next sync first.  Credit it to rx_cq_cntr so ft_rx() finds it.
+ */
+static int pp_ctrl_comp(struct fi_cq_entry *comp)
+{
+	if (comp->op_context != &rx_ctx)
+		return 0;
+	rx_cq_cntr++;
+	return 1;
+}
+
+static int pp_stash(struct fid_cq *cq)
+{
+	struct pp_backlog *bl = cq == txcq ? &tx_backlog : &rx_backlog;
+	ssize_t ret, i;
+
+	if (bl->cnt > max_streams)
+		return 0;
+
+	ret = fi_cq_read(cq, bl->comp + bl->cnt, max_streams + 1 - bl->cnt);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	/* a sync receive is credited now, the main loop may not read again */
+	for (i = 0; i < ret; i++) {
+		if (!pp_ctrl_comp(&bl->comp[bl->cnt]))
+			bl->cnt++;
+		else
+			memmove(&bl->comp[bl->cnt], &bl->comp[bl->cnt + 1],
+				(ret - i - 1) * sizeof *bl->comp);
+	}
+	return 0;
+}
+
+/*
+ * A post that returns -FI_EAGAIN may be waiting on queue space that only
+ * frees up once completions are read, which on manual progress providers
+ * is also what drives the transfers.  The completions are stashed for the
+ * main loop rather than handled here, so posts never nest.
+ */
+static int pp_retry(void)
+{
+	int ret;
+
+	ret = pp_stash(txcq);
+	if (ret)
+		return ret;
+	return pp_stash(rxcq);
+}
+
+static int pp_post_recv(struct pp_stream *s)
+{
+	ssize_t ret;
+
+	while ((ret = fi_trecv(ep, s->rx.buf, slot_size, slot_desc, 0,
+			       PP_TAG | s->rx.stream, 0, &s->rx.context)) ==
+	       -FI_EAGAIN) {
+		ret = pp_retry();
+		if (ret)
+			return (int) ret;
+	}
+	if (ret) {
+		FT_PRINTERR("fi_trecv", ret);
+		return (int) ret;
+	}
+	s->rx_busy = 1;
+	return 0;
+}
+
+static int pp_post_send(struct pp_stream *s, struct pp_slot *slot)
+{
+	ssize_t ret;
+
+	while ((ret = fi_tsend(ep, slot->buf,
+			       opts.transfer_size + ft_tx_prefix_size(),
+			       slot_desc, remote_fi_addr,
+			       PP_TAG | slot->stream, &s->tx.context)) ==
+	       -FI_EAGAIN) {
+		ret = pp_retry();
+		if (ret)
+			return (int) ret;
+	}
+	if (ret) {
+		FT_PRINTERR("fi_tsend", ret);
+		return (int) ret;
+	}
+	s->tx_busy = 1;
+	return 0;
+}
+
+/*
+ * A client stream starts its next round trip only once both the reply and
+ * the completion of its previous send have been seen, so its buffers are
+ * never reused while in flight.
+ */
+static int pp_client_next(struct pp_stream *s)
+{
+	int ret;
+
+	if (s->tx_busy || s->rx_busy || !s->remaining)
+		return 0;
+
+	s->remaining--;
+	ret = pp_post_recv(s);
+	if (ret)
+		return ret;
+
+	s->post = ft_gettime_ns();
+	return pp_post_send(s, &s->tx);
+}
+
+static int pp_client(int nstreams, int iters, int record)
+{
+	struct fi_cq_entry comp[PP_BATCH];
+	struct pp_stream *s;
+	struct pp_slot *slot;
+	int64_t now;
+	int done = 0, i, n, ret;
+
+	for (i = 0; i < nstreams; i++) {
+		streams[i].remaining = iters;
+		ret = pp_client_next(&streams[i]);
+		if (ret)
+			return ret;
+	}
+
+	while (done < nstreams * iters) {
+		n = pp_read(rxcq, comp);
+		if (n < 0)
+			return n;
+		if (n)
+			now = ft_gettime_ns();
+		for (i = 0; i < n; i++) {
+			if (pp_ctrl_comp(&comp[i]))
+				continue;
+			slot = comp[i].op_context;
+			s = &streams[slot->stream];
+			s->rx_busy = 0;
+			done++;
+			if (record)
+				ft_hist_add(&rtt, now - s->post);
+			ret = pp_client_next(s);
+			if (ret)
+				return ret;
+		}
+
+		n = pp_read(txcq, comp);
+		if (n < 0)
+			return n;
+		for (i = 0; i < n; i++) {
+			slot = comp[i].op_context;
+			s = &streams[slot->stream];
+			s->tx_busy = 0;
+			ret = pp_client_next(s);
+			if (ret)
+				return ret;
+		}
+	}
+
+	while (1) {
+		for (i = 0; i < nstreams && !streams[i].tx_busy; i++)
+			;
+		if (i == nstreams)
+			break;
+
+		n = pp_read(txcq, comp);
+		if (n < 0)
+			return n;
+		for (i = 0; i < n; i++) {
+			slot = comp[i].op_context;
+			streams[slot->stream].tx_busy = 0;
+		}
+	}
+	return 0;
+}
+
+/* Server: echo each request from its receive buffer, repost on completion */
+static int pp_server(int nstreams, int iters)
+{
+	struct fi_cq_entry comp[PP_BATCH];
+	struct pp_slot *slot;
+	int done = 0, i, n, ret;
+
+	for (i = 0; i < nstreams && iters; i++) {
+		streams[i].remaining = iters;
+		ret = pp_post_recv(&streams[i]);
+		if (ret)
+			return ret;
+	}
+
+	while (done < nstreams * iters) {
+		n = pp_read(rxcq, comp);
+		if (n < 0)
+			return n;
+		for (i = 0; i < n; i++) {
+			if (pp_ctrl_comp(&comp[i]))
+				continue;
+			slot = comp[i].op_context;
+			ret = pp_post_send(&streams[slot->stream], slot);
+			if (ret)
+				return ret;
+		}
+
+		n = pp_read(txcq, comp);
+		if (n < 0)
+			return n;
+		for (i = 0; i < n; i++) {
+			slot = comp[i].op_context;
+			streams[slot->stream].tx_busy = 0;
+			done++;
+			if (--streams[slot->stream].remaining) {
+				ret = pp_post_recv(&streams[slot->stream]);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+static void pp_show(int nstreams, int64_t elapsed)
+{
+	double tps = (double) rtt.count * 1e9 / elapsed;
+	char name[FT_STR_LEN];
+
+	if (opts.machr)
+		printf("- { streams: %d, xfer_size: %d, transactions/sec: %.0f }\n",
+			nstreams, opts.transfer_size, tps);
+	else
+		printf("%d streams: %.0f transactions/sec\n", nstreams, tps);
+
+	snprintf(name, sizeof name, "rtt_q%d", nstreams);
+	ft_hist_show(name, &rtt);
+}
+
+static int run_streams(int nstreams)
+{
+	int64_t start;
+	int ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr) {
+		ret = pp_server(nstreams, opts.warmup_iterations);
+		if (ret)
+			return ret;
+		return pp_server(nstreams, opts.iterations);
+	}
+
+	ret = pp_client(nstreams, opts.warmup_iterations, 0);
+	if (ret)
+		return ret;
+
+	ft_hist_reset(&rtt);
+	start = ft_gettime_ns();
+	ret = pp_client(nstreams, opts.iterations, 1);
+	if (ret)
+		return ret;
+
+	pp_show(nstreams, ft_gettime_ns() - start);
+	return 0;
+}
+
+static int run(void)
+{
+	int nstreams, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = pp_alloc();
+	if (ret)
+		return ret;
+
+	for (nstreams = 1; ; nstreams = MIN(nstreams * 2, max_streams)) {
+		ret = run_streams(nstreams);
+		if (ret)
+			return ret;
+		if (nstreams == max_streams)
+			break;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = 64;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hQ:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'Q':
+			max_streams = atoi(optarg);
+			if (max_streams < 1) {
+				fprintf(stderr, "Invalid stream count: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Ping pong with multiple outstanding "
+					"streams using tagged messages.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-Q <streams>", "maximum number of "
+					"streams, doubled from 1 (default 256)");
+			fprintf(stderr, "Note: -I is the number of round trips "
+					"per stream.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_TAGGED;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = run();
+
+	pp_free();
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Dependent remote reads through a randomized linked list.
+ *
+ * The server fills the first footprint bytes of its registered buffer
+ * with PC_NODE-byte nodes that form one random cycle.  The first word of
+ * each node holds the offset of the next node.  The client follows the
+ * list with fi_read, taking each target from the previous result, so each
+ * read pays the full network and remote memory latency.  For comparison,
+ * it also issues independent reads to random nodes, one at a time and
+ * then -W at a time.  The footprint doubles from 4k up to -M.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define PC_NODE		64
+#define PC_MIN_FOOTPRINT 4096
+#define PC_BATCH	16
+
+static size_t max_footprint = 1 << 26;
+static struct fi_rma_iov remote;
+static struct fi_context *ctx_arr;
+static uint64_t *targets;
+static struct ft_hist dep_lat, indep_lat;
+
+static inline uint64_t pc_rand(void)
+{
+	return ((uint64_t) lrand48() << 31) ^ lrand48();
+}
+
+/* the list starts past the control message area of the receive buffer */
+static char *pc_base(void)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static uint64_t *pc_local(int i)
+{
+	return (uint64_t *) ((char *) tx_buf + ft_tx_prefix_size()) + i;
+}
+
+/* Server: Sattolo's shuffle yields a single cycle through every node */
+static void pc_build_list(size_t footprint)
+{
+	uint64_t n = footprint / PC_NODE, i, j, tmp;
+	char *base = pc_base();
+
+	for (i = 0; i < n; i++)
+		*(uint64_t *) (base + i * PC_NODE) = i;
+
+	for (i = n - 1; i > 0; i--) {
+		j = pc_rand() % i;
+		tmp = *(uint64_t *) (base + i * PC_NODE);
+		*(uint64_t *) (base + i * PC_NODE) =
+			*(uint64_t *) (base + j * PC_NODE);
+		*(uint64_t *) (base + j * PC_NODE) = tmp;
+	}
+
+	for (i = 0; i < n; i++)
+		*(uint64_t *) (base + i * PC_NODE) *= PC_NODE;
+}
+
+static int pc_post_read(uint64_t offset, int i)
+{
+	ssize_t ret;
+
+	do {
+		ret = fi_read(ep, pc_local(i), sizeof(uint64_t),
+			      fi_mr_desc(mr), remote_fi_addr,
+			      remote.addr + FT_MAX_CTRL_MSG + offset,
+			      remote.key, &ctx_arr[i]);
+	} while (ret == -FI_EAGAIN);
+
+	if (ret)
+		FT_PRINTERR("fi_read", ret);
+	return (int) ret;
+}
+
+static int pc_reap(int *done)
+{
+	struct fi_cq_entry comp[PC_BATCH];
+	ssize_t ret;
+
+	ret = fi_cq_read(txcq, comp, PC_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	*done += ret;
+	return 0;
+}
+
+static int pc_read_sync(uint64_t offset)
+{
+	int done = 0, ret;
+
+	ret = pc_post_read(offset, 0);
+	while (!ret && !done)
+		ret = pc_reap(&done);
+	return ret;
+}
+
+static int pc_dependent(size_t footprint)
+{
+	uint64_t offset = 0;
+	int64_t t;
+	int i, ret;
+
+	ft_hist_reset(&dep_lat);
+	for (i = 0; i < opts.iterations; i++) {
+		t = ft_gettime_ns();
+		ret = pc_read_sync(offset);
+		if (ret)
+			return ret;
+		ft_hist_add(&dep_lat, ft_gettime_ns() - t);
+
+		offset = *pc_local(0);
+		if (offset >= footprint) {
+			FT_ERR("Corrupt list: next offset %lu beyond %zu",
+				(unsigned long) offset, footprint);
+			return -FI_EOTHER;
+		}
+	}
+	return 0;
+}
+
+static int pc_independent(size_t footprint)
+{
+	uint64_t n = footprint / PC_NODE;
+	int64_t t;
+	int i, ret;
+
+	for (i = 0; i < opts.iterations; i++)
+		targets[i] = (pc_rand() % n) * PC_NODE;
+
+	ft_hist_reset(&indep_lat);
+	for (i = 0; i < opts.iterations; i++) {
+		t = ft_gettime_ns();
+		ret = pc_read_sync(targets[i]);
+		if (ret)
+			return ret;
+		ft_hist_add(&indep_lat, ft_gettime_ns() - t);
+	}
+	return 0;
+}
+
+/*
+ * Independent reads with up to window outstanding; returns ns per read.
+ * Completions can return out of order, so contexts are recycled through
+ * a free list.
+ */
+static int pc_pipelined(int64_t *nsec)
+{
+	struct fi_cq_entry comp[PC_BATCH];
+	int *free_idx, nfree, posted = 0, done = 0, i;
+	int64_t t;
+	ssize_t ret = 0;
+
+	free_idx = calloc(opts.window_size, sizeof *free_idx);
+	if (!free_idx)
+		return -FI_ENOMEM;
+	for (nfree = 0; nfree < opts.window_size; nfree++)
+		free_idx[nfree] = nfree;
+
+	t = ft_gettime_ns();
+	while (done < opts.iterations) {
+		while (posted < opts.iterations && nfree) {
+			ret = pc_post_read(targets[posted], free_idx[--nfree]);
+			if (ret)
+				goto out;
+			posted++;
+		}
+
+		ret = fi_cq_read(txcq, comp, PC_BATCH);
+		if (ret == -FI_EAGAIN)
+			continue;
+		if (ret == -FI_EAVAIL) {
+			ret = ft_cq_readerr(txcq);
+			goto out;
+		}
+		if (ret < 0) {
+			FT_PRINTERR("fi_cq_read", ret);
+			goto out;
+		}
+
+		for (i = 0; i < ret; i++)
+			free_idx[nfree++] = (struct fi_context *)
+					    comp[i].op_context - ctx_arr;
+		done += ret;
+	}
+	*nsec = (ft_gettime_ns() - t) / opts.iterations;
+	ret = 0;
+out:
+	free(free_idx);
+	return (int) ret;
+}
+
+static void pc_show(size_t footprint, int64_t pipe_nsec)
+{
+	char str[FT_STR_LEN];
+	static int header = 1;
+
+	if (opts.machr) {
+		printf("- { footprint: %zu, dep_avg: %f, dep_p50: %f, "
+			"dep_p99: %f, indep_avg: %f, indep_p50: %f, "
+			"indep_p99: %f, pipelined_usec/read: %f }\n", footprint,
+			(double) dep_lat.sum / dep_lat.count / 1000.0,
+			ft_hist_percentile(&dep_lat, 50.0) / 1000.0,
+			ft_hist_percentile(&dep_lat, 99.0) / 1000.0,
+			(double) indep_lat.sum / indep_lat.count / 1000.0,
+			ft_hist_percentile(&indep_lat, 50.0) / 1000.0,
+			ft_hist_percentile(&indep_lat, 99.0) / 1000.0,
+			pipe_nsec / 1000.0);
+		return;
+	}
+
+	if (header) {
+		printf("%-10s%10s%10s%10s%10s%10s%10s%12s\n", "footprint",
+			"dep avg", "dep p50", "dep p99", "ind avg", "ind p50",
+			"ind p99", "pipe/read");
+		header = 0;
+	}
+	printf("%-10s%10.2f%10.2f%10.2f%10.2f%10.2f%10.2f%12.3f\n",
+		size_str(str, footprint),
+		(double) dep_lat.sum / dep_lat.count / 1000.0,
+		ft_hist_percentile(&dep_lat, 50.0) / 1000.0,
+		ft_hist_percentile(&dep_lat, 99.0) / 1000.0,
+		(double) indep_lat.sum / indep_lat.count / 1000.0,
+		ft_hist_percentile(&indep_lat, 50.0) / 1000.0,
+		ft_hist_percentile(&indep_lat, 99.0) / 1000.0,
+		pipe_nsec / 1000.0);
+}
+
+static int run_footprint(size_t footprint)
+{
+	int64_t pipe_nsec;
+	int ret;
+
+	if (!opts.dst_addr)
+		pc_build_list(footprint);
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr) {
+		ret = pc_dependent(footprint);
+		if (ret)
+			return ret;
+
+		ret = pc_independent(footprint);
+		if (ret)
+			return ret;
+
+		ret = pc_pipelined(&pipe_nsec);
+		if (ret)
+			return ret;
+
+		pc_show(footprint, pipe_nsec);
+	}
+
+	return ft_sync();
+}
+
+static int run(void)
+{
+	size_t footprint;
+	int ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Footprint");
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	ctx_arr = calloc(opts.window_size, sizeof *ctx_arr);
+	targets = calloc(opts.iterations, sizeof *targets);
+	if (!ctx_arr || !targets)
+		return -FI_ENOMEM;
+
+	srand48(opts.dst_addr ? 2 : 1);
+	for (footprint = PC_MIN_FOOTPRINT; ;
+	     footprint = MIN(footprint * 2, max_footprint)) {
+		ret = run_footprint(footprint);
+		if (ret)
+			return ret;
+		if (footprint == max_footprint)
+			break;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.iterations = 10000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hM:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'M':
+			max_footprint = strtoul(optarg, NULL, 0);
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Dependent remote read latency "
+					"through a randomized linked list.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-M <bytes>", "largest remote "
+					"footprint in bytes, doubled from 4k (default 64m)");
+			fprintf(stderr, "Note: -I is the number of reads per "
+					"footprint, -W the independent reads in "
+					"flight.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (max_footprint < PC_MIN_FOOTPRINT || max_footprint > (1 << 30) ||
+	    opts.window_size < 1) {
+		fprintf(stderr, "Footprint must be between 4k and 1g\n");
+		return EXIT_FAILURE;
+	}
+	max_footprint &= ~((size_t) PC_NODE - 1);
+	opts.transfer_size = FT_MAX_CTRL_MSG +
+			     MAX(max_footprint, opts.window_size * sizeof(uint64_t));
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_RMA | FI_READ | FI_REMOTE_READ;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+	opts.rma_op = FT_RMA_READ;
+
+	ret = run();
+
+	free(ctx_arr);
+	free(targets);
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Scatter-gather RMA versus packing into a contiguous bounce buffer.
+ *
+ * For each layout, op, iov count and segment size, the client times one
+ * transfer at a time (post and wait for completion):
+ *
+ *   writev    N local segments into one contiguous remote range, or
+ *             pack + fi_write
+ *   readv     one contiguous remote range into N local segments, or
+ *             fi_read + unpack
+ *   writemsg  N local segments into N remote segments, or
+ *             pack + fi_write (the target's unpack is not counted)
+ *
+ * Segments follow ft_format_iov_layout(): strided or irregular, with a gap
+ * after each one.  A summary of crossover points follows each op.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define IV_MAX_LIST	16
+#define IV_MAX_IOV	256
+
+enum iv_op {
+	IV_WRITEV,
+	IV_READV,
+	IV_WRITEMSG,
+	IV_OP_MAX,
+};
+
+static const char *iv_op_str[] = {
+	[IV_WRITEV] = "writev",
+	[IV_READV] = "readv",
+	[IV_WRITEMSG] = "writemsg",
+};
+
+static int segs[IV_MAX_LIST] = { 8, 64, 512, 4096, 32768 };
+static int seg_cnt = 5;
+static int max_iov = 64;
+static int op_mask = (1 << IV_OP_MAX) - 1;
+static int layout_mask = (1 << FT_IOV_LAYOUT_MAX) - 1;
+
+static struct fi_rma_iov remote;
+static size_t area_size;
+static struct iovec iov[IV_MAX_IOV];
+static void *desc[IV_MAX_IOV];
+static struct fi_rma_iov rma_iov[IV_MAX_IOV];
+
+/* 1 if packing won, 0 if the vectored op won, -1 if not run */
+static int winner[IV_MAX_LIST][IV_MAX_LIST];
+
+/*
+ * Each region holds the scattered segments, then a contiguous range used
+ * as the pack buffer locally and as the remote target or source.
+ */
+static inline char *iv_scatter(enum iv_op op)
+{
+	if (op == IV_READV)
+		return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static inline char *iv_bounce(enum iv_op op)
+{
+	return iv_scatter(op) + 2 * area_size;
+}
+
+static inline uint64_t iv_remote_contig(void)
+{
+	return remote.addr + FT_MAX_CTRL_MSG + 2 * area_size;
+}
+
+static size_t iv_limit(enum iv_op op)
+{
+	size_t limit = MIN(fi->tx_attr->iov_limit, IV_MAX_IOV);
+
+	if (op == IV_WRITEMSG)
+		limit = MIN(limit, fi->tx_attr->rma_iov_limit);
+	return MIN(limit, (size_t) max_iov);
+}
+
+static int iv_wait(void)
+{
+	struct fi_cq_entry comp;
+	ssize_t ret;
+
+	do {
+		ret = fi_cq_read(txcq, &comp, 1);
+	} while (ret == -FI_EAGAIN);
+
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	return 0;
+}
+
+static void iv_pack(char *dst, size_t cnt)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+}
+
+static void iv_unpack(const char *src, size_t cnt)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(iov[i].iov_base, src, iov[i].iov_len);
+		src += iov[i].iov_len;
+	}
+}
+
+static ssize_t iv_post_vec(enum iv_op op, size_t cnt)
+{
+	struct fi_msg_rma msg;
+
+	switch (op) {
+	case IV_WRITEV:
+		return fi_writev(ep, iov, desc, cnt, remote_fi_addr,
+				 iv_remote_contig(), remote.key, &tx_ctx);
+	case IV_READV:
+		return fi_readv(ep, iov, desc, cnt, remote_fi_addr,
+				iv_remote_contig(), remote.key, &tx_ctx);
+	default:
+		msg.msg_iov = iov;
+		msg.desc = desc;
+		msg.iov_count = cnt;
+		msg.addr = remote_fi_addr;
+		msg.rma_iov = rma_iov;
+		msg.rma_iov_count = cnt;
+		msg.context = &tx_ctx;
+		msg.data = 0;
+		return fi_writemsg(ep, &msg, FI_COMPLETION);
+	}
+}
+
+static int iv_xfer(enum iv_op op, int packed, size_t cnt, size_t bytes)
+{
+	ssize_t ret;
+
+	do {
+		if (!packed) {
+			ret = iv_post_vec(op, cnt);
+		} else if (op == IV_READV) {
+			ret = fi_read(ep, iv_bounce(op), bytes, fi_mr_desc(mr),
+				      remote_fi_addr, iv_remote_contig(),
+				      remote.key, &tx_ctx);
+		} else {
+			iv_pack(iv_bounce(op), cnt);
+			ret = fi_write(ep, iv_bounce(op), bytes, fi_mr_desc(mr),
+				       remote_fi_addr, iv_remote_contig(),
+				       remote.key, &tx_ctx);
+		}
+	} while (ret == -FI_EAGAIN);
+	if (ret) {
+		FT_PRINTERR("rma post", ret);
+		return (int) ret;
+	}
+
+	ret = iv_wait();
+	if (ret)
+		return (int) ret;
+
+	if (packed && op == IV_READV)
+		iv_unpack(iv_bounce(op), cnt);
+	return 0;
+}
+
+static int iv_time(enum iv_op op, int packed, size_t cnt, size_t bytes,
+		   double *usec)
+{
+	int64_t start = 0;
+	int i, ret;
+
+	for (i = 0; i < opts.warmup_iterations + opts.iterations; i++) {
+		if (i == opts.warmup_iterations)
+			start = ft_gettime_ns();
+		ret = iv_xfer(op, packed, cnt, bytes);
+		if (ret)
+			return ret;
+	}
+	*usec = (ft_gettime_ns() - start) / 1000.0 / opts.iterations;
+	return 0;
+}
+
+static int iv_config(enum ft_iov_layout layout, enum iv_op op, size_t cnt,
+		     size_t seg, int *pack_won)
+{
+	double vec_usec, pack_usec;
+	char *scatter = iv_scatter(op);
+	size_t bytes, i;
+	int ret;
+
+	bytes = ft_format_iov_layout(iov, cnt, scatter, seg, layout);
+	for (i = 0; i < cnt; i++) {
+		desc[i] = fi_mr_desc(mr);
+		rma_iov[i].addr = remote.addr + FT_MAX_CTRL_MSG +
+				  ((char *) iov[i].iov_base - scatter);
+		rma_iov[i].len = iov[i].iov_len;
+		rma_iov[i].key = remote.key;
+	}
+
+	ret = iv_time(op, 0, cnt, bytes, &vec_usec);
+	if (ret)
+		return ret;
+	ret = iv_time(op, 1, cnt, bytes, &pack_usec);
+	if (ret)
+		return ret;
+
+	*pack_won = pack_usec < vec_usec;
+
+	if (opts.machr) {
+		printf("- { layout: %s, op: %s, iovs: %zu, seg: %zu, bytes: %zu, "
+			"vec_usec: %f, pack_usec: %f, winner: %s }\n",
+			ft_iov_layout_str[layout], iv_op_str[op], cnt, seg,
+			bytes, vec_usec, pack_usec,
+			*pack_won ? "pack" : "vec");
+	} else {
+		printf("%-10s%-9s%6zu%8zu%10zu%11.2f%11.2f  %s\n",
+			ft_iov_layout_str[layout], iv_op_str[op], cnt, seg,
+			bytes, vec_usec, pack_usec,
+			*pack_won ? "pack" : "vec");
+	}
+	return 0;
+}
+
+static void iv_summary(enum ft_iov_layout layout, enum iv_op op, int cnt_steps)
+{
+	int s, n;
+
+	if (opts.machr)
+		return;
+
+	printf("  %s %s crossovers:\n", ft_iov_layout_str[layout],
+		iv_op_str[op]);
+	for (s = 0; s < seg_cnt; s++) {
+		for (n = 0; n < cnt_steps && winner[n][s] != 1; n++)
+			;
+		if (n < cnt_steps)
+			printf("    seg %6d: pack wins from %d iovs\n",
+				segs[s], 1 << n);
+		else
+			printf("    seg %6d: vectored wins at all iov counts\n",
+				segs[s]);
+	}
+	for (n = 0; n < cnt_steps; n++) {
+		for (s = 0; s < seg_cnt && winner[n][s] != 0; s++)
+			;
+		if (s < seg_cnt)
+			printf("    %4d iovs: vectored wins from %d byte "
+				"segments\n", 1 << n, segs[s]);
+		else
+			printf("    %4d iovs: pack wins at all segment sizes\n",
+				1 << n);
+	}
+}
+
+static int run(void)
+{
+	enum ft_iov_layout layout;
+	enum iv_op op;
+	size_t cnt;
+	int n, s, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Segments");
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr)
+		return ft_finalize();
+
+	printf("%-10s%-9s%6s%8s%10s%11s%11s  %s\n", "layout", "op", "iovs",
+		"seg", "bytes", "vec usec", "pack usec", "winner");
+	for (layout = 0; layout < FT_IOV_LAYOUT_MAX; layout++) {
+		if (!(layout_mask & (1 << layout)))
+			continue;
+		for (op = 0; op < IV_OP_MAX; op++) {
+			if (!(op_mask & (1 << op)))
+				continue;
+
+			memset(winner, -1, sizeof winner);
+			for (n = 0, cnt = 1; cnt <= iv_limit(op) &&
+			     n < IV_MAX_LIST; n++, cnt *= 2) {
+				for (s = 0; s < seg_cnt; s++) {
+					ret = iv_config(layout, op, cnt,
+							segs[s], &winner[n][s]);
+					if (ret)
+						return ret;
+				}
+			}
+			iv_summary(layout, op, n);
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, i, ret, max_seg = 0;
+
+	opts = INIT_OPTS;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hG:N:T:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'G':
+			if (ft_parse_int_list(optarg, segs, &seg_cnt,
+					      IV_MAX_LIST, 1, 1 << 20)) {
+				fprintf(stderr, "Invalid segment sizes: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'N':
+			max_iov = atoi(optarg);
+			if (max_iov < 1 || max_iov > IV_MAX_IOV) {
+				fprintf(stderr, "Max iov count must be 1-%d\n",
+					IV_MAX_IOV);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			if (ft_parse_mask(optarg, ft_iov_layout_str,
+					  FT_IOV_LAYOUT_MAX, &layout_mask)) {
+				fprintf(stderr, "Invalid layout: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, iv_op_str,
+					  IV_OP_MAX, &op_mask)) {
+				fprintf(stderr, "Invalid op: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Vectored RMA versus pack and "
+					"contiguous RMA.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-o <op>", "writev|readv|writemsg|all "
+					"(default all)");
+			FT_PRINT_OPTS_USAGE("-T <layout>", "strided|irregular|all "
+					"(default all)");
+			FT_PRINT_OPTS_USAGE("-N <iovs>", "max iov count, swept in "
+					"powers of two (default 64)");
+			FT_PRINT_OPTS_USAGE("-G <s1,s2,..>", "segment sizes "
+					"(default 8,64,512,4096,32768)");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	for (i = 0; i < seg_cnt; i++)
+		max_seg = MAX(max_seg, segs[i]);
+
+	/* payload may exceed max_iov * max_seg by one byte per segment */
+	area_size = (size_t) max_iov * (max_seg + 1);
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + 3 * area_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_RMA | FI_READ | FI_WRITE |
+		      FI_REMOTE_READ | FI_REMOTE_WRITE;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,606 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Ways of telling the target that a put has landed.
+ *
+ *   writedata - fi_writedata; the target sees remote CQ data on its CQ
+ *   flag      - fi_write, then a write of a flag word the target polls
+ *   cntr      - fi_write; the target polls a FI_REMOTE_WRITE counter
+ *   send      - fi_write, then a small tagged message
+ *
+ * The flag and send variants are only correct if the notification cannot
+ * overtake the payload.  Without FI_ORDER_WAW (flag) or FI_ORDER_SAW
+ * (send), the payload is written with FI_DELIVERY_COMPLETE and completed
+ * before the notification is issued.
+ *
+ * For every size, each mode reports put+notify one-way latency, taken as
+ * half of a ping-pong, and windowed put+notify throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define NT_TAG		(1ULL << 40)
+#define NT_MAX_MSG	(1 << 20)
+#define NT_FLAG_OFF	0
+#define NT_MSG_OFF	8
+#define NT_DATA_OFF	64
+#define NT_BATCH	16
+
+enum nt_mode {
+	NT_WRITEDATA,
+	NT_FLAG,
+	NT_CNTR,
+	NT_SEND,
+	NT_MODE_MAX,
+};
+
+static const char *nt_mode_str[] = {
+	[NT_WRITEDATA] = "writedata",
+	[NT_FLAG] = "flag",
+	[NT_CNTR] = "cntr",
+	[NT_SEND] = "send",
+};
+
+static int mode_mask = (1 << NT_MODE_MAX) - 1;
+static struct fi_rma_iov remote;
+static struct fid_cntr *rcntr;
+static struct fi_context *ctx_arr;
+static struct fi_context *nt_rx_ctx;
+static int nt_rx_next;
+static int ordered[NT_MODE_MAX];
+
+static enum nt_mode cur_mode;
+static uint64_t pending;
+static uint64_t notified, seen, base;
+static struct ft_hist nt_lat;
+
+/* Flag word, notification messages and payload, past the control area */
+static inline char *nt_local(size_t off)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG + off;
+}
+
+static inline char *nt_staging(size_t off)
+{
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG + off;
+}
+
+static inline uint64_t nt_remote(size_t off)
+{
+	return remote.addr + FT_MAX_CTRL_MSG + off;
+}
+
+static int nt_reap_tx(void)
+{
+	struct fi_cq_data_entry comp[NT_BATCH];
+	ssize_t ret;
+
+	ret = fi_cq_read(txcq, comp, NT_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	pending -= ret;
+	return 0;
+}
+
+static int nt_drain_tx(void)
+{
+	int ret;
+
+	while (pending) {
+		ret = nt_reap_tx();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+#define NT_POST(post_fn, ...)						\
+	do {								\
+		ssize_t rc;						\
+		while ((rc = post_fn(__VA_ARGS__)) == -FI_EAGAIN) {	\
+			rc = nt_reap_tx();				\
+			if (rc)						\
+				return (int) rc;			\
+		}							\
+		if (rc) {						\
+			FT_PRINTERR(#post_fn, rc);			\
+			return (int) rc;				\
+		}							\
+	} while (0)
+
+static int nt_put(size_t size, struct fi_context *ctx)
+{
+	void *desc = fi_mr_desc(mr);
+	struct fi_rma_iov rma_iov;
+	struct fi_msg_rma msg;
+	struct iovec iov;
+
+	if (cur_mode == NT_WRITEDATA) {
+		NT_POST(fi_writedata, ep, nt_staging(NT_DATA_OFF), size, desc,
+			notified, remote_fi_addr, nt_remote(NT_DATA_OFF),
+			remote.key, ctx);
+	} else if (ordered[cur_mode]) {
+		NT_POST(fi_write, ep, nt_staging(NT_DATA_OFF), size, desc,
+			remote_fi_addr, nt_remote(NT_DATA_OFF), remote.key, ctx);
+	} else {
+		iov.iov_base = nt_staging(NT_DATA_OFF);
+		iov.iov_len = size;
+		rma_iov.addr = nt_remote(NT_DATA_OFF);
+		rma_iov.len = size;
+		rma_iov.key = remote.key;
+		msg.msg_iov = &iov;
+		msg.desc = &desc;
+		msg.iov_count = 1;
+		msg.addr = remote_fi_addr;
+		msg.rma_iov = &rma_iov;
+		msg.rma_iov_count = 1;
+		msg.context = ctx;
+		msg.data = 0;
+		NT_POST(fi_writemsg, ep, &msg,
+			FI_COMPLETION | FI_DELIVERY_COMPLETE);
+	}
+	pending++;
+	return 0;
+}
+
+/* One put plus its notification; ctx has room for two operations */
+static int nt_put_notify(size_t size, struct fi_context *ctx)
+{
+	int ret;
+
+	ret = nt_put(size, ctx);
+	if (ret)
+		return ret;
+	notified++;
+
+	if (cur_mode == NT_WRITEDATA || cur_mode == NT_CNTR)
+		return 0;
+
+	if (!ordered[cur_mode]) {
+		ret = nt_drain_tx();
+		if (ret)
+			return ret;
+	}
+
+	if (cur_mode == NT_FLAG) {
+		*(uint64_t *) nt_staging(NT_FLAG_OFF) = notified;
+		if (fi->tx_attr->inject_size >= sizeof(uint64_t)) {
+			NT_POST(fi_inject_write, ep, nt_staging(NT_FLAG_OFF),
+				sizeof(uint64_t), remote_fi_addr,
+				nt_remote(NT_FLAG_OFF), remote.key);
+			return 0;
+		}
+		NT_POST(fi_write, ep, nt_staging(NT_FLAG_OFF),
+			sizeof(uint64_t), fi_mr_desc(mr), remote_fi_addr,
+			nt_remote(NT_FLAG_OFF), remote.key, ctx + 1);
+	} else {
+		NT_POST(fi_tsend, ep, nt_staging(NT_MSG_OFF), sizeof(uint64_t),
+			fi_mr_desc(mr), remote_fi_addr, NT_TAG, ctx + 1);
+	}
+	pending++;
+	return 0;
+}
+
+/* Receives consumed by writedata or carrying send notifications */
+static int nt_post_recvs(int count)
+{
+	struct fi_context *ctx;
+	int i;
+
+	if (cur_mode != NT_WRITEDATA && cur_mode != NT_SEND)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		ctx = &nt_rx_ctx[nt_rx_next];
+		nt_rx_next = (nt_rx_next + 1) % opts.window_size;
+		if (cur_mode == NT_WRITEDATA)
+			NT_POST(fi_recv, ep, nt_local(NT_MSG_OFF),
+				sizeof(uint64_t), fi_mr_desc(mr), 0, ctx);
+		else
+			NT_POST(fi_trecv, ep, nt_local(NT_MSG_OFF),
+				sizeof(uint64_t), fi_mr_desc(mr), 0, NT_TAG, 0,
+				ctx);
+	}
+	return 0;
+}
+
+/* Wait until count notifications have arrived in this run */
+static int nt_wait(uint64_t count)
+{
+	struct fi_cq_data_entry comp[NT_BATCH];
+	ssize_t ret, i;
+
+	while (seen < count) {
+		switch (cur_mode) {
+		case NT_FLAG:
+			seen = *(volatile uint64_t *) nt_local(NT_FLAG_OFF);
+			ret = fi_cq_read(rxcq, comp, 0);
+			break;
+		case NT_CNTR:
+			seen = fi_cntr_read(rcntr) - base;
+			ret = fi_cq_read(rxcq, comp, 0);
+			break;
+		default:
+			ret = fi_cq_read(rxcq, comp, NT_BATCH);
+			/* skip the peer's next ft_sync() message, for ft_rx() */
+			for (i = 0; i < ret; i++) {
+				if (comp[i].op_context == &rx_ctx)
+					rx_cq_cntr++;
+				else
+					seen++;
+			}
+			break;
+		}
+		if (ret == -FI_EAVAIL)
+			return ft_cq_readerr(rxcq);
+		if (ret < 0 && ret != -FI_EAGAIN) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return (int) ret;
+		}
+
+		ret = nt_reap_tx();
+		if (ret)
+			return (int) ret;
+	}
+	return 0;
+}
+
+/*
+ * Both sides start each run with no notifications sent or seen.  The peer
+ * may write as soon as ft_sync returns, so take the counter baseline first.
+ */
+static int nt_run_start(void)
+{
+	notified = seen = 0;
+	*(uint64_t *) nt_local(NT_FLAG_OFF) = 0;
+	base = fi_cntr_read(rcntr);
+
+	return ft_sync();
+}
+
+static int nt_latency(size_t size)
+{
+	int64_t t;
+	int i, ret;
+
+	ret = nt_post_recvs(1);
+	if (ret)
+		return ret;
+
+	ret = nt_run_start();
+	if (ret)
+		return ret;
+
+	ft_hist_reset(&nt_lat);
+	for (i = 0; i < opts.warmup_iterations + opts.iterations; i++) {
+		t = ft_gettime_ns();
+		if (opts.dst_addr) {
+			ret = nt_put_notify(size, ctx_arr);
+			if (ret)
+				return ret;
+			ret = nt_wait(i + 1);
+			if (ret)
+				return ret;
+		} else {
+			ret = nt_wait(i + 1);
+			if (ret)
+				return ret;
+			ret = nt_put_notify(size, ctx_arr);
+			if (ret)
+				return ret;
+		}
+
+		if (i + 1 < opts.warmup_iterations + opts.iterations) {
+			ret = nt_post_recvs(1);
+			if (ret)
+				return ret;
+		}
+
+		ret = nt_drain_tx();
+		if (ret)
+			return ret;
+
+		if (i >= opts.warmup_iterations)
+			ft_hist_add(&nt_lat, (ft_gettime_ns() - t) / 2);
+	}
+	return 0;
+}
+
+/*
+ * The server posts receives for a window and then signals readiness with
+ * a control message.  The client puts the window and waits for the next
+ * signal.  The final signal marks the end of the timed region.
+ */
+static int nt_throughput(size_t size, int64_t *elapsed, int *puts)
+{
+	int64_t start = 0;
+	int i, j, windows, ret;
+
+	windows = MAX(opts.iterations / opts.window_size, 1);
+	ret = nt_run_start();
+	if (ret)
+		return ret;
+
+	for (i = 0; i <= windows; i++) {
+		if (!opts.dst_addr) {
+			if (i) {
+				ret = nt_wait((uint64_t) i * opts.window_size);
+				if (ret)
+					return ret;
+			}
+			if (i < windows) {
+				ret = nt_post_recvs(opts.window_size);
+				if (ret)
+					return ret;
+			}
+			ret = ft_tx(ep, remote_fi_addr, 1, &tx_ctx);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		ret = ft_rx(ep, 1);
+		if (ret)
+			return ret;
+		if (!i)
+			start = ft_gettime_ns();
+		if (i == windows)
+			break;
+
+		for (j = 0; j < opts.window_size; j++) {
+			ret = nt_put_notify(size, &ctx_arr[2 * j]);
+			if (ret)
+				return ret;
+		}
+		ret = nt_drain_tx();
+		if (ret)
+			return ret;
+	}
+
+	*elapsed = ft_gettime_ns() - start;
+	*puts = windows * opts.window_size;
+	return 0;
+}
+
+static void nt_show(size_t size, int64_t elapsed, int puts)
+{
+	static int header = 1;
+	double rate = puts * 1e9 / elapsed;
+	char str[FT_STR_LEN];
+
+	if (opts.machr) {
+		printf("- { mode: %s, xfer_size: %zu, ordered: %d, lat_avg: %f, "
+			"lat_p50: %f, lat_p99: %f, puts/sec: %.0f, "
+			"MB/sec: %f }\n", nt_mode_str[cur_mode], size,
+			ordered[cur_mode],
+			(double) nt_lat.sum / nt_lat.count / 1000.0,
+			ft_hist_percentile(&nt_lat, 50.0) / 1000.0,
+			ft_hist_percentile(&nt_lat, 99.0) / 1000.0,
+			rate, rate * size / 1e6);
+		return;
+	}
+
+	if (header) {
+		printf("%-10s%-8s%8s%10s%10s%10s%14s%12s\n", "mode", "bytes",
+			"ordered", "lat avg", "lat p50", "lat p99",
+			"puts/sec", "MB/sec");
+		header = 0;
+	}
+	printf("%-10s%-8s%8s%10.2f%10.2f%10.2f%14.0f%12.2f\n",
+		nt_mode_str[cur_mode], size_str(str, size),
+		ordered[cur_mode] ? "yes" : "no",
+		(double) nt_lat.sum / nt_lat.count / 1000.0,
+		ft_hist_percentile(&nt_lat, 50.0) / 1000.0,
+		ft_hist_percentile(&nt_lat, 99.0) / 1000.0,
+		rate, rate * size / 1e6);
+}
+
+static int run_size(size_t size)
+{
+	int64_t elapsed = 0;
+	int ret, puts = 0;
+
+	for (cur_mode = 0; cur_mode < NT_MODE_MAX; cur_mode++) {
+		if (!(mode_mask & (1 << cur_mode)))
+			continue;
+
+		opts.transfer_size = size;
+		init_test(&opts, test_name, sizeof(test_name));
+
+		ret = nt_latency(size);
+		if (ret)
+			return ret;
+
+		ret = nt_throughput(size, &elapsed, &puts);
+		if (ret)
+			return ret;
+
+		if (opts.dst_addr)
+			nt_show(size, elapsed, puts);
+	}
+	return 0;
+}
+
+static int init_fabric(void)
+{
+	struct fi_cntr_attr attr = {
+		.events = FI_CNTR_EVENTS_COMP,
+		.wait_obj = FI_WAIT_NONE,
+	};
+	int ret;
+
+	ret = ft_getinfo(hints, &fi);
+	if (ret)
+		return ret;
+
+	ret = ft_open_fabric_res();
+	if (ret)
+		return ret;
+
+	ret = ft_alloc_active_res(fi);
+	if (ret)
+		return ret;
+
+	/* the remote write counter must be bound before ft_init_ep enables */
+	ret = fi_cntr_open(domain, &attr, &rcntr, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cntr_open", ret);
+		return ret;
+	}
+	FT_EP_BIND(ep, rcntr, FI_REMOTE_WRITE);
+
+	ret = ft_init_ep();
+	if (ret)
+		return ret;
+
+	return ft_init_av();
+}
+
+static int run(int sweep, size_t max_size)
+{
+	int i, ret;
+
+	ret = init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Payload");
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	ctx_arr = calloc(2 * opts.window_size, sizeof *ctx_arr);
+	nt_rx_ctx = calloc(opts.window_size, sizeof *nt_rx_ctx);
+	if (!ctx_arr || !nt_rx_ctx)
+		return -FI_ENOMEM;
+
+	ordered[NT_WRITEDATA] = ordered[NT_CNTR] = 1;
+	ordered[NT_FLAG] = (fi->tx_attr->msg_order & FI_ORDER_WAW) != 0;
+	ordered[NT_SEND] = (fi->tx_attr->msg_order & FI_ORDER_SAW) != 0;
+
+	if (!sweep) {
+		ret = run_size(max_size);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; sweep && i < TEST_CNT; i++) {
+		if (!ft_use_size(i, opts.sizes_enabled) ||
+		    test_size[i].size > NT_MAX_MSG)
+			continue;
+		ret = run_size(test_size[i].size);
+		if (ret)
+			return ret;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret, sweep;
+	size_t max_size;
+
+	opts = INIT_OPTS;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "ho:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, nt_mode_str,
+					  NT_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Put with remote notification: "
+					"writedata, flag, counter or send.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-o <mode>", "writedata|flag|cntr|send|"
+					"all (default all)");
+			fprintf(stderr, "Note: sizes above 1m are skipped unless "
+					"set with -S.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	sweep = !(opts.options & FT_OPT_SIZE);
+	max_size = sweep ? NT_MAX_MSG : opts.transfer_size;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + NT_DATA_OFF + max_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_TAGGED | FI_RMA | FI_RMA_EVENT |
+		      FI_WRITE | FI_REMOTE_WRITE;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR | FI_RX_CQ_DATA;
+	cq_attr.format = FI_CQ_FORMAT_DATA;
+
+	ret = run(sweep, max_size);
+
+	FT_CLOSE_FID(rcntr);
+	free(ctx_arr);
+	free(nt_rx_ctx);
+	ft_free_res();
+	return -ret;
+}
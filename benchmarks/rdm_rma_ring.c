@@ -0,0 +1,651 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Single-producer single-consumer message channel built on RMA.
+ *
+ * Each side exposes a ring of -W slots plus two words that the peer
+ * writes: the tail, holding the number of messages the peer has
+ * published, and the credit, holding the number of our messages the peer
+ * has consumed.  The producer writes a message into the next remote slot
+ * and publishes it in one of two ways:
+ *
+ *   data - fi_writedata, so the consumer sees the message on its CQ
+ *   tail - fi_write, then a separate write of the tail word, which the
+ *          consumer polls in memory
+ *
+ * The consumer returns credits with an RMA write every half ring.  The
+ * msg mode sends the same traffic with tagged messages for comparison.
+ * Each message size reports ping-pong latency and streaming message rate.
+ *
+ * Without FI_ORDER_WAW, the tail write could overtake the payload.  In
+ * that case the payload is written with FI_DELIVERY_COMPLETE, and the
+ * producer waits for it before publishing the tail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define RING_TAG	(1ULL << 40)
+#define RING_MAX_MSG	(1 << 16)
+#define RING_TAIL_OFF	0
+#define RING_CREDIT_OFF	8
+#define RING_SLOTS_OFF	64
+#define RING_BATCH	16
+
+enum ring_mode {
+	RING_DATA,
+	RING_TAIL,
+	RING_MSG,
+	RING_MODE_MAX,
+};
+
+static const char *ring_mode_str[] = {
+	[RING_DATA] = "data",
+	[RING_TAIL] = "tail",
+	[RING_MSG] = "msg",
+};
+
+static int mode_mask = (1 << RING_MODE_MAX) - 1;
+static int slots;
+static size_t slot_size;
+static int waw;
+static struct fi_rma_iov remote;
+
+static struct fi_context *ctx_pool, **ctx_free, *ring_rx_ctx;
+static int ctx_cnt, ctx_free_cnt;
+
+/* producer: messages published, consumer: messages consumed */
+static uint64_t sent, recvd, returned;
+static uint64_t posted, expected;
+static enum ring_mode cur_mode;
+static struct ft_hist ring_lat;
+
+/* Words and slots the peer writes into, past the control message area */
+static inline char *ring_local(size_t off)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG + off;
+}
+
+/* Outgoing payloads and the values of tail and credit writes */
+static inline char *ring_staging(size_t off)
+{
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG + off;
+}
+
+static inline uint64_t ring_remote(size_t off)
+{
+	return remote.addr + FT_MAX_CTRL_MSG + off;
+}
+
+static inline volatile uint64_t *ring_word(size_t off)
+{
+	return (volatile uint64_t *) ring_local(off);
+}
+
+static int ring_alloc(void)
+{
+	int i;
+
+	ctx_cnt = 2 * slots + 2;
+	ctx_pool = calloc(ctx_cnt, sizeof *ctx_pool);
+	ctx_free = calloc(ctx_cnt, sizeof *ctx_free);
+	ring_rx_ctx = calloc(slots, sizeof *ring_rx_ctx);
+	if (!ctx_pool || !ctx_free || !ring_rx_ctx)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < ctx_cnt; i++)
+		ctx_free[i] = &ctx_pool[i];
+	ctx_free_cnt = ctx_cnt;
+	return 0;
+}
+
+static void ring_free(void)
+{
+	free(ctx_pool);
+	free(ctx_free);
+	free(ring_rx_ctx);
+}
+
+/* Reap transmit completions, returning their contexts to the pool */
+static int ring_progress_tx(void)
+{
+	struct fi_cq_data_entry comp[RING_BATCH];
+	ssize_t ret, i;
+
+	ret = fi_cq_read(txcq, comp, RING_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	for (i = 0; i < ret; i++)
+		ctx_free[ctx_free_cnt++] = comp[i].op_context;
+	return 0;
+}
+
+static int ring_drain_tx(void)
+{
+	int ret;
+
+	while (ctx_free_cnt < ctx_cnt) {
+		ret = ring_progress_tx();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int ring_get_ctx(struct fi_context **ctx)
+{
+	int ret;
+
+	while (!ctx_free_cnt) {
+		ret = ring_progress_tx();
+		if (ret)
+			return ret;
+	}
+	*ctx = ctx_free[--ctx_free_cnt];
+	return 0;
+}
+
+/* Small writes of the tail or credit word, injected when possible */
+static int ring_write_word(size_t off, uint64_t val)
+{
+	struct fi_context *ctx;
+	ssize_t ret;
+	int rc;
+
+	*(uint64_t *) ring_staging(off) = val;
+	if (fi->tx_attr->inject_size >= sizeof val) {
+		while ((ret = fi_inject_write(ep, ring_staging(off), sizeof val,
+					      remote_fi_addr, ring_remote(off),
+					      remote.key)) == -FI_EAGAIN) {
+			rc = ring_progress_tx();
+			if (rc)
+				return rc;
+		}
+	} else {
+		rc = ring_get_ctx(&ctx);
+		if (rc)
+			return rc;
+		while ((ret = fi_write(ep, ring_staging(off), sizeof val,
+				       fi_mr_desc(mr), remote_fi_addr,
+				       ring_remote(off), remote.key,
+				       ctx)) == -FI_EAGAIN) {
+			rc = ring_progress_tx();
+			if (rc)
+				return rc;
+		}
+	}
+	if (ret)
+		FT_PRINTERR("ring_write_word", ret);
+	return (int) ret;
+}
+
+static ssize_t ring_post_payload(enum ring_mode mode, size_t size,
+				 struct fi_context *ctx)
+{
+	size_t off = RING_SLOTS_OFF + (sent % slots) * slot_size;
+	void *buf = ring_staging(off);
+	struct fi_rma_iov rma_iov;
+	struct fi_msg_rma msg;
+	struct iovec iov;
+	void *desc = fi_mr_desc(mr);
+
+	switch (mode) {
+	case RING_DATA:
+		return fi_writedata(ep, buf, size, desc, sent, remote_fi_addr,
+				    ring_remote(off), remote.key, ctx);
+	case RING_TAIL:
+		if (waw)
+			return fi_write(ep, buf, size, desc, remote_fi_addr,
+					ring_remote(off), remote.key, ctx);
+
+		iov.iov_base = buf;
+		iov.iov_len = size;
+		rma_iov.addr = ring_remote(off);
+		rma_iov.len = size;
+		rma_iov.key = remote.key;
+		msg.msg_iov = &iov;
+		msg.desc = &desc;
+		msg.iov_count = 1;
+		msg.addr = remote_fi_addr;
+		msg.rma_iov = &rma_iov;
+		msg.rma_iov_count = 1;
+		msg.context = ctx;
+		msg.data = 0;
+		return fi_writemsg(ep, &msg, FI_COMPLETION | FI_DELIVERY_COMPLETE);
+	default:
+		return fi_tsend(ep, buf, size, desc, remote_fi_addr, RING_TAG,
+				ctx);
+	}
+}
+
+static int ring_send(enum ring_mode mode, size_t size)
+{
+	struct fi_context *ctx;
+	ssize_t ret;
+	int rc;
+
+	while (sent - *ring_word(RING_CREDIT_OFF) >= (uint64_t) slots) {
+		rc = ring_progress_tx();
+		if (rc)
+			return rc;
+	}
+
+	rc = ring_get_ctx(&ctx);
+	if (rc)
+		return rc;
+
+	while ((ret = ring_post_payload(mode, size, ctx)) == -FI_EAGAIN) {
+		rc = ring_progress_tx();
+		if (rc)
+			return rc;
+	}
+	if (ret) {
+		FT_PRINTERR("ring_post_payload", ret);
+		return (int) ret;
+	}
+	sent++;
+
+	if (mode != RING_TAIL)
+		return 0;
+
+	if (!waw) {
+		rc = ring_drain_tx();
+		if (rc)
+			return rc;
+	}
+	return ring_write_word(RING_TAIL_OFF, sent);
+}
+
+/*
+ * Writedata consumes a posted receive at the target, and msg mode needs
+ * one per message.  No more receives are posted than the run expects, so
+ * none are left behind when it ends.
+ */
+static int ring_post_recv(int i)
+{
+	void *buf = ring_local(RING_SLOTS_OFF + i * slot_size);
+	ssize_t ret;
+
+	if (cur_mode == RING_TAIL || posted == expected)
+		return 0;
+
+	do {
+		if (cur_mode == RING_DATA)
+			ret = fi_recv(ep, buf, slot_size, fi_mr_desc(mr), 0,
+				      &ring_rx_ctx[i]);
+		else
+			ret = fi_trecv(ep, buf, slot_size, fi_mr_desc(mr), 0,
+				       RING_TAG, 0, &ring_rx_ctx[i]);
+	} while (ret == -FI_EAGAIN);
+	if (ret) {
+		FT_PRINTERR("ring_post_recv", ret);
+		return (int) ret;
+	}
+	posted++;
+	return 0;
+}
+
+static int ring_consumer_start(enum ring_mode mode, uint64_t count)
+{
+	int i, ret;
+
+	cur_mode = mode;
+	posted = 0;
+	expected = count;
+	for (i = 0; i < slots; i++) {
+		ret = ring_post_recv(i);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int ring_credit(int force)
+{
+	if (recvd == returned ||
+	    (!force && recvd - returned < (uint64_t) slots / 2))
+		return 0;
+
+	returned = recvd;
+	return ring_write_word(RING_CREDIT_OFF, returned);
+}
+
+/* Consume whatever has arrived and return credits every half ring */
+static int ring_poll(void)
+{
+	struct fi_cq_data_entry comp[RING_BATCH];
+	uint64_t tail;
+	ssize_t cnt, i;
+	int ret;
+
+	ret = ring_progress_tx();
+	if (ret)
+		return ret;
+
+	if (cur_mode == RING_TAIL) {
+		tail = *ring_word(RING_TAIL_OFF);
+		if (tail > recvd)
+			recvd = tail;
+	} else {
+		cnt = fi_cq_read(rxcq, comp, RING_BATCH);
+		if (cnt == -FI_EAVAIL)
+			return ft_cq_readerr(rxcq);
+		if (cnt < 0 && cnt != -FI_EAGAIN) {
+			FT_PRINTERR("fi_cq_read", cnt);
+			return (int) cnt;
+		}
+		for (i = 0; i < cnt; i++) {
+			/* the peer's next ft_sync() message, for ft_rx() */
+			if (comp[i].op_context == &rx_ctx) {
+				rx_cq_cntr++;
+				continue;
+			}
+			recvd++;
+			ret = ring_post_recv((struct fi_context *)
+					     comp[i].op_context - ring_rx_ctx);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return ring_credit(0);
+}
+
+static int ring_wait(uint64_t count)
+{
+	int ret;
+
+	while (recvd < count) {
+		ret = ring_poll();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int ring_latency(enum ring_mode mode, size_t size)
+{
+	int64_t t;
+	int i, ret;
+
+	ret = ring_consumer_start(mode, opts.warmup_iterations +
+				  opts.iterations);
+	if (ret)
+		return ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	ft_hist_reset(&ring_lat);
+	for (i = 0; i < opts.warmup_iterations + opts.iterations; i++) {
+		t = ft_gettime_ns();
+		if (opts.dst_addr) {
+			ret = ring_send(mode, size);
+			if (ret)
+				return ret;
+			ret = ring_wait(recvd + 1);
+			if (ret)
+				return ret;
+		} else {
+			ret = ring_wait(recvd + 1);
+			if (ret)
+				return ret;
+			ret = ring_send(mode, size);
+			if (ret)
+				return ret;
+		}
+		if (i >= opts.warmup_iterations)
+			ft_hist_add(&ring_lat, (ft_gettime_ns() - t) / 2);
+	}
+
+	/* final credits, so the next run starts with an empty ring */
+	ret = ring_credit(1);
+	if (ret)
+		return ret;
+	return ring_drain_tx();
+}
+
+/* Client streams, server consumes and acknowledges the last message */
+static int ring_rate(enum ring_mode mode, size_t size, int64_t *elapsed)
+{
+	int64_t start;
+	int i, ret;
+
+	ret = ring_consumer_start(mode, opts.dst_addr ? 0 : opts.iterations);
+	if (ret)
+		return ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr) {
+		ret = ring_wait(recvd + opts.iterations);
+		if (ret)
+			return ret;
+		ret = ring_credit(1);
+		if (ret)
+			return ret;
+		ret = ring_drain_tx();
+		if (ret)
+			return ret;
+		return ft_tx(ep, remote_fi_addr, 1, &tx_ctx);
+	}
+
+	start = ft_gettime_ns();
+	for (i = 0; i < opts.iterations; i++) {
+		ret = ring_send(mode, size);
+		if (ret)
+			return ret;
+	}
+	ret = ring_drain_tx();
+	if (ret)
+		return ret;
+
+	ret = ft_rx(ep, 1);
+	*elapsed = ft_gettime_ns() - start;
+	return ret;
+}
+
+static void ring_show(enum ring_mode mode, size_t size, int64_t elapsed)
+{
+	static int header = 1;
+	double rate = opts.iterations * 1e9 / elapsed;
+	char str[FT_STR_LEN];
+
+	if (opts.machr) {
+		printf("- { mode: %s, xfer_size: %zu, lat_avg: %f, lat_p50: %f, "
+			"lat_p99: %f, msgs/sec: %.0f, MB/sec: %f }\n",
+			ring_mode_str[mode], size,
+			(double) ring_lat.sum / ring_lat.count / 1000.0,
+			ft_hist_percentile(&ring_lat, 50.0) / 1000.0,
+			ft_hist_percentile(&ring_lat, 99.0) / 1000.0,
+			rate, rate * size / 1e6);
+		return;
+	}
+
+	if (header) {
+		printf("%-6s%-8s%10s%10s%10s%14s%12s\n", "mode", "bytes",
+			"lat avg", "lat p50", "lat p99", "msgs/sec", "MB/sec");
+		header = 0;
+	}
+	printf("%-6s%-8s%10.2f%10.2f%10.2f%14.0f%12.2f\n",
+		ring_mode_str[mode], size_str(str, size),
+		(double) ring_lat.sum / ring_lat.count / 1000.0,
+		ft_hist_percentile(&ring_lat, 50.0) / 1000.0,
+		ft_hist_percentile(&ring_lat, 99.0) / 1000.0,
+		rate, rate * size / 1e6);
+}
+
+static int run_size(size_t size)
+{
+	enum ring_mode mode;
+	int64_t elapsed = 0;
+	int ret;
+
+	opts.transfer_size = size;
+	init_test(&opts, test_name, sizeof(test_name));
+
+	for (mode = 0; mode < RING_MODE_MAX; mode++) {
+		if (!(mode_mask & (1 << mode)))
+			continue;
+
+		ret = ring_latency(mode, size);
+		if (ret)
+			return ret;
+
+		ret = ring_rate(mode, size, &elapsed);
+		if (ret)
+			return ret;
+
+		if (opts.dst_addr)
+			ring_show(mode, size, elapsed);
+	}
+	return 0;
+}
+
+static int run(int sweep)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Ring");
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	ret = ring_alloc();
+	if (ret)
+		return ret;
+
+	waw = (fi->tx_attr->msg_order & FI_ORDER_WAW) != 0;
+
+	if (!sweep) {
+		ret = run_size(slot_size);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; sweep && i < TEST_CNT; i++) {
+		if (!ft_use_size(i, opts.sizes_enabled) ||
+		    test_size[i].size > RING_MAX_MSG)
+			continue;
+		ret = run_size(test_size[i].size);
+		if (ret)
+			return ret;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret, sweep;
+
+	opts = INIT_OPTS;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "ho:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, ring_mode_str,
+					  RING_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "SPSC message ring over RMA writes "
+					"compared with tagged messages.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-o <mode>", "data|tail|msg|all "
+					"(default all)");
+			fprintf(stderr, "Note: -W sets the ring slots, and sizes "
+					"above 64k are skipped unless set "
+					"with -S.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	slots = MAX(opts.window_size, 2);
+	sweep = !(opts.options & FT_OPT_SIZE);
+	slot_size = sweep ? RING_MAX_MSG : opts.transfer_size;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + RING_SLOTS_OFF +
+			     slots * slot_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_TAGGED | FI_RMA;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR | FI_RX_CQ_DATA;
+	cq_attr.format = FI_CQ_FORMAT_DATA;
+
+	ret = run(sweep);
+
+	ring_free();
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Vectored messages versus pack-and-send.
+ *
+ * Messages of N segments ping-pong between client and server, sent and
+ * received in one of two ways:
+ *
+ *   vec   fi_sendv/fi_tsendv of the N segments, received with
+ *         fi_recvv/fi_trecvv into N segments of the same layout
+ *   pack  memcpy into a registered bounce buffer and one send; receive
+ *         into a bounce buffer and memcpy out
+ *
+ * Segments follow ft_format_iov_layout().  The iov count is swept in
+ * powers of two, up to the provider's iov_limit.  Each row reports half
+ * the round trip for both methods, and a summary gives the crossover
+ * points.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define SV_TAG		(1ULL << 40)
+#define SV_MAX_LIST	16
+#define SV_MAX_IOV	256
+
+enum sv_api {
+	SV_MSG,
+	SV_TAGGED,
+	SV_API_MAX,
+};
+
+static const char *sv_api_str[] = {
+	[SV_MSG] = "msg",
+	[SV_TAGGED] = "tagged",
+};
+
+static int segs[SV_MAX_LIST] = { 8, 64, 512, 4096, 32768 };
+static int seg_cnt = 5;
+static int max_iov = 64;
+static int api_mask = (1 << SV_API_MAX) - 1;
+static int layout_mask = (1 << FT_IOV_LAYOUT_MAX) - 1;
+
+static size_t area_size;
+static struct iovec tx_iov[SV_MAX_IOV], rx_iov[SV_MAX_IOV];
+static void *desc[SV_MAX_IOV];
+static struct fi_context sv_tx_ctx, sv_rx_ctx;
+
+/* 1 if packing won, 0 if the vectored op won, -1 if not run */
+static int winner[SV_MAX_LIST][SV_MAX_LIST];
+
+/* Scattered segments, then the bounce buffer, past the control area */
+static inline char *sv_tx_scatter(void)
+{
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static inline char *sv_rx_scatter(void)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static size_t sv_limit(void)
+{
+	size_t limit = MIN(fi->tx_attr->iov_limit, fi->rx_attr->iov_limit);
+
+	return MIN(MIN(limit, SV_MAX_IOV), (size_t) max_iov);
+}
+
+static int sv_wait(struct fid_cq *cq)
+{
+	struct fi_cq_entry comp;
+	ssize_t ret;
+
+	do {
+		ret = fi_cq_read(cq, &comp, 1);
+	} while (ret == -FI_EAGAIN);
+
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	return 0;
+}
+
+static int sv_post_recv(enum sv_api api, int packed, size_t cnt, size_t bytes)
+{
+	char *bounce = sv_rx_scatter() + 2 * area_size;
+	ssize_t ret;
+
+	do {
+		if (packed && api == SV_TAGGED)
+			ret = fi_trecv(ep, bounce, bytes, fi_mr_desc(mr),
+				       remote_fi_addr, SV_TAG, 0, &sv_rx_ctx);
+		else if (packed)
+			ret = fi_recv(ep, bounce, bytes, fi_mr_desc(mr),
+				      remote_fi_addr, &sv_rx_ctx);
+		else if (api == SV_TAGGED)
+			ret = fi_trecvv(ep, rx_iov, desc, cnt, remote_fi_addr,
+					SV_TAG, 0, &sv_rx_ctx);
+		else
+			ret = fi_recvv(ep, rx_iov, desc, cnt, remote_fi_addr,
+				       &sv_rx_ctx);
+	} while (ret == -FI_EAGAIN);
+	if (ret)
+		FT_PRINTERR("receive", ret);
+	return (int) ret;
+}
+
+static int sv_send(enum sv_api api, int packed, size_t cnt, size_t bytes)
+{
+	char *bounce = sv_tx_scatter() + 2 * area_size;
+	char *dst = bounce;
+	ssize_t ret;
+	size_t i;
+
+	if (packed) {
+		for (i = 0; i < cnt; i++) {
+			memcpy(dst, tx_iov[i].iov_base, tx_iov[i].iov_len);
+			dst += tx_iov[i].iov_len;
+		}
+	}
+
+	do {
+		if (packed && api == SV_TAGGED)
+			ret = fi_tsend(ep, bounce, bytes, fi_mr_desc(mr),
+				       remote_fi_addr, SV_TAG, &sv_tx_ctx);
+		else if (packed)
+			ret = fi_send(ep, bounce, bytes, fi_mr_desc(mr),
+				      remote_fi_addr, &sv_tx_ctx);
+		else if (api == SV_TAGGED)
+			ret = fi_tsendv(ep, tx_iov, desc, cnt, remote_fi_addr,
+					SV_TAG, &sv_tx_ctx);
+		else
+			ret = fi_sendv(ep, tx_iov, desc, cnt, remote_fi_addr,
+				       &sv_tx_ctx);
+	} while (ret == -FI_EAGAIN);
+	if (ret) {
+		FT_PRINTERR("send", ret);
+		return (int) ret;
+	}
+	return sv_wait(txcq);
+}
+
+static int sv_recv(int packed, size_t cnt)
+{
+	const char *src = sv_rx_scatter() + 2 * area_size;
+	size_t i;
+	int ret;
+
+	ret = sv_wait(rxcq);
+	if (ret || !packed)
+		return ret;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(rx_iov[i].iov_base, src, rx_iov[i].iov_len);
+		src += rx_iov[i].iov_len;
+	}
+	return 0;
+}
+
+/* Every message has a receive posted before its peer can send it */
+static int sv_time(enum sv_api api, int packed, size_t cnt, size_t bytes,
+		   double *usec)
+{
+	int total = opts.warmup_iterations + opts.iterations;
+	int64_t start = 0;
+	int i, ret;
+
+	if (!opts.dst_addr) {
+		ret = sv_post_recv(api, packed, cnt, bytes);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	for (i = 0; i < total; i++) {
+		if (i == opts.warmup_iterations)
+			start = ft_gettime_ns();
+
+		if (opts.dst_addr) {
+			ret = sv_post_recv(api, packed, cnt, bytes);
+			if (ret)
+				return ret;
+			ret = sv_send(api, packed, cnt, bytes);
+			if (ret)
+				return ret;
+			ret = sv_recv(packed, cnt);
+			if (ret)
+				return ret;
+		} else {
+			ret = sv_recv(packed, cnt);
+			if (ret)
+				return ret;
+			if (i + 1 < total) {
+				ret = sv_post_recv(api, packed, cnt, bytes);
+				if (ret)
+					return ret;
+			}
+			ret = sv_send(api, packed, cnt, bytes);
+			if (ret)
+				return ret;
+		}
+	}
+	*usec = (ft_gettime_ns() - start) / 1000.0 / opts.iterations / 2;
+	return 0;
+}
+
+static int sv_config(enum ft_iov_layout layout, enum sv_api api, size_t cnt,
+		     size_t seg, int *pack_won)
+{
+	double vec_usec = 0, pack_usec = 0;
+	size_t bytes, i;
+	int ret;
+
+	bytes = ft_format_iov_layout(tx_iov, cnt, sv_tx_scatter(), seg, layout);
+	ft_format_iov_layout(rx_iov, cnt, sv_rx_scatter(), seg, layout);
+	for (i = 0; i < cnt; i++)
+		desc[i] = fi_mr_desc(mr);
+
+	ret = sv_time(api, 0, cnt, bytes, &vec_usec);
+	if (ret)
+		return ret;
+	ret = sv_time(api, 1, cnt, bytes, &pack_usec);
+	if (ret)
+		return ret;
+
+	*pack_won = pack_usec < vec_usec;
+	if (!opts.dst_addr)
+		return 0;
+
+	if (opts.machr) {
+		printf("- { layout: %s, api: %s, iovs: %zu, seg: %zu, bytes: %zu, "
+			"vec_usec: %f, pack_usec: %f, winner: %s }\n",
+			ft_iov_layout_str[layout], sv_api_str[api], cnt, seg,
+			bytes, vec_usec, pack_usec,
+			*pack_won ? "pack" : "vec");
+	} else {
+		printf("%-10s%-8s%6zu%8zu%10zu%11.2f%11.2f  %s\n",
+			ft_iov_layout_str[layout], sv_api_str[api], cnt, seg,
+			bytes, vec_usec, pack_usec,
+			*pack_won ? "pack" : "vec");
+	}
+	return 0;
+}
+
+static void sv_summary(enum ft_iov_layout layout, enum sv_api api,
+		       int cnt_steps)
+{
+	int s, n;
+
+	if (opts.machr || !opts.dst_addr)
+		return;
+
+	printf("  %s %s crossovers:\n", ft_iov_layout_str[layout],
+		sv_api_str[api]);
+	for (s = 0; s < seg_cnt; s++) {
+		for (n = 0; n < cnt_steps && winner[n][s] != 1; n++)
+			;
+		if (n < cnt_steps)
+			printf("    seg %6d: pack wins from %d iovs\n",
+				segs[s], 1 << n);
+		else
+			printf("    seg %6d: vectored wins at all iov counts\n",
+				segs[s]);
+	}
+	for (n = 0; n < cnt_steps; n++) {
+		for (s = 0; s < seg_cnt && winner[n][s] != 0; s++)
+			;
+		if (s < seg_cnt)
+			printf("    %4d iovs: vectored wins from %d byte "
+				"segments\n", 1 << n, segs[s]);
+		else
+			printf("    %4d iovs: pack wins at all segment sizes\n",
+				1 << n);
+	}
+}
+
+static int run(void)
+{
+	enum ft_iov_layout layout;
+	enum sv_api api;
+	size_t cnt;
+	int n, s, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Segments");
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr) {
+		printf("tx iov_limit %zu, rx iov_limit %zu\n",
+			fi->tx_attr->iov_limit, fi->rx_attr->iov_limit);
+		printf("%-10s%-8s%6s%8s%10s%11s%11s  %s\n", "layout", "api",
+			"iovs", "seg", "bytes", "vec usec", "pack usec",
+			"winner");
+	}
+
+	for (layout = 0; layout < FT_IOV_LAYOUT_MAX; layout++) {
+		if (!(layout_mask & (1 << layout)))
+			continue;
+		for (api = 0; api < SV_API_MAX; api++) {
+			if (!(api_mask & (1 << api)))
+				continue;
+
+			memset(winner, -1, sizeof winner);
+			for (n = 0, cnt = 1; cnt <= sv_limit() &&
+			     n < SV_MAX_LIST; n++, cnt *= 2) {
+				for (s = 0; s < seg_cnt; s++) {
+					ret = sv_config(layout, api, cnt,
+							segs[s], &winner[n][s]);
+					if (ret)
+						return ret;
+				}
+			}
+			sv_summary(layout, api, n);
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, i, ret, max_seg = 0;
+
+	opts = INIT_OPTS;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hG:N:T:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'G':
+			if (ft_parse_int_list(optarg, segs, &seg_cnt,
+					      SV_MAX_LIST, 1, 1 << 20)) {
+				fprintf(stderr, "Invalid segment sizes: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'N':
+			max_iov = atoi(optarg);
+			if (max_iov < 1 || max_iov > SV_MAX_IOV) {
+				fprintf(stderr, "Max iov count must be 1-%d\n",
+					SV_MAX_IOV);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			if (ft_parse_mask(optarg, ft_iov_layout_str,
+					  FT_IOV_LAYOUT_MAX, &layout_mask)) {
+				fprintf(stderr, "Invalid layout: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, sv_api_str,
+					  SV_API_MAX, &api_mask)) {
+				fprintf(stderr, "Invalid api: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Vectored sends versus pack and "
+					"send.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-o <api>", "msg|tagged|all "
+					"(default all)");
+			FT_PRINT_OPTS_USAGE("-T <layout>", "strided|irregular|all "
+					"(default all)");
+			FT_PRINT_OPTS_USAGE("-N <iovs>", "max iov count, swept in "
+					"powers of two (default 64)");
+			FT_PRINT_OPTS_USAGE("-G <s1,s2,..>", "segment sizes "
+					"(default 8,64,512,4096,32768)");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	for (i = 0; i < seg_cnt; i++)
+		max_seg = MAX(max_seg, segs[i]);
+
+	/* payload may exceed max_iov * max_seg by one byte per segment */
+	area_size = (size_t) max_iov * (max_seg + 1);
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + 3 * area_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_TAGGED;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+
+	ret = run();
+
+	ft_free_res();
+	return -ret;
+}
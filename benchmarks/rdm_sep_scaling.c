@@ -0,0 +1,711 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Message rate across transmit contexts of a scalable endpoint.
+ *
+ * For each context count C, doubling from 1 up to -C, both sides open a
+ * scalable endpoint with C TX/RX context pairs.  Each pair gets its own
+ * CQ and its own thread pinned to a CPU.  Client context i streams -I
+ * messages to server RX context i, addressed with fi_rx_addr(), and waits
+ * for one acknowledgement.  The same step is repeated with C independent
+ * regular endpoints as a baseline.  Aggregate message rate and bandwidth
+ * are reported for both side by side, along with the speedup over C = 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_cm.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define SC_BATCH	16
+
+enum sc_mode {
+	SC_SEP,
+	SC_EP,
+	SC_MODE_MAX,
+};
+
+static const char *sc_mode_str[] = {
+	[SC_SEP] = "sep",
+	[SC_EP] = "ep",
+};
+
+struct sc_lane {
+	int id;
+	pthread_t thread;
+	struct fid_ep *tx;
+	struct fid_ep *rx;
+	struct fid_cq *cq;
+	struct fid_mr *mr;
+	void *desc;
+	void *buf;
+	void *tx_buf;
+	void *rx_buf;
+	fi_addr_t dest;
+	struct fi_context *ctx;
+	struct fi_context ack_ctx;
+
+	int64_t elapsed;
+	int ret;
+};
+
+static int max_ctx = 16;
+static int mode_mask = (1 << SC_MODE_MAX) - 1;
+static int ncpus;
+static struct sc_lane *lanes;
+static struct fid_ep *sep;
+static struct fid_av *sc_av;
+static volatile int go;
+
+/* Aggregate Mmsg/s per mode, indexed by context count step */
+static double rate[SC_MODE_MAX][32];
+
+static int sc_open_av(int ctx_bits)
+{
+	struct fi_av_attr attr = {
+		.type = av_attr.type,
+		.rx_ctx_bits = ctx_bits,
+		.count = max_ctx,
+	};
+	int ret;
+
+	ret = fi_av_open(domain, &attr, &sc_av, NULL);
+	if (ret)
+		FT_PRINTERR("fi_av_open", ret);
+	return ret;
+}
+
+static int sc_open_lane(struct sc_lane *lane)
+{
+	struct fi_cq_attr attr = {
+		.format = FI_CQ_FORMAT_CONTEXT,
+		.wait_obj = FI_WAIT_NONE,
+		.size = fi->tx_attr->size + fi->rx_attr->size,
+	};
+	size_t len;
+	int ret;
+
+	lane->ctx = calloc(opts.window_size, sizeof *lane->ctx);
+	if (!lane->ctx)
+		return -FI_ENOMEM;
+
+	len = MAX(opts.transfer_size, FT_MAX_CTRL_MSG) +
+		MAX(ft_tx_prefix_size(), ft_rx_prefix_size());
+	lane->buf = calloc(2, len);
+	if (!lane->buf)
+		return -FI_ENOMEM;
+	lane->tx_buf = lane->buf;
+	lane->rx_buf = (char *) lane->buf + len;
+
+	if (fi->mode & FI_LOCAL_MR) {
+		ret = fi_mr_reg(domain, lane->buf, 2 * len, FI_SEND | FI_RECV,
+				0, FT_MR_KEY + 1 + lane->id, 0, &lane->mr, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_mr_reg", ret);
+			return ret;
+		}
+		lane->desc = fi_mr_desc(lane->mr);
+	}
+
+	ret = fi_cq_open(domain, &attr, &lane->cq, NULL);
+	if (ret) {
+		FT_PRINTERR("fi_cq_open", ret);
+		return ret;
+	}
+	return 0;
+}
+
+static void sc_close(int n)
+{
+	int i;
+
+	for (i = 0; lanes && i < n; i++) {
+		if (lanes[i].rx != lanes[i].tx)
+			FT_CLOSE_FID(lanes[i].rx);
+		FT_CLOSE_FID(lanes[i].tx);
+		FT_CLOSE_FID(lanes[i].cq);
+		FT_CLOSE_FID(lanes[i].mr);
+		free(lanes[i].buf);
+		free(lanes[i].ctx);
+	}
+	FT_CLOSE_FID(sep);
+	FT_CLOSE_FID(sc_av);
+	free(lanes);
+	lanes = NULL;
+}
+
+/* Trade an endpoint name over the control endpoint */
+static int sc_exchange_addr(struct fid *fid, fi_addr_t *addr)
+{
+	size_t addrlen = FT_MAX_CTRL_MSG;
+	int ret;
+
+	ret = fi_getname(fid, (char *) tx_buf + ft_tx_prefix_size(), &addrlen);
+	if (ret) {
+		FT_PRINTERR("fi_getname", ret);
+		return ret;
+	}
+
+	if (opts.dst_addr) {
+		ret = ft_tx(ep, remote_fi_addr, addrlen, &tx_ctx);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_get_rx_comp(rx_seq);
+	if (ret)
+		return ret;
+
+	ret = ft_av_insert(sc_av, (char *) rx_buf + ft_rx_prefix_size(), 1,
+			   addr, 0, NULL);
+	if (ret)
+		return ret;
+
+	ret = ft_post_rx(ep, rx_size, &rx_ctx);
+	if (ret)
+		return ret;
+
+	if (!opts.dst_addr)
+		ret = ft_tx(ep, remote_fi_addr, addrlen, &tx_ctx);
+
+	return ret;
+}
+
+/*
+ * One scalable endpoint with n context pairs.  TX and RX context i share
+ * lane i's CQ, and peer RX context i is addressed with fi_rx_addr().
+ */
+static int sc_open_sep(int n)
+{
+	struct fi_info *info;
+	fi_addr_t peer;
+	int i, ret, ctx_bits = 0;
+
+	/* Get number of bits needed to represent n */
+	while (n >> ++ctx_bits);
+
+	ret = sc_open_av(ctx_bits);
+	if (ret)
+		return ret;
+
+	info = fi_dupinfo(fi);
+	if (!info)
+		return -FI_ENOMEM;
+	info->ep_attr->tx_ctx_cnt = n;
+	info->ep_attr->rx_ctx_cnt = n;
+
+	ret = fi_scalable_ep(domain, info, &sep, NULL);
+	fi_freeinfo(info);
+	if (ret) {
+		FT_PRINTERR("fi_scalable_ep", ret);
+		return ret;
+	}
+
+	ret = fi_scalable_ep_bind(sep, &sc_av->fid, 0);
+	if (ret) {
+		FT_PRINTERR("fi_scalable_ep_bind", ret);
+		return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		ret = fi_tx_context(sep, i, NULL, &lanes[i].tx, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_tx_context", ret);
+			return ret;
+		}
+
+		ret = fi_rx_context(sep, i, NULL, &lanes[i].rx, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_rx_context", ret);
+			return ret;
+		}
+
+		FT_EP_BIND(lanes[i].tx, lanes[i].cq, FI_SEND);
+		FT_EP_BIND(lanes[i].rx, lanes[i].cq, FI_RECV);
+
+		ret = fi_enable(lanes[i].tx);
+		if (ret) {
+			FT_PRINTERR("fi_enable", ret);
+			return ret;
+		}
+
+		ret = fi_enable(lanes[i].rx);
+		if (ret) {
+			FT_PRINTERR("fi_enable", ret);
+			return ret;
+		}
+	}
+
+	ret = fi_enable(sep);
+	if (ret) {
+		FT_PRINTERR("fi_enable", ret);
+		return ret;
+	}
+
+	ret = sc_exchange_addr(&sep->fid, &peer);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < n; i++)
+		lanes[i].dest = fi_rx_addr(peer, i, ctx_bits);
+	return 0;
+}
+
+/* n regular endpoints, each with a single CQ, paired with the peer's */
+static int sc_open_eps(int n)
+{
+	int i, ret;
+
+	ret = sc_open_av(0);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < n; i++) {
+		ret = fi_endpoint(domain, fi, &lanes[i].tx, NULL);
+		if (ret) {
+			FT_PRINTERR("fi_endpoint", ret);
+			return ret;
+		}
+		lanes[i].rx = lanes[i].tx;
+
+		FT_EP_BIND(lanes[i].tx, sc_av, 0);
+		FT_EP_BIND(lanes[i].tx, lanes[i].cq, FI_TRANSMIT | FI_RECV);
+
+		ret = fi_enable(lanes[i].tx);
+		if (ret) {
+			FT_PRINTERR("fi_enable", ret);
+			return ret;
+		}
+
+		ret = sc_exchange_addr(&lanes[i].tx->fid, &lanes[i].dest);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int sc_open(enum sc_mode mode, int n)
+{
+	int i, ret;
+
+	lanes = calloc(n, sizeof *lanes);
+	if (!lanes)
+		return -FI_ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		lanes[i].id = i;
+		ret = sc_open_lane(&lanes[i]);
+		if (ret)
+			return ret;
+	}
+
+	return mode == SC_SEP ? sc_open_sep(n) : sc_open_eps(n);
+}
+
+static int sc_post_recv(struct sc_lane *lane, struct fi_context *ctx)
+{
+	ssize_t ret;
+
+	do {
+		ret = fi_recv(lane->rx, lane->rx_buf,
+			      MAX(opts.transfer_size, FT_MAX_CTRL_MSG) +
+			      ft_rx_prefix_size(), lane->desc, 0, ctx);
+	} while (ret == -FI_EAGAIN);
+
+	if (ret)
+		FT_PRINTERR("fi_recv", ret);
+	return (int) ret;
+}
+
+static int sc_send(struct sc_lane *lane, size_t size, struct fi_context *ctx)
+{
+	ssize_t ret;
+
+	ret = fi_send(lane->tx, lane->tx_buf, size + ft_tx_prefix_size(),
+		      lane->desc, lane->dest, ctx);
+	if (ret && ret != -FI_EAGAIN)
+		FT_PRINTERR("fi_send", ret);
+	return (int) ret;
+}
+
+/*
+ * Reads a batch of completions.  Data completions are counted in *cnt and,
+ * while *posted is below the iteration count, receives are reposted on the
+ * returned context.  *acked is set by the acknowledgement completion.
+ */
+static int sc_reap(struct sc_lane *lane, int *cnt, int *posted, int *acked)
+{
+	struct fi_cq_entry comp[SC_BATCH];
+	ssize_t ret, i;
+	int err;
+
+	ret = fi_cq_read(lane->cq, comp, SC_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(lane->cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	for (i = 0; i < ret; i++) {
+		if (comp[i].op_context == &lane->ack_ctx) {
+			*acked = 1;
+			continue;
+		}
+
+		(*cnt)++;
+		if (posted && *posted < opts.iterations) {
+			err = sc_post_recv(lane, comp[i].op_context);
+			if (err)
+				return err;
+			(*posted)++;
+		}
+	}
+	return 0;
+}
+
+static int sc_client(struct sc_lane *lane)
+{
+	int sent = 0, done = 0, acked = 0, ret;
+
+	while (done < opts.iterations) {
+		while (sent < opts.iterations &&
+		       sent - done < opts.window_size) {
+			ret = sc_send(lane, opts.transfer_size,
+				      &lane->ctx[sent % opts.window_size]);
+			if (ret == -FI_EAGAIN)
+				break;
+			if (ret)
+				return ret;
+			sent++;
+		}
+
+		ret = sc_reap(lane, &done, NULL, &acked);
+		if (ret)
+			return ret;
+	}
+
+	while (!acked) {
+		ret = sc_reap(lane, &done, NULL, &acked);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int sc_server(struct sc_lane *lane, int *posted)
+{
+	int got = 0, acked = 0, ret;
+
+	while (got < opts.iterations) {
+		ret = sc_reap(lane, &got, posted, &acked);
+		if (ret)
+			return ret;
+	}
+
+	while ((ret = sc_send(lane, 0, &lane->ack_ctx)) == -FI_EAGAIN)
+		;
+	if (ret)
+		return ret;
+
+	while (!acked) {
+		ret = sc_reap(lane, &got, NULL, &acked);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void *sc_thread(void *arg)
+{
+	struct sc_lane *lane = arg;
+	cpu_set_t cpus;
+	int64_t start;
+	int posted;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(lane->id % ncpus, &cpus);
+	lane->ret = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+	if (lane->ret) {
+		FT_PRINTERR("pthread_setaffinity_np", -lane->ret);
+		lane->ret = -lane->ret;
+		return NULL;
+	}
+
+	posted = MIN(opts.window_size, opts.iterations);
+	while (!go)
+		;
+
+	start = ft_gettime_ns();
+	lane->ret = opts.dst_addr ? sc_client(lane) : sc_server(lane, &posted);
+	lane->elapsed = ft_gettime_ns() - start;
+	return NULL;
+}
+
+/*
+ * Receives are posted before the step's ft_sync(), so the client cannot
+ * run ahead of them: the server posts a window of data receives per lane
+ * and the client a single acknowledgement receive.
+ */
+static int sc_prepost(int n)
+{
+	int i, j, ret;
+
+	for (i = 0; i < n; i++) {
+		if (opts.dst_addr) {
+			ret = sc_post_recv(&lanes[i], &lanes[i].ack_ctx);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		for (j = 0; j < MIN(opts.window_size, opts.iterations); j++) {
+			ret = sc_post_recv(&lanes[i], &lanes[i].ctx[j]);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int sc_run(int n)
+{
+	int i, ret = 0;
+
+	go = 0;
+	for (i = 0; i < n; i++) {
+		ret = pthread_create(&lanes[i].thread, NULL, sc_thread,
+				     &lanes[i]);
+		if (ret) {
+			FT_PRINTERR("pthread_create", ret);
+			n = i;
+			ret = -ret;
+			break;
+		}
+	}
+
+	go = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(lanes[i].thread, NULL);
+		if (!ret)
+			ret = lanes[i].ret;
+	}
+	return ret;
+}
+
+static int run_step(enum sc_mode mode, int n, int step)
+{
+	int64_t elapsed = 0;
+	int i, ret;
+
+	ret = sc_open(mode, n);
+	if (ret)
+		goto out;
+
+	ret = sc_prepost(n);
+	if (ret)
+		goto out;
+
+	ret = ft_sync();
+	if (ret)
+		goto out;
+
+	ret = sc_run(n);
+	if (ret)
+		goto out;
+
+	ret = ft_sync();
+	if (ret)
+		goto out;
+
+	for (i = 0; i < n; i++)
+		elapsed = MAX(elapsed, lanes[i].elapsed);
+	rate[mode][step] = (double) n * opts.iterations * 1e3 / elapsed;
+out:
+	sc_close(n);
+	return ret;
+}
+
+static void show_step(int n, int step)
+{
+	double mbps;
+	int m;
+
+	if (!opts.machr)
+		printf("%8d", n);
+
+	for (m = 0; m < SC_MODE_MAX; m++) {
+		if (!(mode_mask & (1 << m))) {
+			if (!opts.machr)
+				printf(" %10s %10s %8s", "-", "-", "-");
+			continue;
+		}
+
+		mbps = rate[m][step] * opts.transfer_size;
+		if (opts.machr)
+			printf("- { mode: %s, contexts: %d, size: %d, "
+				"Mmsg/sec: %f, MB/sec: %f, speedup: %f }\n",
+				sc_mode_str[m], n, opts.transfer_size,
+				rate[m][step], mbps, rate[m][step] / rate[m][0]);
+		else
+			printf(" %10.3f %10.2f %8.2f", rate[m][step], mbps,
+				rate[m][step] / rate[m][0]);
+	}
+
+	if (!opts.machr)
+		printf("\n");
+}
+
+static int run(void)
+{
+	enum sc_mode mode;
+	int n, step, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	max_ctx = MIN(max_ctx, fi->domain_attr->max_ep_tx_ctx);
+	max_ctx = MIN(max_ctx, fi->domain_attr->max_ep_rx_ctx);
+	if (max_ctx < 1) {
+		fprintf(stderr, "Provider doesn't support contexts\n");
+		return -FI_ENODATA;
+	}
+
+	ncpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	if (opts.dst_addr && !opts.machr) {
+		printf("contexts: up to %d (max_ep_tx_ctx %zu, max_ep_rx_ctx "
+			"%zu), %d cpus, %d byte messages\n", max_ctx,
+			fi->domain_attr->max_ep_tx_ctx,
+			fi->domain_attr->max_ep_rx_ctx, ncpus,
+			opts.transfer_size);
+		printf("%8s %10s %10s %8s %10s %10s %8s\n", "contexts",
+			"sep Mmsg/s", "sep MB/s", "speedup",
+			"ep Mmsg/s", "ep MB/s", "speedup");
+	}
+
+	for (n = 1, step = 0; ; n = MIN(n * 2, max_ctx), step++) {
+		for (mode = 0; mode < SC_MODE_MAX; mode++) {
+			if (!(mode_mask & (1 << mode)))
+				continue;
+
+			ret = run_step(mode, n, step);
+			if (ret)
+				return ret;
+		}
+
+		if (opts.dst_addr)
+			show_step(n, step);
+		if (n == max_ctx)
+			break;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.options |= FT_OPT_SIZE;
+	opts.iterations = 100000;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hC:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'C':
+			max_ctx = atoi(optarg);
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, sc_mode_str,
+					  SC_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Message rate across scalable "
+					"endpoint contexts versus regular "
+					"endpoints.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-C <count>", "maximum number of "
+					"contexts (default 16)");
+			FT_PRINT_OPTS_USAGE("-o <mode>", "sep|ep|all "
+					"(default all)");
+			fprintf(stderr, "Note: -I is the number of messages per "
+					"context, and all options must match on "
+					"both sides.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	if (max_ctx < 1 || max_ctx > (1 << 30) || opts.window_size < 1) {
+		fprintf(stderr, "Context count and window must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_NAMED_RX_CTX;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	hints->domain_attr->threading = FI_THREAD_COMPLETION;
+
+	ret = run();
+
+	sc_close(0);
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Tag matching cost as the posted and unexpected queues grow.
+ *
+ * The server receives and the client sends, in rounds of N messages,
+ * each with a distinct tag.
+ *
+ *   posted  the server pre-posts N tagged receives, then the client sends
+ *           N messages so that each one matches the head (best), the tail
+ *           (worst) or a random entry of the posted queue.  Time runs from
+ *           the sync to the last completion.
+ *   unexp   the client sends N messages first and signals the server with
+ *           one more message.  The server then posts N receives so that
+ *           each one matches the head, the tail or a random entry of the
+ *           unexpected queue.  Time runs from the first post to the last
+ *           completion.
+ *
+ * -i gives every receive an ignore mask over the low tag byte, and the
+ * sender puts random bits there.  -d posts directed receives
+ * (FI_DIRECTED_RECV).  The server reports time per message for each depth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define TM_TAG		(1ULL << 40)
+#define TM_MARK		(1ULL << 41)
+#define TM_MARK_IDX	-1
+#define TM_IGNORE	0xffULL
+#define TM_BATCH	16
+
+enum tm_path {
+	TM_POSTED,
+	TM_UNEXP,
+	TM_PATH_MAX,
+};
+
+enum tm_order {
+	TM_BEST,
+	TM_WORST,
+	TM_RANDOM,
+	TM_ORDER_MAX,
+};
+
+static const char *tm_path_str[] = {
+	[TM_POSTED] = "posted",
+	[TM_UNEXP] = "unexp",
+};
+
+static const char *tm_order_str[] = {
+	[TM_BEST] = "best",
+	[TM_WORST] = "worst",
+	[TM_RANDOM] = "random",
+};
+
+static int path_mask = (1 << TM_PATH_MAX) - 1;
+static int order_mask = (1 << TM_ORDER_MAX) - 1;
+static int max_depth = 1024;
+static int use_ignore, use_directed;
+static size_t tm_size = 4;
+
+static int *perm;
+static struct fi_context *tm_tx_ctx, *tm_rx_ctx;
+static struct fi_context tm_mark_ctx;
+
+static inline uint64_t tm_tag(int i)
+{
+	return TM_TAG | ((uint64_t) i << 8);
+}
+
+static void tm_order(enum tm_order order, int cnt)
+{
+	int i, j, tmp;
+
+	for (i = 0; i < cnt; i++)
+		perm[i] = order == TM_WORST ? cnt - 1 - i : i;
+
+	if (order != TM_RANDOM)
+		return;
+
+	for (i = cnt - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+}
+
+/*
+ * The receive ft_rx() keeps posted for the next sync completes on rxcq if
+ * the peer reaches that sync first.  It is credited to rx_cq_cntr for
+ * ft_rx() rather than counted as a data message.
+ */
+static int tm_reap(struct fid_cq *cq, int *cnt)
+{
+	struct fi_cq_entry comp[TM_BATCH];
+	ssize_t ret, i;
+
+	ret = fi_cq_read(cq, comp, TM_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(cq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	for (i = 0; i < ret; i++) {
+		if (comp[i].op_context == &rx_ctx)
+			rx_cq_cntr++;
+		else
+			(*cnt)++;
+	}
+	return 0;
+}
+
+static int tm_wait(struct fid_cq *cq, int cnt)
+{
+	int done = 0, ret;
+
+	while (done < cnt) {
+		ret = tm_reap(cq, &done);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int tm_post_recv(int i)
+{
+	char *buf = (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+	ssize_t ret;
+
+	do {
+		if (i == TM_MARK_IDX)
+			ret = fi_trecv(ep, buf, tm_size, fi_mr_desc(mr),
+				       remote_fi_addr, TM_MARK, 0,
+				       &tm_mark_ctx);
+		else
+			ret = fi_trecv(ep, buf, tm_size, fi_mr_desc(mr),
+				       use_directed ? remote_fi_addr :
+				       FI_ADDR_UNSPEC, tm_tag(i),
+				       use_ignore ? TM_IGNORE : 0,
+				       &tm_rx_ctx[i]);
+	} while (ret == -FI_EAGAIN);
+	if (ret)
+		FT_PRINTERR("fi_trecv", ret);
+	return (int) ret;
+}
+
+/*
+ * Sends are posted back to back; completions are reaped only on EAGAIN.
+ * Unexpected rounds end with a marker the server receives on its own tag,
+ * so the control path never sees data completions.
+ */
+static int tm_send_all(int cnt, int mark, int *done)
+{
+	char *buf = (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG;
+	uint64_t tag;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < cnt + mark; i++) {
+		if (i == cnt) {
+			while ((ret = fi_tinject(ep, buf, 0, remote_fi_addr,
+						 TM_MARK)) == -FI_EAGAIN) {
+				ret = tm_reap(txcq, done);
+				if (ret)
+					return (int) ret;
+			}
+			if (ret) {
+				FT_PRINTERR("fi_tinject", ret);
+				return (int) ret;
+			}
+			break;
+		}
+
+		tag = tm_tag(perm[i]);
+		if (use_ignore)
+			tag |= rand() & TM_IGNORE;
+
+		while ((ret = fi_tsend(ep, buf, tm_size, fi_mr_desc(mr),
+				       remote_fi_addr, tag, &tm_tx_ctx[i])) ==
+		       -FI_EAGAIN) {
+			ret = tm_reap(txcq, done);
+			if (ret)
+				return (int) ret;
+		}
+		if (ret) {
+			FT_PRINTERR("fi_tsend", ret);
+			return (int) ret;
+		}
+	}
+	return 0;
+}
+
+static int tm_round(enum tm_path path, enum tm_order order, int cnt,
+		    int64_t *elapsed)
+{
+	int64_t start;
+	int i, done = 0, ret;
+
+	if (!opts.dst_addr && path == TM_UNEXP) {
+		ret = tm_post_recv(TM_MARK_IDX);
+		if (ret)
+			return ret;
+	} else if (!opts.dst_addr) {
+		for (i = 0; i < cnt; i++) {
+			ret = tm_post_recv(i);
+			if (ret)
+				return ret;
+		}
+	}
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr) {
+		tm_order(path == TM_POSTED ? order : TM_BEST, cnt);
+		ret = tm_send_all(cnt, path == TM_UNEXP, &done);
+		if (ret)
+			return ret;
+		return tm_wait(txcq, cnt - done);
+	}
+
+	if (path == TM_POSTED) {
+		start = ft_gettime_ns();
+	} else {
+		ret = tm_wait(rxcq, 1);
+		if (ret)
+			return ret;
+
+		tm_order(order, cnt);
+		start = ft_gettime_ns();
+		for (i = 0; i < cnt; i++) {
+			ret = tm_post_recv(perm[i]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	ret = tm_wait(rxcq, cnt);
+	if (ret)
+		return ret;
+
+	*elapsed += ft_gettime_ns() - start;
+	return 0;
+}
+
+static int tm_run(enum tm_path path, enum tm_order order, int cnt)
+{
+	int64_t elapsed = 0, warm = 0;
+	int rounds, i, ret;
+	double ns;
+
+	rounds = MAX(opts.iterations / cnt, 1);
+	for (i = 0; i < opts.warmup_iterations; i++) {
+		ret = tm_round(path, order, cnt, &warm);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; i < rounds; i++) {
+		ret = tm_round(path, order, cnt, &elapsed);
+		if (ret)
+			return ret;
+	}
+
+	if (opts.dst_addr)
+		return 0;
+
+	ns = (double) elapsed / rounds / cnt;
+	if (opts.machr)
+		printf("- { path: %s, order: %s, depth: %d, ignore: %d, "
+			"directed: %d, xfer_size: %zu, ns/msg: %f, "
+			"Mmsg/sec: %f }\n", tm_path_str[path],
+			tm_order_str[order], cnt, use_ignore, use_directed,
+			tm_size, ns, 1000.0 / ns);
+	else
+		printf("%-8s%-8s%8d%12.1f%12.3f\n", tm_path_str[path],
+			tm_order_str[order], cnt, ns, 1000.0 / ns);
+	return 0;
+}
+
+static int tm_max(enum tm_path path)
+{
+	/* the control path keeps one receive posted */
+	if (path == TM_POSTED)
+		return MIN(max_depth, (int) fi->rx_attr->size - 1);
+	return MIN(max_depth, (int) fi->tx_attr->size);
+}
+
+static int run(void)
+{
+	enum tm_path path;
+	enum tm_order order;
+	int cnt, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Message");
+	if (ret)
+		return ret;
+
+	perm = calloc(max_depth, sizeof *perm);
+	tm_tx_ctx = calloc(max_depth, sizeof *tm_tx_ctx);
+	tm_rx_ctx = calloc(max_depth, sizeof *tm_rx_ctx);
+	if (!perm || !tm_tx_ctx || !tm_rx_ctx)
+		return -FI_ENOMEM;
+
+	srand(1);
+	if (!opts.dst_addr) {
+		if ((path_mask & (1 << TM_UNEXP)) &&
+		    !(fi->tx_attr->msg_order & FI_ORDER_SAS))
+			printf("Warning: no FI_ORDER_SAS, unexpected rounds "
+				"may start before all messages arrive\n");
+		if (!opts.machr)
+			printf("%-8s%-8s%8s%12s%12s\n", "path", "order",
+				"depth", "ns/msg", "Mmsg/sec");
+	}
+
+	for (path = 0; path < TM_PATH_MAX; path++) {
+		if (!(path_mask & (1 << path)))
+			continue;
+		for (order = 0; order < TM_ORDER_MAX; order++) {
+			if (!(order_mask & (1 << order)))
+				continue;
+			for (cnt = 1; cnt <= tm_max(path); cnt *= 4) {
+				ret = tm_run(path, order, cnt);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret;
+
+	opts = INIT_OPTS;
+	opts.transfer_size = tm_size;
+	opts.warmup_iterations = 2;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hQ:o:r:id" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'Q':
+			max_depth = atoi(optarg);
+			if (max_depth < 1) {
+				fprintf(stderr, "Invalid depth: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, tm_path_str,
+					  TM_PATH_MAX, &path_mask)) {
+				fprintf(stderr, "Invalid path: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (ft_parse_mask(optarg, tm_order_str,
+					  TM_ORDER_MAX, &order_mask)) {
+				fprintf(stderr, "Invalid order: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			use_ignore = 1;
+			break;
+		case 'd':
+			use_directed = 1;
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Tag matching cost versus posted and "
+					"unexpected queue depth.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-Q <depth>", "max queue depth, swept "
+					"in powers of four (default 1024)");
+			FT_PRINT_OPTS_USAGE("-o <path>", "posted|unexp|all "
+					"(default all)");
+			FT_PRINT_OPTS_USAGE("-r <order>", "match position: "
+					"best|worst|random|all (default all)");
+			FT_PRINT_OPTS_USAGE("-i", "post receives with an ignore "
+					"mask over the low tag byte");
+			FT_PRINT_OPTS_USAGE("-d", "post directed receives "
+					"(FI_DIRECTED_RECV)");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	tm_size = opts.transfer_size;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + tm_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_TAGGED;
+	if (use_directed)
+		hints->caps |= FI_DIRECTED_RECV;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+
+	ret = run();
+
+	free(perm);
+	free(tm_tx_ctx);
+	free(tm_rx_ctx);
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Cost of probe-driven receives (FI_PEEK and FI_CLAIM).
+ *
+ * For each size and unexpected queue depth Q, the client queues Q tagged
+ * messages, then sends a marker on a private tag.  Once the marker
+ * arrives, the server times:
+ *
+ *   hit    FI_PEEK for a tag that is queued
+ *   miss   FI_PEEK for a tag that is not queued (a polling probe loop)
+ *   claim  FI_PEEK | FI_CLAIM followed by the claiming fi_trecvmsg,
+ *          per message, until the queue is drained
+ *
+ * For each size, the server then compares message rate when every receive
+ * is driven by a wildcard FI_PEEK | FI_CLAIM (MPI_Improbe/Mrecv style)
+ * against pre-posted receives, over -W message windows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define PB_TAG		(1ULL << 40)
+#define PB_MISS		(PB_TAG | 0xffffffffULL)
+#define PB_ANY		0xffffffffULL
+#define PB_MARK		(1ULL << 41)
+#define PB_MAX_MSG	(1 << 16)
+#define PB_BATCH	16
+
+static int max_depth = 256;
+static size_t pb_size;
+
+static struct fi_context *pb_tx_ctx, *pb_rx_ctx;
+static struct fi_context pb_peek_ctx, pb_mark_ctx;
+static int tx_pending;
+
+static inline char *pb_rx_data(void)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static inline char *pb_tx_data(void)
+{
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static int pb_reap_tx(void)
+{
+	struct fi_cq_tagged_entry comp[PB_BATCH];
+	ssize_t ret;
+
+	ret = fi_cq_read(txcq, comp, PB_BATCH);
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret == -FI_EAVAIL)
+		return ft_cq_readerr(txcq);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+	tx_pending -= ret;
+	return 0;
+}
+
+/*
+ * Waits for cnt receive-side completions.  A peek that finds nothing
+ * completes with FI_ENOMSG, which is returned as -FI_ENOMSG.  The receive
+ * ft_rx() keeps posted for the next sync also completes here if the peer
+ * reaches it first; it is credited to rx_cq_cntr for ft_rx() to pick up.
+ */
+static int pb_wait_rx(int cnt)
+{
+	struct fi_cq_tagged_entry comp[PB_BATCH];
+	struct fi_cq_err_entry err;
+	ssize_t ret, i;
+
+	while (cnt > 0) {
+		ret = fi_cq_read(rxcq, comp, MIN(cnt, PB_BATCH));
+		if (ret > 0) {
+			for (i = 0; i < ret; i++) {
+				if (comp[i].op_context == &rx_ctx)
+					rx_cq_cntr++;
+				else
+					cnt--;
+			}
+			continue;
+		}
+		if (ret == -FI_EAGAIN)
+			continue;
+		if (ret != -FI_EAVAIL) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return (int) ret;
+		}
+
+		ret = fi_cq_readerr(rxcq, &err, 0);
+		if (ret < 0) {
+			FT_PRINTERR("fi_cq_readerr", ret);
+			return (int) ret;
+		}
+		if (err.err == FI_ENOMSG && err.op_context == &pb_peek_ctx)
+			return -FI_ENOMSG;
+		FT_CQ_ERR(rxcq, err, NULL, 0);
+		return -err.err;
+	}
+	return 0;
+}
+
+static int pb_trecvmsg(uint64_t tag, uint64_t ignore, void *ctx,
+		       uint64_t flags)
+{
+	struct fi_msg_tagged msg;
+	struct iovec iov;
+	void *desc = fi_mr_desc(mr);
+	ssize_t ret;
+
+	iov.iov_base = pb_rx_data();
+	iov.iov_len = pb_size;
+
+	memset(&msg, 0, sizeof msg);
+	msg.addr = remote_fi_addr;
+	msg.tag = tag;
+	msg.ignore = ignore;
+	msg.context = ctx;
+	if (!(flags & FI_PEEK)) {
+		msg.msg_iov = &iov;
+		msg.desc = &desc;
+		msg.iov_count = 1;
+	}
+
+	do {
+		ret = fi_trecvmsg(ep, &msg, flags);
+	} while (ret == -FI_EAGAIN);
+	if (ret)
+		FT_PRINTERR("fi_trecvmsg", ret);
+	return (int) ret;
+}
+
+/* Returns 0 if a matching message is queued, -FI_ENOMSG if not */
+static int pb_peek(uint64_t tag, uint64_t ignore, uint64_t flags)
+{
+	int ret;
+
+	ret = pb_trecvmsg(tag, ignore, &pb_peek_ctx, FI_PEEK | flags);
+	if (ret)
+		return ret;
+	return pb_wait_rx(1);
+}
+
+/* MPI_Improbe + MPI_Mrecv: claim a matching message, then receive it */
+static int pb_claim_recv(uint64_t tag, uint64_t ignore)
+{
+	int ret;
+
+	ret = pb_peek(tag, ignore, FI_CLAIM);
+	if (ret)
+		return ret;
+
+	ret = pb_trecvmsg(tag, ignore, &pb_peek_ctx, FI_CLAIM);
+	if (ret)
+		return ret;
+	return pb_wait_rx(1);
+}
+
+static int pb_expect(int ret, int hit)
+{
+	if (ret == (hit ? 0 : -FI_ENOMSG))
+		return 0;
+	if (!ret || ret == -FI_ENOMSG) {
+		FT_ERR("FI_PEEK %s", ret ? "missed a queued message" :
+			"matched a tag that was never sent");
+		return -FI_EOTHER;
+	}
+	return ret;
+}
+
+static int pb_send(int i, uint64_t tag)
+{
+	ssize_t ret;
+
+	while ((ret = fi_tsend(ep, pb_tx_data(), pb_size, fi_mr_desc(mr),
+			       remote_fi_addr, tag, &pb_tx_ctx[i])) ==
+	       -FI_EAGAIN) {
+		ret = pb_reap_tx();
+		if (ret)
+			return (int) ret;
+	}
+	if (ret) {
+		FT_PRINTERR("fi_tsend", ret);
+		return (int) ret;
+	}
+	tx_pending++;
+	return 0;
+}
+
+static int pb_drain_tx(void)
+{
+	int ret;
+
+	while (tx_pending) {
+		ret = pb_reap_tx();
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+struct pb_cost {
+	int64_t hit;
+	int64_t miss;
+	int64_t claim;
+};
+
+static int pb_round(int depth, struct pb_cost *cost)
+{
+	int64_t t0, t1, t2;
+	ssize_t ret;
+	int i;
+
+	if (!opts.dst_addr) {
+		ret = pb_trecvmsg(PB_MARK, 0, &pb_mark_ctx, 0);
+		if (ret)
+			return (int) ret;
+	}
+
+	ret = ft_sync();
+	if (ret)
+		return (int) ret;
+
+	if (opts.dst_addr) {
+		for (i = 0; i < depth; i++) {
+			ret = pb_send(i, PB_TAG | i);
+			if (ret)
+				return (int) ret;
+		}
+		while ((ret = fi_tinject(ep, pb_tx_data(), 0, remote_fi_addr,
+					 PB_MARK)) == -FI_EAGAIN) {
+			ret = pb_reap_tx();
+			if (ret)
+				return (int) ret;
+		}
+		if (ret) {
+			FT_PRINTERR("fi_tinject", ret);
+			return (int) ret;
+		}
+		/* unexpected rendezvous sends complete once claimed */
+		return pb_drain_tx();
+	}
+
+	ret = pb_wait_rx(1);
+	if (ret)
+		return (int) ret;
+
+	t0 = ft_gettime_ns();
+	for (i = 0; i < depth; i++) {
+		ret = pb_expect(pb_peek(PB_TAG | i, 0, 0), 1);
+		if (ret)
+			return (int) ret;
+	}
+	t1 = ft_gettime_ns();
+	for (i = 0; i < depth; i++) {
+		ret = pb_expect(pb_peek(PB_MISS, 0, 0), 0);
+		if (ret)
+			return (int) ret;
+	}
+	t2 = ft_gettime_ns();
+	for (i = 0; i < depth; i++) {
+		ret = pb_expect(pb_claim_recv(PB_TAG | i, 0), 1);
+		if (ret)
+			return (int) ret;
+	}
+
+	cost->hit += t1 - t0;
+	cost->miss += t2 - t1;
+	cost->claim += ft_gettime_ns() - t2;
+	return 0;
+}
+
+static int pb_queue_cost(int depth)
+{
+	struct pb_cost cost = { 0 }, warm = { 0 };
+	int rounds, i, ret;
+	double msgs;
+
+	rounds = MAX(opts.iterations / depth, 1);
+	for (i = 0; i < opts.warmup_iterations; i++) {
+		ret = pb_round(depth, &warm);
+		if (ret)
+			return ret;
+	}
+	for (i = 0; i < rounds; i++) {
+		ret = pb_round(depth, &cost);
+		if (ret)
+			return ret;
+	}
+
+	if (opts.dst_addr)
+		return 0;
+
+	msgs = (double) rounds * depth;
+	if (opts.machr)
+		printf("- { test: queue, xfer_size: %zu, depth: %d, "
+			"peek_hit_ns: %f, peek_miss_ns: %f, "
+			"claim_recv_ns: %f }\n", pb_size, depth,
+			cost.hit / msgs, cost.miss / msgs, cost.claim / msgs);
+	else
+		printf("%-8zu%8d%14.1f%14.1f%14.1f\n", pb_size, depth,
+			cost.hit / msgs, cost.miss / msgs, cost.claim / msgs);
+	return 0;
+}
+
+/*
+ * Windows of messages consumed by pre-posted receives (probe = 0) or by a
+ * wildcard peek/claim loop (probe = 1).  The server times from releasing
+ * the first window until it has consumed the last one.
+ */
+static int pb_rate(int probe, double *rate)
+{
+	int windows = MAX(opts.iterations / opts.window_size, 1);
+	int64_t start;
+	int i, j, ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	start = ft_gettime_ns();
+	for (i = 0; i < windows; i++) {
+		if (opts.dst_addr) {
+			ret = ft_rx(ep, 0);
+			if (ret)
+				return ret;
+			for (j = 0; j < opts.window_size; j++) {
+				ret = pb_send(j, PB_TAG | j);
+				if (ret)
+					return ret;
+			}
+			ret = pb_drain_tx();
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		for (j = 0; !probe && j < opts.window_size; j++) {
+			ret = pb_trecvmsg(PB_TAG | j, 0, &pb_rx_ctx[j], 0);
+			if (ret)
+				return ret;
+		}
+
+		ret = ft_tx(ep, remote_fi_addr, 0, &tx_ctx);
+		if (ret)
+			return ret;
+
+		if (!probe) {
+			ret = pb_wait_rx(opts.window_size);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		for (j = 0; j < opts.window_size; j++) {
+			do {
+				ret = pb_claim_recv(PB_TAG, PB_ANY);
+			} while (ret == -FI_ENOMSG);
+			if (ret)
+				return ret;
+		}
+	}
+
+	*rate = (double) windows * opts.window_size * 1000.0 /
+		(ft_gettime_ns() - start);
+	return 0;
+}
+
+static int run_size(size_t size)
+{
+	double posted = 0, probed = 0;
+	int depth, ret;
+
+	pb_size = size;
+	for (depth = 1; depth <= max_depth &&
+	     depth <= (int) fi->tx_attr->size; depth *= 4) {
+		ret = pb_queue_cost(depth);
+		if (ret)
+			return ret;
+	}
+
+	ret = pb_rate(0, &posted);
+	if (ret)
+		return ret;
+	ret = pb_rate(1, &probed);
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr)
+		return 0;
+
+	if (opts.machr)
+		printf("- { test: rate, xfer_size: %zu, posted_Mmsg/sec: %f, "
+			"probe_Mmsg/sec: %f }\n", size, posted, probed);
+	else
+		printf("%-8zu%8s  posted %.3f Mmsg/sec, probe-driven %.3f "
+			"Mmsg/sec (%.0f%%)\n", size, "rate", posted, probed,
+			100.0 * probed / posted);
+	return 0;
+}
+
+static int run(int sweep, size_t max_size)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Message");
+	if (ret)
+		return ret;
+
+	pb_tx_ctx = calloc(MAX(max_depth, opts.window_size),
+			   sizeof *pb_tx_ctx);
+	pb_rx_ctx = calloc(opts.window_size, sizeof *pb_rx_ctx);
+	if (!pb_tx_ctx || !pb_rx_ctx)
+		return -FI_ENOMEM;
+
+	if (!opts.dst_addr && !opts.machr)
+		printf("%-8s%8s%14s%14s%14s\n", "bytes", "depth",
+			"peek hit ns", "peek miss ns", "claim+recv ns");
+
+	if (!sweep) {
+		ret = run_size(max_size);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; sweep && i < TEST_CNT; i++) {
+		if (!ft_use_size(i, opts.sizes_enabled) ||
+		    test_size[i].size > PB_MAX_MSG)
+			continue;
+		ret = run_size(test_size[i].size);
+		if (ret)
+			return ret;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret, sweep;
+	size_t max_size;
+
+	opts = INIT_OPTS;
+	opts.warmup_iterations = 2;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hQ:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'Q':
+			max_depth = atoi(optarg);
+			if (max_depth < 1) {
+				fprintf(stderr, "Invalid depth: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "FI_PEEK/FI_CLAIM probe cost and "
+					"probe-driven message rate.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-Q <depth>", "max unexpected queue "
+					"depth, swept in powers of four "
+					"(default 256)");
+			fprintf(stderr, "Note: sizes above 64k are skipped unless "
+					"set with -S.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	sweep = !(opts.options & FT_OPT_SIZE);
+	max_size = sweep ? PB_MAX_MSG : opts.transfer_size;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + max_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_TAGGED;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	hints->rx_attr->total_buffered_recv = max_depth * max_size;
+	cq_attr.format = FI_CQ_FORMAT_TAGGED;
+
+	ret = run(sweep, max_size);
+
+	free(pb_tx_ctx);
+	free(pb_rx_ctx);
+	ft_free_res();
+	return -ret;
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Multi-stage write pipelines between two peers, fired either by triggered
+ * operations or by the host.
+ *
+ * A pipeline of depth D has D levels and alternates between the peers,
+ * starting and ending at the client.  Each level is F writes (F = 1 is a
+ * chain, F > 1 a tree).  A peer fires its next level once its remote-write
+ * counter shows that all F writes of the previous level have landed.
+ *
+ *   triggered - every level is pre-posted on a FI_TRIGGER alias endpoint
+ *               with a FI_TRIGGER_THRESHOLD on the remote-write counter;
+ *               only the first level is issued by the host
+ *   host      - the host polls the counter and issues each level itself
+ *
+ * The client times each pipeline, from issuing level 0 until the last
+ * level lands.  Per-stage latency is total time divided by depth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_trigger.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define TC_MAX_LIST	16
+#define TC_BATCH	16
+
+enum tc_mode {
+	TC_TRIGGERED,
+	TC_HOST,
+	TC_MODE_MAX,
+};
+
+static const char *tc_mode_str[] = {
+	[TC_TRIGGERED] = "triggered",
+	[TC_HOST] = "host",
+};
+
+static int depths[TC_MAX_LIST] = { 2, 4, 8, 16, 32, 64 };
+static int depth_cnt = 6;
+static int fanouts[TC_MAX_LIST] = { 1, 4 };
+static int fanout_cnt = 2;
+static int mode_mask = (1 << TC_MODE_MAX) - 1;
+
+static struct fi_rma_iov remote;
+static struct fi_triggered_context *trig_ctx;
+static struct fi_context *host_ctx;
+static size_t max_ops;
+static int tc_size = 8;
+static struct ft_hist tc_lat[TC_MODE_MAX];
+
+/* Write f of a level lands in its own slot past the control area */
+static inline void *tc_src(int f)
+{
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG +
+		(size_t) f * tc_size;
+}
+
+static inline uint64_t tc_dst(int f)
+{
+	return remote.addr + FT_MAX_CTRL_MSG + (size_t) f * tc_size;
+}
+
+/* Counter value at which this peer fires its level */
+static inline uint64_t tc_threshold(uint64_t base, int level, int fanout)
+{
+	return base + (uint64_t) fanout * ((level + 1) / 2);
+}
+
+static inline int tc_local_level(int level)
+{
+	return (level % 2) == (opts.dst_addr ? 0 : 1);
+}
+
+static int tc_write(struct fid_ep *wep, int f, void *ctx)
+{
+	int ret;
+
+	do {
+		ret = fi_write(wep, tc_src(f), tc_size,
+			       fi_mr_desc(mr), remote_fi_addr, tc_dst(f),
+			       remote.key, ctx);
+	} while (ret == -FI_EAGAIN);
+	if (ret)
+		FT_PRINTERR("fi_write", ret);
+	return ret;
+}
+
+static int tc_post_triggered(uint64_t base, int depth, int fanout)
+{
+	struct fi_triggered_context *ctx = trig_ctx;
+	int level, f, ret;
+
+	for (level = 1; level < depth; level++) {
+		if (!tc_local_level(level))
+			continue;
+		for (f = 0; f < fanout; f++, ctx++) {
+			ctx->event_type = FI_TRIGGER_THRESHOLD;
+			ctx->trigger.threshold.cntr = rxcntr;
+			ctx->trigger.threshold.threshold =
+				tc_threshold(base, level, fanout);
+			ret = tc_write(alias_ep, f, ctx);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int tc_wait_cntr(uint64_t value)
+{
+	while (fi_cntr_read(rxcntr) < value) {
+		if (fi_cntr_readerr(rxcntr)) {
+			FT_ERR("remote write counter reported an error");
+			return -FI_EIO;
+		}
+	}
+	return 0;
+}
+
+static int tc_drain_tx(size_t count)
+{
+	struct fi_cq_entry comp[TC_BATCH];
+	ssize_t ret;
+
+	while (count) {
+		ret = fi_cq_read(txcq, comp, MIN(count, TC_BATCH));
+		if (ret == -FI_EAGAIN)
+			continue;
+		if (ret == -FI_EAVAIL)
+			return ft_cq_readerr(txcq);
+		if (ret < 0) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return (int) ret;
+		}
+		count -= ret;
+	}
+	return 0;
+}
+
+static int tc_pipeline(enum tc_mode mode, int depth, int fanout,
+		       int64_t *elapsed)
+{
+	struct fi_context *ctx = host_ctx;
+	uint64_t base;
+	size_t ops = 0;
+	int64_t start = 0;
+	int level, f, ret;
+
+	/* The previous pipeline has fully landed on both sides */
+	base = fi_cntr_read(rxcntr);
+
+	if (mode == TC_TRIGGERED) {
+		ret = tc_post_triggered(base, depth, fanout);
+		if (ret)
+			return ret;
+	}
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	if (opts.dst_addr)
+		start = ft_gettime_ns();
+
+	for (level = 0; level < depth; level++) {
+		if (!tc_local_level(level))
+			continue;
+		ops += fanout;
+		if (level && mode == TC_TRIGGERED)
+			continue;
+
+		ret = tc_wait_cntr(tc_threshold(base, level, fanout));
+		if (ret)
+			return ret;
+		for (f = 0; f < fanout; f++, ctx++) {
+			ret = tc_write(ep, f, ctx);
+			if (ret)
+				return ret;
+		}
+	}
+
+	/* The client receives the last level */
+	ret = tc_wait_cntr(tc_threshold(base, depth, fanout));
+	if (ret)
+		return ret;
+	if (opts.dst_addr)
+		*elapsed = ft_gettime_ns() - start;
+
+	return tc_drain_tx(ops);
+}
+
+static void tc_show(int depth, int fanout)
+{
+	static int header = 1;
+	struct ft_hist *trig = &tc_lat[TC_TRIGGERED];
+	struct ft_hist *host = &tc_lat[TC_HOST];
+	double avg[TC_MODE_MAX] = { 0 };
+	enum tc_mode mode;
+
+	for (mode = 0; mode < TC_MODE_MAX; mode++) {
+		if (tc_lat[mode].count)
+			avg[mode] = (double) tc_lat[mode].sum /
+				    tc_lat[mode].count / 1000.0;
+	}
+
+	if (opts.machr) {
+		printf("- { depth: %d, fanout: %d, xfer_size: %d",
+			depth, fanout, tc_size);
+		for (mode = 0; mode < TC_MODE_MAX; mode++) {
+			if (!tc_lat[mode].count)
+				continue;
+			printf(", %s_total: %f, %s_p99: %f, %s_stage: %f",
+				tc_mode_str[mode], avg[mode], tc_mode_str[mode],
+				ft_hist_percentile(&tc_lat[mode], 99.0) / 1000.0,
+				tc_mode_str[mode], avg[mode] / depth);
+		}
+		printf(" }\n");
+		return;
+	}
+
+	if (header) {
+		printf("%-7s%-8s%12s%12s%12s%12s%12s%12s\n", "depth",
+			"fanout", "trig total", "trig p99", "trig stage",
+			"host total", "host p99", "host stage");
+		header = 0;
+	}
+	printf("%-7d%-8d", depth, fanout);
+	if (trig->count)
+		printf("%12.2f%12.2f%12.2f", avg[TC_TRIGGERED],
+			ft_hist_percentile(trig, 99.0) / 1000.0,
+			avg[TC_TRIGGERED] / depth);
+	else
+		printf("%12s%12s%12s", "-", "-", "-");
+	if (host->count)
+		printf("%12.2f%12.2f%12.2f", avg[TC_HOST],
+			ft_hist_percentile(host, 99.0) / 1000.0,
+			avg[TC_HOST] / depth);
+	else
+		printf("%12s%12s%12s", "-", "-", "-");
+	printf("\n");
+}
+
+static int run_pattern(int depth, int fanout)
+{
+	enum tc_mode mode;
+	int64_t elapsed = 0;
+	int i, ret;
+
+	for (mode = 0; mode < TC_MODE_MAX; mode++) {
+		ft_hist_reset(&tc_lat[mode]);
+		if (!(mode_mask & (1 << mode)))
+			continue;
+
+		for (i = 0; i < opts.warmup_iterations + opts.iterations; i++) {
+			ret = tc_pipeline(mode, depth, fanout, &elapsed);
+			if (ret)
+				return ret;
+			if (i >= opts.warmup_iterations)
+				ft_hist_add(&tc_lat[mode], elapsed);
+		}
+	}
+
+	if (opts.dst_addr)
+		tc_show(depth, fanout);
+	return 0;
+}
+
+static int run(void)
+{
+	size_t ops;
+	int d, f, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Fanout");
+	if (ret)
+		return ret;
+
+	ret = ft_init_alias_ep(FI_TRANSMIT | FI_TRIGGER);
+	if (ret)
+		return ret;
+
+	ret = ft_exchange_keys(&remote);
+	if (ret)
+		return ret;
+
+	trig_ctx = calloc(max_ops, sizeof *trig_ctx);
+	host_ctx = calloc(max_ops, sizeof *host_ctx);
+	if (!trig_ctx || !host_ctx)
+		return -FI_ENOMEM;
+
+	for (f = 0; f < fanout_cnt; f++) {
+		for (d = 0; d < depth_cnt; d++) {
+			ops = (size_t) fanouts[f] * depths[d] / 2;
+			if (ops > fi->tx_attr->size) {
+				if (opts.dst_addr)
+					printf("depth %d fanout %d: %zu writes "
+						"exceed tx size %zu, skipped\n",
+						depths[d], fanouts[f], ops,
+						fi->tx_attr->size);
+				continue;
+			}
+			ret = run_pattern(depths[d], fanouts[f]);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, i, ret, max_fanout = 1, max_depth = 2;
+
+	opts = INIT_OPTS;
+	opts.transfer_size = tc_size;
+	opts.iterations = 100;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hD:F:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'D':
+			if (ft_parse_int_list(optarg, depths, &depth_cnt,
+					      TC_MAX_LIST, 2, 4096)) {
+				fprintf(stderr, "Invalid depth list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'F':
+			if (ft_parse_int_list(optarg, fanouts, &fanout_cnt,
+					      TC_MAX_LIST, 1, 64)) {
+				fprintf(stderr, "Invalid fanout list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, tc_mode_str,
+					  TC_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Triggered versus host-driven "
+					"write chains and trees.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-D <d1,d2,..>", "pipeline depths, "
+					"even (default 2,4,8,16,32,64)");
+			FT_PRINT_OPTS_USAGE("-F <f1,f2,..>", "writes per level; "
+					"1 is a chain (default 1,4)");
+			FT_PRINT_OPTS_USAGE("-o <mode>", "triggered|host|all "
+					"(default all)");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	/* A pipeline alternates between the peers and returns to the client */
+	for (i = 0; i < depth_cnt; i++) {
+		if (depths[i] % 2) {
+			fprintf(stderr, "Depth must be even: %d\n", depths[i]);
+			return EXIT_FAILURE;
+		}
+		max_depth = MAX(max_depth, depths[i]);
+	}
+	for (i = 0; i < fanout_cnt; i++)
+		max_fanout = MAX(max_fanout, fanouts[i]);
+	max_ops = (size_t) max_fanout * max_depth / 2;
+
+	opts.options |= FT_OPT_SIZE | FT_OPT_RX_CNTR | FT_OPT_TX_CNTR;
+	tc_size = opts.transfer_size;
+	opts.transfer_size = FT_MAX_CTRL_MSG + max_fanout * tc_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_MSG | FI_RMA | FI_RMA_EVENT | FI_TRIGGER |
+		      FI_WRITE | FI_REMOTE_WRITE;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+
+	ret = run();
+
+	free(trig_ctx);
+	free(host_ctx);
+	ft_free_res();
+	return -ret;
+}
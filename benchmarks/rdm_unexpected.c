@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2016 Cray Inc.  All rights reserved.
+ *
+ * This software is available to you under the BSD license
+ * below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Expected versus unexpected receive path.
+ *
+ * The receiver posts each receive according to the mode:
+ *
+ *   expected  before the peer sends (what pingpong() and bandwidth() do)
+ *   sync      after a marker that trails the data on a private tag
+ *   delay     a fixed delay (-D) after the data could have been sent
+ *   peek      after FI_PEEK has seen the message arrive
+ *
+ * For every size, each mode reports ping-pong latency (half the round
+ * trip) and windowed bandwidth (-W messages per window).  Both are shown
+ * beside the expected-path numbers, so the unexpected-path copy (eager)
+ * or the delayed pull (rendezvous) shows up as the difference.  The
+ * injected delay is subtracted from the delay-mode results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_tagged.h>
+
+#include <shared.h>
+#include "benchmark_shared.h"
+
+#define UX_TAG		(1ULL << 40)
+#define UX_MARK		(1ULL << 41)
+#define UX_MAX_MSG	(1 << 20)
+#define UX_BATCH	16
+
+enum ux_mode {
+	UX_EXPECTED,
+	UX_SYNC,
+	UX_DELAY,
+	UX_PEEK,
+	UX_MODE_MAX,
+};
+
+static const char *ux_mode_str[] = {
+	[UX_EXPECTED] = "expected",
+	[UX_SYNC] = "sync",
+	[UX_DELAY] = "delay",
+	[UX_PEEK] = "peek",
+};
+
+enum {
+	UX_PEEK_IDLE,
+	UX_PEEK_WAIT,
+	UX_PEEK_FOUND,
+};
+
+static int mode_mask = (1 << UX_MODE_MAX) - 1;
+static int delay_us = 50;
+static size_t ux_size;
+
+static struct fi_context *ux_tx_ctx, *ux_rx_ctx;
+static struct fi_context ux_peek_ctx, ux_mark_ctx;
+static int tx_pending, rx_done, mark_done, peek_state;
+
+static double lat_exp, bw_exp;
+
+static void ux_spin(int usec)
+{
+	int64_t end = ft_gettime_ns() + usec * 1000LL;
+
+	while (ft_gettime_ns() < end)
+		;
+}
+
+static inline char *ux_rx_data(void)
+{
+	return (char *) rx_buf + ft_rx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static inline char *ux_tx_data(void)
+{
+	return (char *) tx_buf + ft_tx_prefix_size() + FT_MAX_CTRL_MSG;
+}
+
+static int ux_rx_err(void)
+{
+	struct fi_cq_err_entry err;
+	ssize_t ret;
+
+	ret = fi_cq_readerr(rxcq, &err, 0);
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_readerr", ret);
+		return (int) ret;
+	}
+
+	if (err.op_context == &ux_peek_ctx && err.err == FI_ENOMSG) {
+		peek_state = UX_PEEK_IDLE;
+		return 0;
+	}
+	FT_CQ_ERR(rxcq, err, NULL, 0);
+	return -err.err;
+}
+
+/* Reaps send completions and sorts receive completions by context */
+static int ux_progress(void)
+{
+	struct fi_cq_entry comp[UX_BATCH];
+	ssize_t ret;
+	int i;
+
+	ret = fi_cq_read(txcq, comp, UX_BATCH);
+	if (ret > 0) {
+		tx_pending -= ret;
+	} else if (ret == -FI_EAVAIL) {
+		return ft_cq_readerr(txcq);
+	} else if (ret != -FI_EAGAIN) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	ret = fi_cq_read(rxcq, comp, UX_BATCH);
+	if (ret == -FI_EAVAIL)
+		return ux_rx_err();
+	if (ret == -FI_EAGAIN)
+		return 0;
+	if (ret < 0) {
+		FT_PRINTERR("fi_cq_read", ret);
+		return (int) ret;
+	}
+
+	for (i = 0; i < ret; i++) {
+		if (comp[i].op_context == &ux_peek_ctx)
+			peek_state = UX_PEEK_FOUND;
+		else if (comp[i].op_context == &ux_mark_ctx)
+			mark_done++;
+		else if (comp[i].op_context == &rx_ctx)
+			rx_cq_cntr++;	/* next ft_sync() message, for ft_rx() */
+		else
+			rx_done++;
+	}
+	return 0;
+}
+
+#define UX_WAIT(cond)					\
+	do {						\
+		int rc;					\
+		while (!(cond)) {			\
+			rc = ux_progress();		\
+			if (rc)				\
+				return rc;		\
+		}					\
+	} while (0)
+
+#define UX_POST(post_fn, ...)					\
+	do {							\
+		ssize_t rc;					\
+		while ((rc = post_fn(__VA_ARGS__)) == -FI_EAGAIN) {	\
+			rc = ux_progress();			\
+			if (rc)					\
+				return (int) rc;		\
+		}						\
+		if (rc) {					\
+			FT_PRINTERR(#post_fn, rc);		\
+			return (int) rc;			\
+		}						\
+	} while (0)
+
+static int ux_post_recv(int i)
+{
+	UX_POST(fi_trecv, ep, ux_rx_data(), ux_size, fi_mr_desc(mr),
+		remote_fi_addr, UX_TAG, 0, &ux_rx_ctx[i]);
+	return 0;
+}
+
+static int ux_post_mark(void)
+{
+	UX_POST(fi_trecv, ep, ux_rx_data(), 0, fi_mr_desc(mr),
+		remote_fi_addr, UX_MARK, 0, &ux_mark_ctx);
+	return 0;
+}
+
+/* In sync mode, mark sends the trailing marker after the data */
+static int ux_send(int i, int mark)
+{
+	UX_POST(fi_tsend, ep, ux_tx_data(), ux_size, fi_mr_desc(mr),
+		remote_fi_addr, UX_TAG, &ux_tx_ctx[i]);
+	tx_pending++;
+
+	if (mark)
+		UX_POST(fi_tinject, ep, ux_tx_data(), 0, remote_fi_addr,
+			UX_MARK);
+	return 0;
+}
+
+/* Spin on FI_PEEK until a data message is waiting */
+static int ux_peek(void)
+{
+	struct fi_msg_tagged msg;
+
+	memset(&msg, 0, sizeof msg);
+	msg.addr = remote_fi_addr;
+	msg.tag = UX_TAG;
+	msg.context = &ux_peek_ctx;
+
+	do {
+		UX_POST(fi_trecvmsg, ep, &msg, FI_PEEK);
+		peek_state = UX_PEEK_WAIT;
+		UX_WAIT(peek_state != UX_PEEK_WAIT);
+	} while (peek_state != UX_PEEK_FOUND);
+	return 0;
+}
+
+/*
+ * Posts the receive for data message i in the unexpected modes.  marks is
+ * the number of markers the caller has to see first in sync mode.
+ */
+static int ux_late_recv(enum ux_mode mode, int i, int marks)
+{
+	int ret;
+
+	switch (mode) {
+	case UX_SYNC:
+		UX_WAIT(mark_done >= marks);
+		break;
+	case UX_DELAY:
+		ux_spin(delay_us);
+		break;
+	case UX_PEEK:
+		ret = ux_peek();
+		if (ret)
+			return ret;
+		break;
+	default:
+		return 0;
+	}
+	return ux_post_recv(i);
+}
+
+static int ux_latency(enum ux_mode mode, double *usec)
+{
+	int total = opts.warmup_iterations + opts.iterations;
+	int64_t start = 0;
+	int i, ret;
+
+	tx_pending = rx_done = mark_done = 0;
+	if (mode == UX_EXPECTED)
+		ret = ux_post_recv(0);
+	else if (mode == UX_SYNC)
+		ret = ux_post_mark();
+	else
+		ret = 0;
+	if (ret)
+		return ret;
+
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	for (i = 0; i < total; i++) {
+		if (i == opts.warmup_iterations)
+			start = ft_gettime_ns();
+
+		if (opts.dst_addr) {
+			ret = ux_send(0, mode == UX_SYNC);
+			if (ret)
+				return ret;
+		}
+
+		ret = ux_late_recv(mode, 0, i + 1);
+		if (ret)
+			return ret;
+		UX_WAIT(rx_done > i);
+
+		if (i + 1 < total) {
+			if (mode == UX_EXPECTED)
+				ret = ux_post_recv(0);
+			else if (mode == UX_SYNC)
+				ret = ux_post_mark();
+			if (ret)
+				return ret;
+		}
+
+		/* the single send context is reused once it completes */
+		UX_WAIT(!tx_pending);
+		if (!opts.dst_addr) {
+			ret = ux_send(0, mode == UX_SYNC);
+			if (ret)
+				return ret;
+			UX_WAIT(!tx_pending);
+		}
+	}
+
+	*usec = (ft_gettime_ns() - start) / 1000.0 / opts.iterations / 2;
+	if (mode == UX_DELAY)
+		*usec -= delay_us;
+	return 0;
+}
+
+/*
+ * The server prepares each window and releases it with a control message;
+ * the last control message ends the client's timed region.
+ */
+static int ux_bandwidth(enum ux_mode mode, double *mbps)
+{
+	int windows = MAX(opts.iterations / opts.window_size, 1);
+	int64_t start = 0, elapsed;
+	int i, j, ret;
+
+	tx_pending = rx_done = mark_done = 0;
+	ret = ft_sync();
+	if (ret)
+		return ret;
+
+	for (i = 0; i <= windows; i++) {
+		if (opts.dst_addr) {
+			ret = ft_rx(ep, 0);
+			if (ret)
+				return ret;
+			if (!i)
+				start = ft_gettime_ns();
+			if (i == windows)
+				break;
+
+			for (j = 0; j < opts.window_size; j++) {
+				ret = ux_send(j, mode == UX_SYNC &&
+					      j == opts.window_size - 1);
+				if (ret)
+					return ret;
+			}
+			UX_WAIT(!tx_pending);
+			continue;
+		}
+
+		if (i < windows && mode == UX_EXPECTED) {
+			for (j = 0; j < opts.window_size; j++) {
+				ret = ux_post_recv(j);
+				if (ret)
+					return ret;
+			}
+		} else if (i < windows && mode == UX_SYNC) {
+			ret = ux_post_mark();
+			if (ret)
+				return ret;
+		}
+
+		ret = ft_tx(ep, remote_fi_addr, 0, &tx_ctx);
+		if (ret)
+			return ret;
+		if (i == windows)
+			break;
+
+		for (j = 0; mode != UX_EXPECTED && j < opts.window_size; j++) {
+			/* one delay or marker covers the whole window */
+			if (j && mode != UX_PEEK)
+				ret = ux_post_recv(j);
+			else
+				ret = ux_late_recv(mode, j, i + 1);
+			if (ret)
+				return ret;
+		}
+		UX_WAIT(rx_done == (i + 1) * opts.window_size);
+	}
+
+	elapsed = ft_gettime_ns() - start;
+	if (mode == UX_DELAY)
+		elapsed -= (int64_t) windows * delay_us * 1000;
+	*mbps = (double) windows * opts.window_size * ux_size * 1000.0 /
+		elapsed;
+	return 0;
+}
+
+static void ux_show(enum ux_mode mode, double lat, double mbps)
+{
+	static int header = 1;
+	char str[FT_STR_LEN];
+
+	if (opts.machr) {
+		printf("- { mode: %s, xfer_size: %zu, lat_usec: %f, "
+			"lat_extra_usec: %f, MB/sec: %f, bw_vs_expected: %f }\n",
+			ux_mode_str[mode], ux_size, lat, lat - lat_exp, mbps,
+			bw_exp > 0 ? mbps / bw_exp : 0);
+		return;
+	}
+
+	if (header) {
+		printf("%-10s%-8s%11s%11s%12s%10s\n", "mode", "bytes",
+			"lat usec", "extra", "MB/sec", "vs exp");
+		header = 0;
+	}
+	printf("%-10s%-8s%11.2f%11.2f%12.2f%9.0f%%\n", ux_mode_str[mode],
+		size_str(str, ux_size), lat, lat - lat_exp, mbps,
+		bw_exp > 0 ? 100.0 * mbps / bw_exp : 0);
+}
+
+static int run_size(size_t size)
+{
+	enum ux_mode mode;
+	double lat, mbps;
+	int ret;
+
+	ux_size = size;
+	lat_exp = bw_exp = 0;
+	for (mode = 0; mode < UX_MODE_MAX; mode++) {
+		if (!(mode_mask & (1 << mode)))
+			continue;
+
+		ret = ux_latency(mode, &lat);
+		if (ret)
+			return ret;
+		ret = ux_bandwidth(mode, &mbps);
+		if (ret)
+			return ret;
+
+		if (mode == UX_EXPECTED) {
+			lat_exp = lat;
+			bw_exp = mbps;
+		}
+		if (opts.dst_addr)
+			ux_show(mode, lat, mbps);
+	}
+	return 0;
+}
+
+static int run(int sweep, size_t max_size)
+{
+	int i, ret;
+
+	ret = ft_init_fabric();
+	if (ret)
+		return ret;
+
+	ret = ft_check_rx_fit("Message");
+	if (ret)
+		return ret;
+
+	ux_tx_ctx = calloc(opts.window_size, sizeof *ux_tx_ctx);
+	ux_rx_ctx = calloc(opts.window_size, sizeof *ux_rx_ctx);
+	if (!ux_tx_ctx || !ux_rx_ctx)
+		return -FI_ENOMEM;
+
+	if (!sweep) {
+		ret = run_size(max_size);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; sweep && i < TEST_CNT; i++) {
+		if (!ft_use_size(i, opts.sizes_enabled) ||
+		    test_size[i].size > UX_MAX_MSG)
+			continue;
+		ret = run_size(test_size[i].size);
+		if (ret)
+			return ret;
+	}
+
+	return ft_finalize();
+}
+
+int main(int argc, char **argv)
+{
+	int op, ret, sweep;
+	size_t max_size;
+
+	opts = INIT_OPTS;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return EXIT_FAILURE;
+
+	while ((op = getopt(argc, argv, "hD:o:" CS_OPTS INFO_OPTS
+			    BENCHMARK_BASE_OPTS)) != -1) {
+		switch (op) {
+		default:
+			ft_parse_benchmark_opts(op, optarg);
+			ft_parseinfo(op, optarg, hints);
+			ft_parsecsopts(op, optarg, &opts);
+			break;
+		case 'D':
+			delay_us = atoi(optarg);
+			if (delay_us < 0) {
+				fprintf(stderr, "Invalid delay: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, ux_mode_str,
+					  UX_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?':
+		case 'h':
+			ft_csusage(argv[0], "Expected versus unexpected receive "
+					"path latency and bandwidth.");
+			ft_benchmark_base_usage();
+			FT_PRINT_OPTS_USAGE("-o <mode>", "expected|sync|delay|peek|"
+					"all (default all)");
+			FT_PRINT_OPTS_USAGE("-D <usec>", "receive posting delay "
+					"for delay mode (default 50)");
+			fprintf(stderr, "Note: sizes above 1m are skipped unless "
+					"set with -S.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		opts.dst_addr = argv[optind];
+
+	/* the extra columns are relative to the expected path */
+	mode_mask |= 1 << UX_EXPECTED;
+
+	sweep = !(opts.options & FT_OPT_SIZE);
+	max_size = sweep ? UX_MAX_MSG : opts.transfer_size;
+	opts.options |= FT_OPT_SIZE;
+	opts.transfer_size = FT_MAX_CTRL_MSG + max_size;
+
+	hints->ep_attr->type = FI_EP_RDM;
+	hints->caps = FI_TAGGED;
+	hints->mode = FI_CONTEXT | FI_LOCAL_MR;
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+
+	ret = run(sweep, max_size);
+
+	free(ux_tx_ctx);
+	free(ux_rx_ctx);
+	ft_free_res();
+	return -ret;
+}
@@ -62,7 +62,7 @@ struct fid_eq *eq;
 
 struct fid_mr no_mr;
 struct fi_context tx_ctx, rx_ctx;
-struct fi_context *tx_ctx_arr = NULL, *rx_ctx_arr = NULL;
+struct ft_context *tx_ctx_arr = NULL, *rx_ctx_arr = NULL;
 uint64_t remote_cq_data = 0;
 
 uint64_t tx_seq, rx_seq, tx_cq_cntr, rx_cq_cntr;
@@ -100,6 +100,18 @@ struct fi_cntr_attr cntr_attr = {
 };
 
 struct ft_opts opts;
+struct ft_queue_stats queue_stats;
+
+static const char *ft_post_op_str[FT_POST_OP_MAX] = {
+	[FT_POST_OP_TX] = "transmit",
+	[FT_POST_OP_INJECT] = "inject",
+	[FT_POST_OP_RX] = "receive",
+	[FT_POST_OP_WRITE] = "fi_write",
+	[FT_POST_OP_WRITEDATA] = "fi_writedata",
+	[FT_POST_OP_READ] = "fi_read",
+	[FT_POST_OP_INJECT_WRITE] = "fi_inject_write",
+	[FT_POST_OP_INJECT_WRITEDATA] = "fi_inject_writedata",
+};
 
 struct test_size_param test_size[] = {
 	{ 1 <<  1, 0 }, { (1 <<  1) + (1 <<  0), 0 },
@@ -991,6 +1003,22 @@ int size_to_count(int size)
 		return (opts.options & FT_OPT_BW) ? 20000: 10000;
 }
 
+/* Resident set size of the calling process in bytes, or -1 if unknown */
+long long ft_rss(void)
+{
+	long long pages = -1;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%*s %lld", &pages) != 1)
+		pages = -1;
+	fclose(f);
+
+	return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
 void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 {
 	char sstr[FT_STR_LEN];
@@ -1002,9 +1030,96 @@ void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 		opts->iterations = size_to_count(opts->transfer_size);
 }
 
-#define FT_POST(post_fn, comp_fn, seq, op_str, ...)				\
+void ft_reset_queue_stats(void)
+{
+	memset(&queue_stats, 0, sizeof queue_stats);
+	queue_stats.tx_left_min = queue_stats.rx_left_min = -1;
+}
+
+/*
+ * Providers without queue depth tracking return -FI_ENOSYS; those samples
+ * are dropped.
+ */
+void ft_sample_queue_depth(struct fid_ep *ep)
+{
+	ssize_t left;
+
+	left = fi_tx_size_left(ep);
+	if (left >= 0) {
+		if (queue_stats.tx_left_min < 0 || left < queue_stats.tx_left_min)
+			queue_stats.tx_left_min = left;
+		queue_stats.tx_left_sum += left;
+		queue_stats.tx_left_samples++;
+	}
+
+	left = fi_rx_size_left(ep);
+	if (left >= 0) {
+		if (queue_stats.rx_left_min < 0 || left < queue_stats.rx_left_min)
+			queue_stats.rx_left_min = left;
+		queue_stats.rx_left_sum += left;
+		queue_stats.rx_left_samples++;
+	}
+}
+
+static void ft_show_cq_polls(const char *pfx, const char *name,
+			     struct ft_cq_poll_stats *polls)
+{
+	uint64_t total = polls->hit + polls->empty;
+
+	printf("%s%-22s%12" PRIu64 "%12" PRIu64 "%11.2f%%\n", pfx, name,
+		polls->hit, polls->empty,
+		total ? 100.0 * polls->empty / total : 0.0);
+}
+
+static void ft_show_size_left(const char *pfx, const char *name,
+			      ssize_t min, uint64_t sum, uint64_t samples)
+{
+	if (!samples) {
+		printf("%s%-22s%12s\n", pfx, name, "n/a");
+		return;
+	}
+
+	printf("%s%-22s%12zd%12.1f%12" PRIu64 "\n", pfx, name, min,
+		(double) sum / samples, samples);
+}
+
+/*
+ * Printed after show_perf()/show_perf_mr().  In machine readable mode every
+ * line is emitted as a YAML comment so the output still parses.
+ */
+void ft_show_queue_stats(void)
+{
+	const char *pfx = opts.machr ? "# " : "  ";
+	int i;
+
+	printf("%squeue stats:\n", opts.machr ? "# " : "");
+	printf("%s%-22s%12s%12s\n", pfx, "post op", "eagain",
+		"drained");
+	for (i = 0; i < FT_POST_OP_MAX; i++) {
+		if (!queue_stats.eagain[i])
+			continue;
+		printf("%s%-22s%12" PRIu64 "%12" PRIu64 "\n", pfx,
+			ft_post_op_str[i], queue_stats.eagain[i],
+			queue_stats.retry_comps[i]);
+	}
+
+	printf("%s%-22s%12s%12s%12s\n", pfx, "cq polls", "non-empty",
+		"empty", "% empty");
+	ft_show_cq_polls(pfx, "tx cq", &queue_stats.txcq);
+	ft_show_cq_polls(pfx, "rx cq", &queue_stats.rxcq);
+
+	printf("%s%-22s%12s%12s%12s\n", pfx, "size_left", "min", "avg",
+		"samples");
+	ft_show_size_left(pfx, "fi_tx_size_left", queue_stats.tx_left_min,
+			  queue_stats.tx_left_sum, queue_stats.tx_left_samples);
+	ft_show_size_left(pfx, "fi_rx_size_left", queue_stats.rx_left_min,
+			  queue_stats.rx_left_sum, queue_stats.rx_left_samples);
+}
+
+#define FT_POST(post_fn, comp_fn, seq, cntr, op, op_str, ...)		\
 	do {									\
 		int timeout_save;						\
+		uint64_t cntr_save;						\
 		int ret, rc;							\
 										\
 		while (1) {							\
@@ -1016,10 +1131,13 @@ void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 				FT_PRINTERR(op_str, ret);			\
 				return ret;					\
 			}							\
+			queue_stats.eagain[op]++;				\
 										\
 			timeout_save = timeout;					\
 			timeout = 0;						\
+			cntr_save = cntr;					\
 			rc = comp_fn(seq);					\
+			queue_stats.retry_comps[op] += cntr - cntr_save;	\
 			if (rc && rc != -FI_EAGAIN) {				\
 				FT_ERR("Failed to get " op_str " completion");	\
 				return rc;					\
@@ -1032,12 +1150,14 @@ void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len)
 ssize_t ft_post_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_context* ctx)
 {
 	if (hints->caps & FI_TAGGED) {
-		FT_POST(fi_tsend, ft_get_tx_comp, tx_seq, "transmit", ep,
-				tx_buf, size + ft_tx_prefix_size(), fi_mr_desc(mr),
+		FT_POST(fi_tsend, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_TX, "transmit", ep, tx_buf,
+				size + ft_tx_prefix_size(), fi_mr_desc(mr),
 				fi_addr, tx_seq, ctx);
 	} else {
-		FT_POST(fi_send, ft_get_tx_comp, tx_seq, "transmit", ep,
-				tx_buf,	size + ft_tx_prefix_size(), fi_mr_desc(mr),
+		FT_POST(fi_send, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_TX, "transmit", ep, tx_buf,
+				size + ft_tx_prefix_size(), fi_mr_desc(mr),
 				fi_addr, ctx);
 	}
 	return 0;
@@ -1061,11 +1181,13 @@ ssize_t ft_tx(struct fid_ep *ep, fi_addr_t fi_addr, size_t size, struct fi_conte
 ssize_t ft_post_inject(struct fid_ep *ep, size_t size)
 {
 	if (hints->caps & FI_TAGGED) {
-		FT_POST(fi_tinject, ft_get_tx_comp, tx_seq, "inject",
+		FT_POST(fi_tinject, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_INJECT, "inject",
 				ep, tx_buf, size + ft_tx_prefix_size(),
 				remote_fi_addr, tx_seq);
 	} else {
-		FT_POST(fi_inject, ft_get_tx_comp, tx_seq, "inject",
+		FT_POST(fi_inject, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_INJECT, "inject",
 				ep, tx_buf, size + ft_tx_prefix_size(),
 				remote_fi_addr);
 	}
@@ -1093,20 +1215,24 @@ ssize_t ft_post_rma(enum ft_rma_opcodes op, struct fid_ep *ep, size_t size,
 {
 	switch (op) {
 	case FT_RMA_WRITE:
-		FT_POST(fi_write, ft_get_tx_comp, tx_seq, "fi_write", ep, tx_buf,
-				opts.transfer_size, fi_mr_desc(mr), remote_fi_addr,
-				remote->addr, remote->key, context);
+		FT_POST(fi_write, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_WRITE, "fi_write", ep, tx_buf,
+				opts.transfer_size, fi_mr_desc(mr),
+				remote_fi_addr, remote->addr,
+				remote->key, context);
 		break;
 	case FT_RMA_WRITEDATA:
-		FT_POST(fi_writedata, ft_get_tx_comp, tx_seq, "fi_writedata", ep,
-				tx_buf, opts.transfer_size, fi_mr_desc(mr),
-				remote_cq_data,	remote_fi_addr,	remote->addr,
-				remote->key, context);
+		FT_POST(fi_writedata, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_WRITEDATA, "fi_writedata", ep, tx_buf,
+				opts.transfer_size, fi_mr_desc(mr), remote_cq_data,
+				remote_fi_addr,	remote->addr, remote->key, context);
 		break;
 	case FT_RMA_READ:
-		FT_POST(fi_read, ft_get_tx_comp, tx_seq, "fi_read", ep, rx_buf,
-				opts.transfer_size, fi_mr_desc(mr), remote_fi_addr,
-				remote->addr, remote->key, context);
+		FT_POST(fi_read, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_READ, "fi_read", ep, rx_buf,
+				opts.transfer_size, fi_mr_desc(mr),
+				remote_fi_addr, remote->addr,
+				remote->key, context);
 		break;
 	default:
 		FT_ERR("Unknown RMA op type\n");
@@ -1143,15 +1269,16 @@ ssize_t ft_post_rma_inject(enum ft_rma_opcodes op, struct fid_ep *ep, size_t siz
 {
 	switch (op) {
 	case FT_RMA_WRITE:
-		FT_POST(fi_inject_write, ft_get_tx_comp, tx_seq, "fi_inject_write",
-				ep, tx_buf, opts.transfer_size, remote_fi_addr,
+		FT_POST(fi_inject_write, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_INJECT_WRITE, "fi_inject_write", ep,
+				tx_buf, opts.transfer_size, remote_fi_addr,
 				remote->addr, remote->key);
 		break;
 	case FT_RMA_WRITEDATA:
-		FT_POST(fi_inject_writedata, ft_get_tx_comp, tx_seq,
-				"fi_inject_writedata", ep, tx_buf, opts.transfer_size,
-				remote_cq_data, remote_fi_addr, remote->addr,
-				remote->key);
+		FT_POST(fi_inject_writedata, ft_get_tx_comp, tx_seq, tx_cq_cntr,
+				FT_POST_OP_INJECT_WRITEDATA, "fi_inject_writedata",
+				ep, tx_buf, opts.transfer_size, remote_cq_data,
+				remote_fi_addr, remote->addr, remote->key);
 		break;
 	default:
 		FT_ERR("Unknown RMA inject op type\n");
@@ -1165,11 +1292,13 @@ ssize_t ft_post_rma_inject(enum ft_rma_opcodes op, struct fid_ep *ep, size_t siz
 ssize_t ft_post_rx(struct fid_ep *ep, size_t size, struct fi_context* ctx)
 {
 	if (hints->caps & FI_TAGGED) {
-		FT_POST(fi_trecv, ft_get_rx_comp, rx_seq, "receive", ep, rx_buf,
+		FT_POST(fi_trecv, ft_get_rx_comp, rx_seq, rx_cq_cntr,
+				FT_POST_OP_RX, "receive", ep, rx_buf,
 				MAX(size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size(),
 				fi_mr_desc(mr), 0, rx_seq, 0, ctx);
 	} else {
-		FT_POST(fi_recv, ft_get_rx_comp, rx_seq, "receive", ep, rx_buf,
+		FT_POST(fi_recv, ft_get_rx_comp, rx_seq, rx_cq_cntr,
+				FT_POST_OP_RX, "receive", ep, rx_buf,
 				MAX(size, FT_MAX_CTRL_MSG) + ft_rx_prefix_size(),
 				fi_mr_desc(mr),	0, ctx);
 	}
@@ -1206,9 +1335,12 @@ static int ft_spin_for_comp(struct fid_cq *cq, uint64_t *cur,
 			    uint64_t total, int timeout)
 {
 	struct fi_cq_err_entry comp;
+	struct ft_cq_poll_stats *polls;
 	struct timespec a, b;
 	int ret;
 
+	polls = cq == txcq ? &queue_stats.txcq : &queue_stats.rxcq;
+
 	if (timeout >= 0)
 		clock_gettime(CLOCK_MONOTONIC, &a);
 
@@ -1218,10 +1350,15 @@ static int ft_spin_for_comp(struct fid_cq *cq, uint64_t *cur,
 			if (timeout >= 0)
 				clock_gettime(CLOCK_MONOTONIC, &a);
 
+			polls->hit++;
 			(*cur)++;
 		} else if (ret < 0 && ret != -FI_EAGAIN) {
 			return ret;
-		} else if (timeout >= 0) {
+		} else {
+			polls->empty++;
+			if (timeout < 0)
+				continue;
+
 			clock_gettime(CLOCK_MONOTONIC, &b);
 			if ((b.tv_sec - a.tv_sec) > timeout) {
 				fprintf(stderr, "%ds timeout expired\n", timeout);
@@ -1240,14 +1377,21 @@ static int ft_wait_for_comp(struct fid_cq *cq, uint64_t *cur,
 			    uint64_t total, int timeout)
 {
 	struct fi_cq_err_entry comp;
+	struct ft_cq_poll_stats *polls;
 	int ret;
 
+	polls = cq == txcq ? &queue_stats.txcq : &queue_stats.rxcq;
+
 	while (total - *cur > 0) {
 		ret = fi_cq_sread(cq, &comp, 1, NULL, timeout);
-		if (ret > 0)
+		if (ret > 0) {
+			polls->hit++;
 			(*cur)++;
-		else if (ret < 0 && ret != -FI_EAGAIN)
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
 			return ret;
+		} else {
+			polls->empty++;
+		}
 	}
 
 	return 0;
@@ -1260,10 +1404,12 @@ static int ft_fdwait_for_comp(struct fid_cq *cq, uint64_t *cur,
 			    uint64_t total, int timeout)
 {
 	struct fi_cq_err_entry comp;
+	struct ft_cq_poll_stats *polls;
 	struct fid *fids[1];
 	int fd, ret;
 
 	fd = cq == txcq ? tx_fd : rx_fd;
+	polls = cq == txcq ? &queue_stats.txcq : &queue_stats.rxcq;
 	fids[0] = &cq->fid;
 
 	while (total - *cur > 0) {
@@ -1276,9 +1422,12 @@ static int ft_fdwait_for_comp(struct fid_cq *cq, uint64_t *cur,
 
 		ret = fi_cq_read(cq, &comp, 1);
 		if (ret > 0) {
+			polls->hit++;
 			(*cur)++;
 		} else if (ret < 0 && ret != -FI_EAGAIN) {
 			return ret;
+		} else {
+			polls->empty++;
 		}
 	}
 
@@ -103,6 +103,8 @@ enum {
 	FT_OPT_VERIFY_DATA	= 1 << 7,
 	FT_OPT_ALIGN		= 1 << 8,
 	FT_OPT_BW		= 1 << 9,
+	FT_OPT_QUEUE_STATS	= 1 << 10,
+	FT_OPT_OP_LATENCY	= 1 << 11,
 };
 
 /* for RMA tests --- we want to be able to select fi_writedata, but there is no
@@ -113,6 +115,45 @@ enum ft_rma_opcodes {
 	FT_RMA_WRITEDATA,
 };
 
+/* post routines tracked by the FT_POST retry counters */
+enum ft_post_op {
+	FT_POST_OP_TX,
+	FT_POST_OP_INJECT,
+	FT_POST_OP_RX,
+	FT_POST_OP_WRITE,
+	FT_POST_OP_WRITEDATA,
+	FT_POST_OP_READ,
+	FT_POST_OP_INJECT_WRITE,
+	FT_POST_OP_INJECT_WRITEDATA,
+	FT_POST_OP_MAX,
+};
+
+struct ft_cq_poll_stats {
+	uint64_t empty;
+	uint64_t hit;
+};
+
+/*
+ * Backpressure counters, reset by ft_start().  eagain counts -FI_EAGAIN
+ * returns from a post call, retry_comps the completions reaped while
+ * waiting to repost.  The size_left fields hold fi_tx/rx_size_left()
+ * samples taken by ft_sample_queue_depth().
+ */
+struct ft_queue_stats {
+	uint64_t eagain[FT_POST_OP_MAX];
+	uint64_t retry_comps[FT_POST_OP_MAX];
+	struct ft_cq_poll_stats txcq, rxcq;
+	ssize_t tx_left_min, rx_left_min;
+	uint64_t tx_left_sum, rx_left_sum;
+	uint64_t tx_left_samples, rx_left_samples;
+};
+
+/* fi_context plus the time the operation using it was posted */
+struct ft_context {
+	struct fi_context context;
+	struct timespec post;
+};
+
 struct ft_opts {
 	int iterations;
 	int warmup_iterations;
@@ -152,7 +193,7 @@ extern int tx_fd, rx_fd;
 extern int timeout;
 
 extern struct fi_context tx_ctx, rx_ctx;
-extern struct fi_context *tx_ctx_arr, *rx_ctx_arr;
+extern struct ft_context *tx_ctx_arr, *rx_ctx_arr;
 extern uint64_t remote_cq_data;
 
 extern uint64_t tx_seq, rx_seq, tx_cq_cntr, rx_cq_cntr;
@@ -164,6 +205,7 @@ extern struct fi_cntr_attr cntr_attr;
 extern char test_name[50];
 extern struct timespec start, end;
 extern struct ft_opts opts;
+extern struct ft_queue_stats queue_stats;
 
 void ft_parseinfo(int op, char *optarg, struct fi_info *hints);
 void ft_parse_addr_opts(int op, char *optarg, struct ft_opts *opts);
@@ -216,6 +258,7 @@ int ft_read_addr_opts(char **node, char **service, struct fi_info *hints,
 char *size_str(char str[FT_STR_LEN], long long size);
 char *cnt_str(char str[FT_STR_LEN], long long cnt);
 int size_to_count(int size);
+long long ft_rss(void);
 
 
 #define FT_PRINTERR(call, retv) \
@@ -290,8 +333,13 @@ int ft_exchange_keys(struct fi_rma_iov *peer_iov);
 void ft_free_res();
 void init_test(struct ft_opts *opts, char *test_name, size_t test_name_len);
 
+void ft_reset_queue_stats(void);
+void ft_sample_queue_depth(struct fid_ep *ep);
+void ft_show_queue_stats(void);
+
 static inline void ft_start(void)
 {
+	ft_reset_queue_stats();
 	opts.options |= FT_OPT_ACTIVE;
 	clock_gettime(CLOCK_MONOTONIC, &start);
 }
@@ -39,6 +39,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_cm.h>
@@ -58,6 +59,7 @@ struct cma_node {
 	struct fid_mr		*mr;
 	void			*mrdesc;
 	void			*mem;
+	struct timespec		start;
 };
 
 enum CQ_INDEX {
@@ -71,6 +73,16 @@ static int			connects_left;
 static int			disconnects_left;
 static int			connections = 1;
 
+/* Connection storm and churn measurement */
+static int			connect_window;
+static int			next_connect;
+static int			rounds;
+static int			accepting = 1;
+static struct fi_info		**pending;
+static int			pending_cnt;
+static int64_t			lat_min, lat_max, lat_sum;
+static long long		rss_base;
+
 
 static int post_recvs(struct cma_node *node)
 {
@@ -213,6 +225,9 @@ static void destroy_node(struct cma_node *node)
 
 	if (node->mem)
 		free(node->mem);
+	node->mem = NULL;
+	node->mrdesc = NULL;
+	node->connected = 0;
 
 	FT_CLOSE_FID(node->domain);
 }
@@ -286,6 +301,7 @@ static int connreq_handler(struct fi_info *info)
 	}
 
 	node = &nodes[conn_index++];
+	clock_gettime(CLOCK_MONOTONIC, &node->start);
 	ret = init_node(node, info);
 	if (ret)
 		goto err2;
@@ -306,6 +322,31 @@ err1:
 	return ret;
 }
 
+static int start_connect(struct cma_node *node)
+{
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &node->start);
+	ret = fi_connect(node->ep, fi->dest_addr, NULL, 0);
+	if (ret) {
+		FT_PRINTERR("fi_connect", ret);
+		connects_left--;
+	}
+	return ret;
+}
+
+static void record_setup(struct cma_node *node)
+{
+	struct timespec now;
+	int64_t lat;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lat = get_elapsed(&node->start, &now, NANO);
+	lat_min = lat_sum ? MIN(lat_min, lat) : lat;
+	lat_max = MAX(lat_max, lat);
+	lat_sum += lat;
+}
+
 static int cma_handler(uint32_t event, struct fi_eq_cm_entry *entry)
 {
 	struct cma_node *node;
@@ -313,14 +354,22 @@ static int cma_handler(uint32_t event, struct fi_eq_cm_entry *entry)
 
 	switch (event) {
 	case FI_CONNREQ:
+		/* Requests for the next churn round wait for the shutdown */
+		if (!accepting && pending_cnt < connections) {
+			pending[pending_cnt++] = entry->info;
+			break;
+		}
 		ret = connreq_handler(entry->info);
 		fi_freeinfo(entry->info);
 		break;
 	case FI_CONNECTED:
 		node = entry->fid->context;
 		node->connected = 1;
+		record_setup(node);
 		connects_left--;
 		disconnects_left++;
+		if (opts.dst_addr && next_connect < connections)
+			ret = start_connect(&nodes[next_connect++]);
 		break;
 	case FI_SHUTDOWN:
 		node = entry->fid->context;
@@ -379,6 +428,118 @@ static int shutdown_events(void)
 	return ret;
 }
 
+/*
+ * Setup latency runs from fi_connect() on the client, and from the
+ * connection request on the server, to FI_CONNECTED.
+ */
+static void show_connect(const char *phase, struct timespec *start,
+			 struct timespec *end)
+{
+	int64_t usec = MAX(get_elapsed(start, end, MICRO), 1);
+	long long rss = ft_rss();
+
+	printf("cmatose: %s: %d connections in %.3f ms, %.1f conn/sec\n",
+		phase, connections, usec / 1000.0, connections * 1e6 / usec);
+	printf("cmatose: %s: setup latency min %.1f avg %.1f max %.1f usec, "
+		"RSS %.1f KB/conn\n", phase, lat_min / 1000.0,
+		lat_sum / 1000.0 / connections, lat_max / 1000.0,
+		(rss - rss_base) / 1024.0 / connections);
+}
+
+static int connect_all(const char *phase)
+{
+	struct timespec start, end;
+	int i, ret = 0;
+
+	lat_min = lat_max = lat_sum = 0;
+	connects_left = connections;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (opts.dst_addr) {
+		next_connect = MIN(connect_window, connections);
+		for (i = 0; i < next_connect && !ret; i++)
+			ret = start_connect(&nodes[i]);
+	} else {
+		accepting = 1;
+		for (i = 0; i < pending_cnt; i++) {
+			if (!ret)
+				ret = connreq_handler(pending[i]);
+			fi_freeinfo(pending[i]);
+		}
+		pending_cnt = 0;
+	}
+
+	if (!ret)
+		ret = connect_events();
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	show_connect(phase, &start, &end);
+	return 0;
+}
+
+/* The server initiates every disconnect */
+static int disconnect_all(const char *phase)
+{
+	struct timespec start, end;
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!opts.dst_addr) {
+		accepting = 0;
+		for (i = 0; i < connections; i++) {
+			if (!nodes[i].connected)
+				continue;
+
+			nodes[i].connected = 0;
+			fi_shutdown(nodes[i].ep, 0);
+		}
+	}
+
+	ret = shutdown_events();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!ret)
+		printf("cmatose: %s: disconnected in %.3f ms\n", phase,
+			get_elapsed(&start, &end, MICRO) / 1000.0);
+	return ret;
+}
+
+/*
+ * Each churn round tears down every node, domain included, and connects
+ * them all again.  RSS is reported against the same baseline as the
+ * first connect, so growth across rounds points at leaked resources.
+ */
+static int churn(void)
+{
+	char phase[32];
+	int r, i, ret;
+
+	for (r = 1; r <= rounds; r++) {
+		for (i = 0; i < connections; i++)
+			destroy_node(&nodes[i]);
+		conn_index = 0;
+
+		if (opts.dst_addr) {
+			for (i = 0; i < connections; i++) {
+				ret = init_node(&nodes[i], fi);
+				if (ret)
+					return ret;
+			}
+		}
+
+		snprintf(phase, sizeof phase, "round %d", r);
+		ret = connect_all(phase);
+		if (ret)
+			return ret;
+
+		ret = disconnect_all(phase);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 static int run_server(void)
 {
 	int i, ret;
@@ -402,7 +563,7 @@ static int run_server(void)
 		goto out;
 	}
 
-	ret = connect_events();
+	ret = connect_all("connect");
 	if (ret)
 		goto out;
 
@@ -428,16 +589,10 @@ static int run_server(void)
 	}
 
 	printf("cmatose: disconnecting\n");
-	for (i = 0; i < connections; i++) {
-		if (!nodes[i].connected)
-			continue;
-
-		nodes[i].connected = 0;
-		fi_shutdown(nodes[i].ep, 0);
-	}
-
-	ret = shutdown_events();
+	ret = disconnect_all("connect");
  	printf("disconnected\n");
+	if (!ret)
+		ret = churn();
 
 out:
 	FT_CLOSE_FID(pep);
@@ -451,16 +606,7 @@ static int run_client(void)
 	printf("cmatose: starting client\n");
 
 	printf("cmatose: connecting\n");
-	for (i = 0; i < connections; i++) {
-		ret = fi_connect(nodes[i].ep, fi->dest_addr, NULL, 0);
-		if (ret) {
-			FT_PRINTERR("fi_connect", ret);
-			connects_left--;
-			return ret;
-		}
-	}
-
-	ret = connect_events();
+	ret = connect_all("connect");
 	if (ret)
 		goto disc;
 
@@ -487,10 +633,12 @@ static int run_client(void)
 
 	ret = 0;
 disc:
-	ret2 = shutdown_events();
+	ret2 = disconnect_all("connect");
  	printf("disconnected\n");
 	if (ret2)
 		ret = ret2;
+	if (!ret)
+		ret = churn();
 	return ret;
 }
 
@@ -500,6 +648,8 @@ static void usage(char *progname)
 	FT_PRINT_OPTS_USAGE("-c <connections>", "# of connections");
 	FT_PRINT_OPTS_USAGE("-C <message_count>", "Message count");
 	FT_PRINT_OPTS_USAGE("-S <message_size>", "Message size");
+	FT_PRINT_OPTS_USAGE("-w <window>", "connects in flight (default all)");
+	FT_PRINT_OPTS_USAGE("-r <rounds>", "disconnect/reconnect churn rounds");
 	exit(1);
 }
 
@@ -525,7 +675,7 @@ int main(int argc, char **argv)
 	hints->tx_attr->size = 10;
 	hints->rx_attr->size = 10;
 
-	while ((op = getopt(argc, argv, "c:C:S:h" ADDR_OPTS INFO_OPTS)) != -1) {
+	while ((op = getopt(argc, argv, "c:C:S:w:r:h" ADDR_OPTS INFO_OPTS)) != -1) {
 		switch (op) {
 		case 'c':
 			connections = atoi(optarg);
@@ -537,6 +687,12 @@ int main(int argc, char **argv)
 		case 'S':
 			hints->ep_attr->max_msg_size = atoi(optarg);
 			break;
+		case 'w':
+			connect_window = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
 		default:
 			ft_parse_addr_opts(op, optarg, &opts);
 			ft_parseinfo(op, optarg, hints);
@@ -550,7 +706,12 @@ int main(int argc, char **argv)
 	if (optind < argc)
 		opts.dst_addr = argv[optind];
 
-	connects_left = connections;
+	if (connect_window <= 0 || connect_window > connections)
+		connect_window = connections;
+
+	pending = calloc(connections, sizeof *pending);
+	if (!pending)
+		exit(1);
 
 	ret = ft_read_addr_opts(&node, &service, hints, &flags, &opts);
 	if (ret)
@@ -567,6 +728,7 @@ int main(int argc, char **argv)
 	if (ret)
 		goto out;
 
+	rss_base = ft_rss();
 	if (alloc_nodes())
 		goto out;
 
@@ -576,6 +738,7 @@ int main(int argc, char **argv)
 	destroy_nodes();
 
 out:
+	free(pending);
 	ft_free_res();
 	return -ret;
 }
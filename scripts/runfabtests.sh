@@ -98,6 +98,7 @@ simple_tests=(
 	"rdm_tagged_peek"
 	"scalable_ep"
 	"cmatose"
+	"cmatose -c 32 -w 8 -r 2"
 	"rdm_shared_av"
 )
 
@@ -110,6 +111,12 @@ short_tests=(
 	"rma_bw -e rdm -o write -I 5"
 	"rma_bw -e rdm -o read -I 5"
 	"rma_bw -e rdm -o writedata -I 5"
+	"rma_pingpong -e msg -o write -I 5"
+	"rma_pingpong -e msg -o read -I 5"
+	"rma_pingpong -e msg -o writedata -I 5"
+	"rma_pingpong -e rdm -o write -I 5"
+	"rma_pingpong -e rdm -o read -I 5"
+	"rma_pingpong -e rdm -o writedata -I 5"
 	"msg_rma -o write -I 5"
 	"msg_rma -o read -I 5"
 	"msg_rma -o writedata -I 5"
@@ -134,28 +141,60 @@ standard_tests=(
 	"msg_pingpong -P"
 	"msg_pingpong -P -v"
 	"msg_bw"
+	"msg_bw -L"
 	"rma_bw -e msg -o write"
 	"rma_bw -e msg -o read"
 	"rma_bw -e msg -o writedata"
 	"rma_bw -e rdm -o write"
 	"rma_bw -e rdm -o read"
 	"rma_bw -e rdm -o writedata"
+	"rma_pingpong -e msg -o write"
+	"rma_pingpong -e msg -o read"
+	"rma_pingpong -e msg -o writedata"
+	"rma_pingpong -e rdm -o write"
+	"rma_pingpong -e rdm -o read"
+	"rma_pingpong -e rdm -o writedata"
 	"msg_rma -o write"
 	"msg_rma -o read"
 	"msg_rma -o writedata"
 	"msg_stream"
 	"rdm_atomic -o all -I 1000"
+	"rdm_atomic -o sum -W 64 -I 1000"
 	"rdm_cntr_pingpong"
 	"rdm_multi_recv"
+	"rdm_multi_recv -M 1,2,8 -B 65536,0 -T 0,16384 -I 1000"
 	"rdm_pingpong"
 	"rdm_pingpong -v"
 	"rdm_pingpong -P"
 	"rdm_pingpong -P -v"
+	"rdm_loaded_pingpong -I 1000 -U 0,50,100"
+	"rdm_open_loop -I 10000 -R 10000,100000"
+	"rdm_open_loop -I 10000 -R 10000,100000 -A poisson"
+	"rdm_open_loop -I 10000 -R 10000,100000 -A burst"
+	"rdm_pipelined_pingpong -I 100 -Q 64"
+	"rdm_contended_atomic -I 1000 -N 4"
+	"rdm_contended_atomic -I 1000 -N 4 -K 16"
+	"rdm_gups -T 16"
+	"rdm_gups -T 16 -B 64 -W 16"
+	"rdm_pointer_chase -I 1000 -M 1048576"
+	"rdm_kv_lookup -I 1000"
+	"rdm_rma_ring"
+	"rdm_rma_notify"
+	"rdm_triggered_chain -I 100"
+	"rdm_rma_iov -I 100"
+	"rdm_sendv -I 100"
+	"rdm_tag_match -Q 256"
+	"rdm_unexpected -I 100"
+	"rdm_tagged_probe -Q 64"
+	"rdm_sep_scaling -C 4 -I 1000"
+	"msg_shared_ctx -E 4,64 -C 0,2 -I 1000"
+	"rdm_multi_domain -D 1,2 -E 1,8 -I 1000"
 	"rdm_rma -o write"
 	"rdm_rma -o read"
 	"rdm_rma -o writedata"
 	"rdm_tagged_pingpong"
 	"rdm_tagged_bw"
+	"rdm_tagged_bw -q"
 	"dgram_pingpong"
 	"dgram_pingpong -v"
 	"dgram_pingpong -P"
@@ -163,6 +202,11 @@ standard_tests=(
 	"rc_pingpong"
 )
 
+# standard benchmarks that run in a single process
+standard_local_tests=(
+	"ep_churn -I 1000"
+)
+
 unit_tests=(
 	"av_test -d GOOD_ADDR -n 1 -s SERVER_ADDR"
 	"dom_test -n 2"
@@ -460,6 +504,10 @@ function main {
 			for test in "${standard_tests[@]}"; do
 				cs_test "$test"
 			done
+
+			for test in "${standard_local_tests[@]}"; do
+				unit_test "$test" "0"
+			done
 		;;
 		complex)
 			for test in "${complex_tests[@]}"; do
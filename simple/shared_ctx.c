@@ -189,10 +189,10 @@ static int run_test()
 	for (i = 0; i < ep_cnt; i++) {
 		if (rx_shared_ctx) {
 			fprintf(stdout, "Posting recv #%d for shared rx ctx\n", i);
-			ret = ft_post_rx(srx_ctx, rx_size, &rx_ctx_arr[i]);
+			ret = ft_post_rx(srx_ctx, rx_size, &rx_ctx_arr[i].context);
 		 } else {
 			fprintf(stdout, "Posting recv for endpoint #%d\n", i);
-			ret = ft_post_rx(ep_array[i], rx_size, &rx_ctx_arr[i]);
+			ret = ft_post_rx(ep_array[i], rx_size, &rx_ctx_arr[i].context);
 		 }
 		if (ret)
 			return ret;
@@ -205,7 +205,8 @@ static int run_test()
 				fprintf(stdout, "Posting send #%d to shared tx ctx\n", i);
 			else
 				fprintf(stdout, "Posting send to endpoint #%d\n", i);
-			ret = ft_tx(ep_array[i], addr_array[i], tx_size, &tx_ctx_arr[i]);
+			ret = ft_tx(ep_array[i], addr_array[i], tx_size,
+				    &tx_ctx_arr[i].context);
 			if (ret)
 				return ret;
 		}
@@ -223,7 +224,8 @@ static int run_test()
 				fprintf(stdout, "Posting send #%d to shared tx ctx\n", i);
 			else
 				fprintf(stdout, "Posting send to endpoint #%d\n", i);
-			ret = ft_tx(ep_array[i], addr_array[i], tx_size, &tx_ctx_arr[i]);
+			ret = ft_tx(ep_array[i], addr_array[i], tx_size,
+				    &tx_ctx_arr[i].context);
 			if (ret)
 				return ret;
 		}
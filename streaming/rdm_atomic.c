@@ -67,6 +67,14 @@ static struct fi_context fi_ctx_atomic;
 static enum fi_datatype datatype;
 static size_t *count;
 static int run_all_ops = 1;
+static int window;
+static struct fi_context *ctx_arr;
+
+enum atomic_kind {
+	ATOMIC_BASE,
+	ATOMIC_FETCH,
+	ATOMIC_COMPARE,
+};
 
 static enum fi_op get_fi_op(char *op) {
 	if (!strcmp(op, "min"))
@@ -227,13 +235,101 @@ static int execute_compare_atomic_op(enum fi_op op)
 	return ret;
 }
 
-static void report_perf()
+static ssize_t post_atomic(enum atomic_kind kind, enum fi_op op, size_t cnt,
+			   struct fi_context *ctx)
+{
+	switch (kind) {
+	case ATOMIC_BASE:
+		return fi_atomic(ep, buf, cnt, fi_mr_desc(mr), remote_fi_addr,
+				remote.addr, remote.key, datatype, op, ctx);
+	case ATOMIC_FETCH:
+		return fi_fetch_atomic(ep, buf, cnt, fi_mr_desc(mr), result,
+				fi_mr_desc(mr_result), remote_fi_addr,
+				remote.addr, remote.key, datatype, op, ctx);
+	default:
+		return fi_compare_atomic(ep, buf, cnt, fi_mr_desc(mr), compare,
+				fi_mr_desc(mr_compare), result,
+				fi_mr_desc(mr_result), remote_fi_addr,
+				remote.addr, remote.key, datatype, op, ctx);
+	}
+}
+
+/* Keep up to window atomics outstanding, then wait for all of them */
+static int execute_atomic_window(enum atomic_kind kind, enum fi_op op,
+				 size_t cnt)
+{
+	ssize_t ret;
+	int j;
+
+	for (j = 0; j < window; j++) {
+		while ((ret = post_atomic(kind, op, cnt, &ctx_arr[j])) ==
+		       -FI_EAGAIN) {
+			if (tx_cq_cntr == tx_seq)
+				continue;
+			ret = ft_get_tx_comp(tx_cq_cntr + 1);
+			if (ret)
+				return (int) ret;
+		}
+		if (ret) {
+			FT_PRINTERR("fi_atomic", ret);
+			return (int) ret;
+		}
+		tx_seq++;
+	}
+
+	return ft_get_tx_comp(tx_seq);
+}
+
+static void report_perf(int iters)
 {
 	if (opts.machr)
-		show_perf_mr(opts.transfer_size, opts.iterations, &start, &end, 1, opts.argc,
+		show_perf_mr(opts.transfer_size, iters, &start, &end, 1, opts.argc,
 			opts.argv);
 	else
-		show_perf(test_name, opts.transfer_size, opts.iterations, &start, &end, 1);
+		show_perf(test_name, opts.transfer_size, iters, &start, &end, 1);
+}
+
+/*
+ * Throughput with window atomics outstanding, sweeping the element count
+ * by powers of two up to the provider limit returned by the atomicvalid
+ * call.  Results are reported per atomic call: MB/sec counts the operand
+ * bytes and Mxfers/sec is millions of atomic operations per second.
+ */
+static int run_atomic_bw(enum atomic_kind kind, enum fi_op op,
+			 const char *suffix)
+{
+	size_t dt_size = datatype_to_size(datatype);
+	size_t max_cnt, cnt;
+	int ret = 0, i, len, iters;
+
+	max_cnt = MIN(*count, (tx_size - ft_tx_prefix_size()) / dt_size);
+	for (cnt = 1; cnt <= max_cnt; cnt = cnt < max_cnt ?
+	     MIN(cnt * 2, max_cnt) : cnt + 1) {
+		len = snprintf(test_name, sizeof(test_name), "%s_",
+			fi_tostr(&datatype, FI_TYPE_ATOMIC_TYPE));
+		snprintf(test_name + len, sizeof(test_name) - len, "%s_%s_bw",
+			fi_tostr(&op, FI_TYPE_ATOMIC_OP), suffix);
+		opts.transfer_size = cnt * dt_size;
+		init_test(&opts, test_name, sizeof(test_name));
+		iters = MAX(opts.iterations / window, 1) * window;
+
+		ret = ft_sync();
+		if (ret)
+			break;
+
+		ft_start();
+		for (i = 0; i < iters; i += window) {
+			ret = execute_atomic_window(kind, op, cnt);
+			if (ret)
+				break;
+		}
+		ft_stop();
+		if (ret)
+			break;
+		report_perf(iters);
+	}
+
+	return ret;
 }
 
 static int run_op(void)
@@ -241,6 +337,8 @@ static int run_op(void)
 	int ret, i, len;
 
 	count = (size_t *) malloc(sizeof(size_t));
+	if (!count)
+		return -FI_ENOMEM;
 	ft_sync();
 
 	switch (op_type) {
@@ -274,7 +372,13 @@ static int run_op(void)
 					break;
 			}
 			ft_stop();
-			report_perf();
+			report_perf(opts.iterations);
+
+			if (window) {
+				ret = run_atomic_bw(ATOMIC_BASE, op_type, "base");
+				if (ret)
+					goto out;
+			}
 		}
 	case FI_ATOMIC_READ:
 		for (datatype = 0; datatype <= FI_LONG_DOUBLE_COMPLEX; datatype++) {
@@ -296,7 +400,13 @@ static int run_op(void)
 					break;
 			}
 			ft_stop();
-			report_perf();
+			report_perf(opts.iterations);
+
+			if (window) {
+				ret = run_atomic_bw(ATOMIC_FETCH, op_type, "fetch");
+				if (ret)
+					goto out;
+			}
 		}
 		break;
 	case FI_CSWAP:
@@ -325,7 +435,13 @@ static int run_op(void)
 					break;
 			}
 			ft_stop();
-			report_perf();
+			report_perf(opts.iterations);
+
+			if (window) {
+				ret = run_atomic_bw(ATOMIC_COMPARE, op_type, "compare");
+				if (ret)
+					goto out;
+			}
 		}
 		break;
 	default:
@@ -364,6 +480,8 @@ static void free_res(void)
 {
 	FT_CLOSE_FID(mr_result);
 	FT_CLOSE_FID(mr_compare);
+	free(ctx_arr);
+	ctx_arr = NULL;
 	if (result) {
 		free(result);
 		result = NULL;
@@ -405,6 +523,14 @@ static int alloc_ep_res(struct fi_info *fi)
 		return -1;
 	}
 
+	if (window) {
+		ctx_arr = calloc(window, sizeof *ctx_arr);
+		if (!ctx_arr) {
+			perror("calloc");
+			return -1;
+		}
+	}
+
 	// registers local data buffer buff that specifies
 	// the first operand of the atomic operation
 	ret = fi_mr_reg(domain, buf, buf_size,
@@ -496,8 +622,15 @@ int main(int argc, char **argv)
 	if (!hints)
 		return EXIT_FAILURE;
 
-	while ((op = getopt(argc, argv, "ho:" CS_OPTS INFO_OPTS)) != -1) {
+	while ((op = getopt(argc, argv, "ho:W:" CS_OPTS INFO_OPTS)) != -1) {
 		switch (op) {
+		case 'W':
+			window = atoi(optarg);
+			if (window < 1) {
+				fprintf(stderr, "Invalid window size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'o':
 			if (!strncasecmp("all", optarg, 3)) {
 				run_all_ops = 1;
@@ -525,6 +658,10 @@ int main(int argc, char **argv)
 			FT_PRINT_OPTS_USAGE("", "land|bor|band|lxor|bxor|read|write|cswap|cswap_ne|"
 					"cswap_le|cswap_lt|");
 			FT_PRINT_OPTS_USAGE("", "cswap_ge|cswap_gt|mswap (default: all)]");
+			FT_PRINT_OPTS_USAGE("-W <window>", "also measure throughput with "
+					"window atomics outstanding,");
+			FT_PRINT_OPTS_USAGE("", "sweeping the element count up to "
+					"the provider limit");
 			return EXIT_FAILURE;
 		}
 	}
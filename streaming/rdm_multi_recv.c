@@ -34,12 +34,14 @@
 #include <time.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
 #include <rdma/fi_endpoint.h>
 #include <rdma/fi_cm.h>
 #include <shared.h>
+#include "../benchmarks/benchmark_shared.h"
 
 // MULTI_BUF_SIZE_FACTOR defines how large the multi recv buffer will be.
 // The minimum value of the factor is 2 which will set the multi recv buffer
@@ -49,9 +51,73 @@
 #define MULTI_BUF_SIZE_FACTOR 4
 #define DEFAULT_MULTI_BUF_SIZE (1024 * 1024)
 
+#define MR_MAX_LIST 16
+#define MR_MAX_SEGS 64
+#define MR_MAX_POSTED 4096
+
+enum mr_mode {
+	MR_MULTI,
+	MR_POSTED,
+	MR_MODE_MAX
+};
+
+static const char *mr_mode_str[] = {
+	[MR_MULTI] = "multi",
+	[MR_POSTED] = "posted",
+};
+
 static struct fid_mr *mr_multi_recv;
-struct fi_context ctx_multi_recv[2];
+static struct fi_context buf_ctx[MR_MAX_POSTED];
+
+/*
+ * Sweep lists.  A segment size of 0 selects the historical default of two
+ * halves of MULTI_BUF_SIZE_FACTOR buffers, a threshold of 0 selects tx_size.
+ */
+static int seg_cnts[MR_MAX_LIST] = { 2 }, seg_cnt_cnt = 1;
+static int seg_sizes[MR_MAX_LIST] = { 0 }, seg_size_cnt = 1;
+static int thresholds[MR_MAX_LIST] = { 0 }, threshold_cnt = 1;
+static int mode_mask = (1 << MR_MODE_MAX) - 1;
+
+/* Receive buffers currently posted by the server */
+static enum mr_mode cur_mode = MR_MULTI;
+static size_t cur_len;
+static int cur_bufs, posted;
+
+/* Times every posted buffer had been consumed before a repost */
+static uint64_t dry;
+static void *last_buf;
 
+static size_t default_seg_size(void)
+{
+	return MAX(tx_size, DEFAULT_MULTI_BUF_SIZE) * MULTI_BUF_SIZE_FACTOR / 2;
+}
+
+static int post_buf(int i)
+{
+	struct iovec iov;
+	struct fi_msg msg;
+	void *desc = fi_mr_desc(mr_multi_recv);
+	int ret;
+
+	iov.iov_base = (char *) rx_buf + cur_len * i;
+	iov.iov_len = cur_len;
+
+	msg.msg_iov = &iov;
+	msg.desc = &desc;
+	msg.iov_count = 1;
+	msg.addr = 0;
+	msg.context = &buf_ctx[i];
+	msg.data = 0;
+
+	/* Explicit flags override the FI_MULTI_RECV rx op_flags default */
+	ret = fi_recvmsg(ep, &msg, cur_mode == MR_MULTI ? FI_MULTI_RECV : 0);
+	if (ret) {
+		FT_PRINTERR("fi_recvmsg", ret);
+		return ret;
+	}
+	posted++;
+	return 0;
+}
 
 int wait_for_recv_completion(int num_completions)
 {
@@ -63,25 +129,117 @@ int wait_for_recv_completion(int num_completions)
 		if (ret == -FI_EAGAIN)
 			continue;
 
+		if (ret == -FI_EAVAIL)
+			return ft_cq_readerr(rxcq);
+
 		if (ret < 0) {
 			FT_PRINTERR("fi_cq_read", ret);
 			return ret;
 		}
 
-		if (comp.len)
+		/*
+		 * comp.buf is only defined for multi recv completions, where
+		 * it locates the message inside the buffer.  A posted buffer
+		 * holds a single message at its start.
+		 */
+		i = (struct fi_context *) comp.op_context - buf_ctx;
+		if (comp.len) {
 			num_completions--;
+			last_buf = cur_mode == MR_MULTI ? comp.buf :
+				   (char *) rx_buf + cur_len * i;
+		}
+
+		/*
+		 * A multi recv buffer is released once less than the minimum
+		 * threshold remains, a posted buffer after every message.
+		 */
+		if (cur_mode == MR_POSTED || (comp.flags & FI_MULTI_RECV)) {
+			if (--posted == 0)
+				dry++;
+
+			ret = post_buf(i);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static int cancel_bufs(void)
+{
+	struct fi_cq_data_entry comp;
+	struct fi_cq_err_entry err;
+	int i, ret;
+
+	for (i = 0; i < cur_bufs; i++) {
+		ret = fi_cancel(&ep->fid, &buf_ctx[i]);
+		if (ret) {
+			FT_PRINTERR("fi_cancel", ret);
+			return ret;
+		}
+	}
 
-		if (comp.flags & FI_MULTI_RECV) {
-			i = (comp.op_context == &ctx_multi_recv[0]) ? 0 : 1;
+	while (posted > 0) {
+		ret = fi_cq_read(rxcq, &comp, 1);
+		if (ret == -FI_EAGAIN)
+			continue;
 
-			ret = fi_recv(ep, rx_buf + (rx_size / 2) * i,
-					rx_size / 2, fi_mr_desc(mr_multi_recv),
-					0, &ctx_multi_recv[i]);
-			if (ret) {
-				FT_PRINTERR("fi_recv", ret);
+		if (ret == -FI_EAVAIL) {
+			ret = fi_cq_readerr(rxcq, &err, 0);
+			if (ret < 0) {
+				FT_PRINTERR("fi_cq_readerr", ret);
 				return ret;
 			}
+			if (err.err != FI_ECANCELED) {
+				FT_CQ_ERR(rxcq, err, NULL, 0);
+				return -err.err;
+			}
+			posted--;
+			continue;
 		}
+
+		if (ret < 0) {
+			FT_PRINTERR("fi_cq_read", ret);
+			return ret;
+		}
+
+		if (cur_mode == MR_POSTED || (comp.flags & FI_MULTI_RECV))
+			posted--;
+	}
+	return 0;
+}
+
+/*
+ * Replace the posted receive buffers.  Multi recv posts bufs segments of
+ * len bytes; posted mode carves bufs receives of len bytes each.
+ */
+static int post_bufs(enum mr_mode mode, int bufs, size_t len, size_t min)
+{
+	int ret, i;
+
+	if (posted) {
+		ret = cancel_bufs();
+		if (ret)
+			return ret;
+	}
+
+	cur_mode = mode;
+	cur_bufs = bufs;
+	cur_len = len;
+
+	if (mode == MR_MULTI) {
+		ret = fi_setopt(&ep->fid, FI_OPT_ENDPOINT, FI_OPT_MIN_MULTI_RECV,
+				&min, sizeof(min));
+		if (ret) {
+			FT_PRINTERR("fi_setopt", ret);
+			return ret;
+		}
+	}
+
+	for (i = 0; i < bufs; i++) {
+		ret = post_buf(i);
+		if (ret)
+			return ret;
 	}
 	return 0;
 }
@@ -104,53 +262,156 @@ static int sync_test(void)
  */
 static int post_multi_recv_buffer()
 {
+	return post_bufs(MR_MULTI, 2, default_seg_size(), tx_size);
+}
+
+static void show_header(void)
+{
+	printf("%-8s %5s %9s %9s %10s %9s %10s %8s %10s\n", "mode", "bufs",
+		"buf_size", "min_mr", "footprint", "Mmsg/s", "MB/s", "dry",
+		"tx_eagain");
+}
+
+static void show_result(size_t min, uint64_t eagain)
+{
+	char len_str[FT_STR_LEN], min_str[FT_STR_LEN], fp_str[FT_STR_LEN];
+	int64_t usec;
+
+	if (opts.machr) {
+		show_perf_mr(opts.transfer_size, opts.iterations,
+			&start, &end, 1, opts.argc, opts.argv);
+		return;
+	}
+
+	usec = get_elapsed(&start, &end, MICRO);
+	printf("%-8s %5d %9s %9s %10s %9.3f %10.2f %8" PRIu64 " %10" PRIu64
+		"\n", mr_mode_str[cur_mode], cur_bufs,
+		size_str(len_str, cur_len),
+		cur_mode == MR_MULTI ? size_str(min_str, min) : "-",
+		size_str(fp_str, cur_len * cur_bufs),
+		(double) opts.iterations / usec,
+		(double) opts.iterations * opts.transfer_size / usec,
+		dry, eagain);
+}
+
+/*
+ * The server reposts its buffers for the configuration and releases the
+ * client, which streams a window at a time and then reports how often
+ * its sends were refused with -FI_EAGAIN.
+ */
+static int run_config(enum mr_mode mode, int bufs, size_t len, size_t min,
+		      struct fi_context *tx_win)
+{
+	uint64_t eagain;
 	int ret, i;
 
-	for (i = 0; i < 2; i++) {
-		ret = fi_recv(ep, rx_buf + (rx_size / 2) * i,
-				rx_size / 2, fi_mr_desc(mr_multi_recv),
-				0, &ctx_multi_recv[i]);
-		if (ret) {
-			FT_PRINTERR("fi_recv", ret);
+	if (opts.dst_addr) {
+		ret = wait_for_recv_completion(1);
+		if (ret)
 			return ret;
+
+		ft_start();
+		for (i = 0; i < opts.iterations; i++) {
+			ret = ft_post_tx(ep, remote_fi_addr, opts.transfer_size,
+					 &tx_win[i % opts.window_size]);
+			if (ret)
+				return ret;
+
+			if ((i + 1) % opts.window_size == 0 ||
+			    i + 1 == opts.iterations) {
+				ret = ft_get_tx_comp(tx_seq);
+				if (ret)
+					return ret;
+			}
 		}
+		ft_stop();
+
+		eagain = queue_stats.eagain[FT_POST_OP_TX];
+		memcpy(tx_buf, &eagain, sizeof eagain);
+		return ft_tx(ep, remote_fi_addr, sizeof eagain, &tx_ctx);
 	}
 
+	ret = post_bufs(mode, bufs, len, min);
+	if (ret)
+		return ret;
+
+	dry = 0;
+	ft_start();
+	ret = ft_tx(ep, remote_fi_addr, 1, &tx_ctx);
+	if (ret)
+		return ret;
+
+	ret = wait_for_recv_completion(opts.iterations);
+	if (ret)
+		return ret;
+	ft_stop();
+
+	ret = wait_for_recv_completion(1);
+	if (ret)
+		return ret;
+
+	memcpy(&eagain, last_buf, sizeof eagain);
+	show_result(min, eagain);
 	return 0;
 }
 
 static int run_test(void)
 {
-	int ret, i;
+	struct fi_context *tx_win;
+	size_t len, min, bufs;
+	int ret, m, c, s, t;
 
 	ret = sync_test();
 	if (ret) {
 		fprintf(stderr, "sync_test failed!\n");
-		goto out;
+		return ret;
 	}
 
-	ft_start();
-	if (opts.dst_addr) {
-		for (i = 0; i < opts.iterations; i++) {
-			ret = ft_tx(ep, remote_fi_addr, opts.transfer_size, &tx_ctx);
-			if (ret)
-				goto out;
+	tx_win = calloc(opts.window_size, sizeof *tx_win);
+	if (!tx_win)
+		return -FI_ENOMEM;
+
+	if (!opts.dst_addr && !opts.machr)
+		show_header();
+
+	for (m = 0; m < MR_MODE_MAX; m++) {
+		if (!(mode_mask & (1 << m)))
+			continue;
+
+		for (c = 0; c < seg_cnt_cnt; c++) {
+			for (s = 0; s < seg_size_cnt; s++) {
+				len = seg_sizes[s] ? seg_sizes[s] : default_seg_size();
+				if (len < tx_size)
+					continue;
+
+				/* Same memory budget, one receive per message */
+				if (m == MR_POSTED) {
+					bufs = MIN(seg_cnts[c] * len / tx_size,
+						   fi->rx_attr->size);
+					bufs = MIN(bufs, MR_MAX_POSTED);
+					ret = run_config(m, bufs, tx_size, 0,
+							 tx_win);
+					if (ret)
+						goto out;
+					continue;
+				}
+
+				for (t = 0; t < threshold_cnt; t++) {
+					min = thresholds[t] ? thresholds[t] : tx_size;
+					if (min > len)
+						continue;
+
+					ret = run_config(m, seg_cnts[c], len,
+							 min, tx_win);
+					if (ret)
+						goto out;
+				}
+			}
 		}
-	} else {
-		ret = wait_for_recv_completion(opts.iterations);
-		if (ret)
-			goto out;
 	}
-	ft_stop();
-
-	if (opts.machr)
-		show_perf_mr(opts.transfer_size, opts.iterations,
-			&start, &end, 1, opts.argc, opts.argv);
-	else
-		show_perf(test_name, opts.transfer_size, opts.iterations,
-			&start, &end, 1);
 
 out:
+	free(tx_win);
 	return ret;
 }
 
@@ -169,7 +430,8 @@ static void free_res(void)
 
 static int alloc_ep_res(struct fi_info *fi)
 {
-	int ret;
+	size_t len;
+	int ret, i, j;
 
 	tx_size = MAX(FT_MAX_CTRL_MSG, opts.transfer_size);
 	if (tx_size > fi->ep_attr->max_msg_size) {
@@ -178,6 +440,16 @@ static int alloc_ep_res(struct fi_info *fi)
 		return -1;
 	}
 
+	/* A threshold below the message size lets a message overrun it */
+	for (i = 0; i < threshold_cnt; i++) {
+		if (thresholds[i] && (size_t) thresholds[i] < tx_size) {
+			fprintf(stderr, "threshold %d is smaller than the "
+					"transfer size %zu\n", thresholds[i],
+					tx_size);
+			return -FI_EINVAL;
+		}
+	}
+
 	tx_buf = malloc(tx_size);
 	if (!tx_buf) {
 		fprintf(stderr, "Cannot allocate tx_buf\n");
@@ -192,7 +464,13 @@ static int alloc_ep_res(struct fi_info *fi)
 	}
 
 	// set the multi buffer size to be allocated
-	rx_size = MAX(tx_size, DEFAULT_MULTI_BUF_SIZE) * MULTI_BUF_SIZE_FACTOR;
+	rx_size = default_seg_size() * 2;
+	for (i = 0; i < seg_cnt_cnt; i++) {
+		for (j = 0; j < seg_size_cnt; j++) {
+			len = seg_sizes[j] ? seg_sizes[j] : default_seg_size();
+			rx_size = MAX(rx_size, len * seg_cnts[i]);
+		}
+	}
 	rx_buf = malloc(rx_size);
 	if (!rx_buf) {
 		fprintf(stderr, "Cannot allocate rx_buf\n");
@@ -239,11 +517,6 @@ static int init_fabric(void)
 	if (ret)
 		return ret;
 
-	ret = fi_setopt(&ep->fid, FI_OPT_ENDPOINT, FI_OPT_MIN_MULTI_RECV,
-			&tx_size, sizeof(tx_size));
-	if (ret)
-		return ret;
-
 	ret = post_multi_recv_buffer();
 	return ret;
 }
@@ -273,7 +546,7 @@ static int init_av(void)
 		if (ret)
 			return ret;
 
-		ret = ft_av_insert(av, rx_buf, 1, &remote_fi_addr, 0, NULL);
+		ret = ft_av_insert(av, last_buf, 1, &remote_fi_addr, 0, NULL);
 		if (ret)
 			return ret;
 	}
@@ -312,15 +585,56 @@ int main(int argc, char **argv)
 	if (!hints)
 		return EXIT_FAILURE;
 
-	while ((op = getopt(argc, argv, "h" CS_OPTS INFO_OPTS)) != -1) {
+	while ((op = getopt(argc, argv, "hB:M:T:o:" CS_OPTS INFO_OPTS)) != -1) {
 		switch (op) {
 		default:
 			ft_parseinfo(op, optarg, hints);
 			ft_parsecsopts(op, optarg, &opts);
 			break;
+		case 'B':
+			if (ft_parse_int_list(optarg, seg_sizes, &seg_size_cnt,
+					      MR_MAX_LIST, 0, 1 << 30)) {
+				fprintf(stderr, "Invalid buffer sizes: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			if (ft_parse_int_list(optarg, seg_cnts, &seg_cnt_cnt,
+					      MR_MAX_LIST, 1, MR_MAX_SEGS)) {
+				fprintf(stderr, "Invalid buffer counts: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			if (ft_parse_int_list(optarg, thresholds,
+					      &threshold_cnt, MR_MAX_LIST,
+					      0, 1 << 30)) {
+				fprintf(stderr, "Invalid thresholds: %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (ft_parse_mask(optarg, mr_mode_str,
+					  MR_MODE_MAX, &mode_mask)) {
+				fprintf(stderr, "Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case '?':
 		case 'h':
-			ft_csusage(argv[0], "Ping pong client and server using message endpoints.");
+			ft_csusage(argv[0], "Streaming client and server using "
+					"multi recv buffers.");
+			FT_PRINT_OPTS_USAGE("-o <mode>", "multi|posted|all "
+					"(default all)");
+			FT_PRINT_OPTS_USAGE("-M <cnt,...>", "multi recv "
+					"buffers posted (default 2)");
+			FT_PRINT_OPTS_USAGE("-B <size,...>", "multi recv "
+					"buffer size, 0 for default");
+			FT_PRINT_OPTS_USAGE("-T <size,...>", "FI_OPT_MIN_MULTI_RECV "
+					"threshold, 0 for transfer size");
 			return EXIT_FAILURE;
 		}
 	}